@@ -24,31 +24,53 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define APP_FQN L"Zini.Disp"
 
 #define MSG_NOTIFYICON (WM_APP + 1)
+#define MSG_CONFIRM_CHANGE (WM_APP + 2)
+#define MSG_MONITOR_NAMES (WM_APP + 3)
+#define MSG_DEFERRED_INIT (WM_APP + 4)
 #define NOTIF_MENU_EXIT 1
 #define NOTIF_MENU_ABOUT_DISPLAYS 2
 #define NOTIF_MENU_CONFIG_SAVE 3
 #define NOTIF_MENU_SHOW_ALIGN_PATTERN 4
-#define NOTIF_MENU_MONITOR_ORIENTATION_SELECT 0x0000F000
-#define NOTIF_MENU_MONITOR_ORIENTATION_MONITOR 0x000003FF
-#define NOTIF_MENU_MONITOR_ORIENTATION_POSITION 0x00000C00
-#define NOTIF_MENU_CONFIG_SELECT 0x0000E000
-#define NOTIF_MENU_CONFIG_INDEX 0x00001FFF
+#define NOTIF_MENU_SHOW_LAUNCHER 5
+#define NOTIF_MENU_REVERT 6
+// Command IDs from NOTIF_MENU_DYNAMIC_BASE up are allocated from the menu action table
+#define NOTIF_MENU_DYNAMIC_BASE 0x0100
+#define NOTIF_MENU_DYNAMIC_MAX 0xFFFF
 
 #define IPC_APPLY_PRESET 1
+#define IPC_REVERT 2
+#define IPC_METRICS 3
+#define IPC_METRICS_REPLY 4
 #define TIMER_RETRY_TRAY 1
+#define TIMER_AUTO_REVERT 2
+#define TIMER_DISPLAY_CHANGE 3
+#define DISPLAY_CHANGE_DEBOUNCE_MS 500
+#define TIMER_IDLE 4
+#define TIMER_SETTLE 5
+#define TIMER_CONFIG_CHANGE 6
+#define CONFIG_CHANGE_DEBOUNCE_MS 300
+#define HOTKEY_ID_BASE 1
 
 #define UNICODE
 #include <Windows.h>
 
+// Data of a monitor that is only needed when changing settings or showing details
 typedef struct {
-    unsigned int num;
     wchar_t name[CCHDEVICENAME];
     wchar_t friendly_name[64];
+    wchar_t device_id[128];
+    DEVMODE devmode;
+} monitor_info_t;
+
+// Compact record of a monitor for matching, ordering and menus
+typedef struct {
+    unsigned int num;
+    UINT64 id; // Hash of the device ID
     RECT rect;
     POINTL virt_pos;
-    DEVMODE devmode;
+    DWORD orientation;
     BOOL primary;
-    wchar_t device_id[128];
+    monitor_info_t *info;
 } monitor_t;
 
 typedef struct {
@@ -61,6 +83,10 @@ typedef struct {
     size_t preset_name_len;
 } ipc_preset_change_request;
 
+typedef struct {
+    UINT64 reply_hwnd; // Window that gets the metrics text as IPC_METRICS_REPLY
+} ipc_metrics_request;
+
 #include "config.h"
 #include "log.h"
 #include "util.h"
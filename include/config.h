@@ -21,6 +21,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define DEFAULT_CONFIG_NAME L"disp_config.json"
 #define APPDATA_CONFIG_NAME L"config.json"
+#define DEFAULT_IDLE_TIMEOUT_SECONDS 300
+#define MAX_SUBSET_DEVICES 64 // Bits in a device mask
 
 #define DISP_CONFIG_SUCCESS 0
 #define DISP_CONFIG_ERROR_GENERAL -1
@@ -35,19 +37,81 @@ typedef struct {
     int pos_y;
     int width;
     int height;
+    int refresh_rate;      // 0 for any
+    int has_refresh_rate;  // The resolution is applied only for presets that have a refresh rate
 } display_settings_t;
 
+typedef struct apply_plan apply_plan_t;
+
 typedef struct {
     const wchar_t *name;
+    const wchar_t *name_folded; // Case-folded name used for lookups
+    UINT32 name_hash;
+    int next_same_name; // Index of the next preset with the same folded name, -1 if none
     size_t display_count;
-    display_settings_t **display_conf;
-    int applicable;
+    UINT64 display_set_fingerprint; // Order independent hash of the device paths, known without the displays
+    int subset;                     // Applicable whenever its displays are connected, even with others
+    UINT64 device_mask;             // Device table bits of the displays of a subset preset
+    int idx;                        // Position in the presets of the config and in the main thread's preset state
+    // The display entries are parsed again from the file when the preset matches, only their location is kept
+    size_t source_offset; // Byte range of the preset object in the config file
+    size_t source_length;
+    UINT64 source_hash;           // Detects a file that has changed since it was read
+    struct json_t *displays_json; // Display entries of a preset created by disp_config_create_preset, NULL otherwise
 } display_preset_t;
 
+// Evaluated against the current topology, owned by the main thread and indexed like the presets of the config
+typedef struct {
+    display_settings_t **display_conf; // Materialized when the preset matches the current display set
+    int applicable;
+    int preflight;      // PREFLIGHT_* result for the current topology
+    apply_plan_t *plan; // Compiled when the preset matches the current topology, NULL otherwise
+} preset_state_t;
+
+#define HOTKEY_ACTION_APPLY_PRESET 0
+#define HOTKEY_ACTION_SHOW_LAUNCHER 1
+#define HOTKEY_ACTION_REVERT 2
+
+typedef struct {
+    const wchar_t *keys;
+    UINT modifiers;
+    UINT vk;
+    int action;
+    const wchar_t *preset_name;
+    int preset_idx; // Resolved when the config is read, -1 if the preset doesn't exist
+} hotkey_t;
+
+#define RULE_POLICY_PRESET 0
+#define RULE_POLICY_LAST_USED 1
+
+typedef struct {
+    size_t display_count;
+    const wchar_t **displays; // Device paths of the displays that trigger the rule
+    UINT64 fingerprint;       // Order independent hash of the device paths
+    int policy;
+    const wchar_t *preset_name; // Optional for the last used policy
+    int preset_idx;             // Resolved when the config is read, -1 if the preset doesn't exist
+    int priority;
+} display_rule_t;
+
 typedef struct {
     int notify_on_start;
+    int auto_revert_seconds; // 0 disables the confirmation and auto-revert
+    int idle_timeout_seconds; // 0 disables the idle mode
+    int snap_layouts;         // Move the displays of invalid preset layouts next to each other before applying
     size_t preset_count;
     display_preset_t **presets;
+    size_t hotkey_count;
+    hotkey_t *hotkeys;
+    size_t name_index_size;
+    int *name_index; // Open addressing hash table of preset indices, -1 marks an empty slot
+    size_t rule_count;
+    display_rule_t *rules;
+    size_t rule_index_size;
+    int *rule_index; // Open addressing hash table of the highest priority rule of each fingerprint
+    size_t device_count;
+    const wchar_t **devices; // Device paths of the subset presets, the index of a path is its mask bit
+    const wchar_t *source_path; // File the presets were read from, NULL for a new config
     wchar_t error_str[512];
 } app_config_t;
 
@@ -55,17 +119,28 @@ typedef struct {
 #include "app.h"
 
 int disp_config_get_appdata_path(wchar_t **config_path_out);
+int disp_config_get_appdata_file(const wchar_t *file_name, wchar_t **path_out);
 int disp_config_read_file(const wchar_t *path, app_config_t *config);
 int disp_config_save_file(const wchar_t *path, app_config_t *config);
 int disp_config_get_presets(const app_config_t *config,
                             display_preset_t ***presets); // returns count of presets or error
 wchar_t *disp_config_get_err_msg(const app_config_t *config);
-int disp_config_preset_get_display(const display_preset_t *preset, const wchar_t *path,
+wchar_t *disp_config_fold_name(const wchar_t *name); // caller frees the returned string
+int disp_config_get_preset_idx(const app_config_t *config,
+                               const wchar_t *name); // returns preset index or error
+int disp_config_preset_get_display(const display_preset_t *preset, const preset_state_t *state, const wchar_t *path,
                                    display_settings_t **settings); // returns DISP_CONFIG_SUCCESS or error
-int disp_config_preset_matches_current(const display_preset_t *preset, const app_ctx_t *ctx);
+int disp_config_preset_matches_current(const display_preset_t *preset, const preset_state_t *state,
+                                       const app_ctx_t *ctx);
+int disp_config_preset_materialize(const app_config_t *config, const display_preset_t *preset,
+                                   preset_state_t *state); // returns DISP_CONFIG_SUCCESS or error
+void disp_config_preset_state_release(const display_preset_t *preset, preset_state_t *state);
+UINT64 disp_config_device_mask(const app_config_t *config, const app_ctx_t *ctx); // Connected devices of the table
+const display_rule_t *disp_config_find_rule(const app_config_t *config, UINT64 fingerprint); // NULL if none
 int disp_config_exists(const wchar_t *name, app_ctx_t *ctx);
-int disp_config_create_preset(const wchar_t *name, app_ctx_t *ctx);
+int disp_config_create_preset(app_config_t *config, const wchar_t *name, const app_ctx_t *ctx);
 
+published_config_t *disp_config_create_published(void); // Empty config to read into and publish
 void disp_config_destroy(app_config_t *config);
 
 #endif
@@ -0,0 +1,40 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _CONFIG_WATCH_H_
+#define _CONFIG_WATCH_H_
+
+#include <windows.h>
+
+#define CONFIG_WATCH_BUFFER_SIZE 4096
+
+// Overlapped watch of the directory of the config file
+typedef struct {
+    HANDLE dir;
+    OVERLAPPED overlapped; // hEvent is signaled when changes are available
+    wchar_t file_name[MAX_PATH];
+    DWORD buffer[CONFIG_WATCH_BUFFER_SIZE / sizeof(DWORD)]; // FILE_NOTIFY_INFORMATION records are DWORD aligned
+} config_watch_t;
+
+BOOL config_watch_start(config_watch_t *watch, const wchar_t *config_path);
+// Call when overlapped.hEvent is signaled, returns TRUE if the config file was among the changes
+BOOL config_watch_check(config_watch_t *watch);
+void config_watch_stop(config_watch_t *watch);
+
+#endif
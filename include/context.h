@@ -20,23 +20,140 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define _CONTEXT_H_
 
 #include "app.h"
+#include "search.h"
+#include "pattern.h"
+#include "modes.h"
+#include "preflight.h"
+#include "monitor_cache.h"
+#include "util.h"
+#include "trace.h"
+#include "rcu.h"
+#include "reactor.h"
+#include "config_watch.h"
+
+#define RECENT_PRESET_COUNT 16
+#define SNAPSHOT_COUNT 4
 
 typedef struct {
-    HINSTANCE hinstance;
+    int preset_idx;
+    wchar_t *name;
+    BOOL disabled; // Preflight has failed for the current topology
+} tray_menu_preset_t;
+
+typedef struct {
+    wchar_t label[100];
+    DWORD orientation;
+} tray_menu_monitor_t;
+
+#define MENU_ACTION_APPLY_PRESET 1
+#define MENU_ACTION_MONITOR_ORIENTATION 2
+#define MENU_ACTION_CONFIG_POPUP 3
+#define MENU_ACTION_MONITOR_POPUP 4
+#define MENU_ACTION_ORIENTATION_POPUP 5
+#define MENU_ACTION_PRESET_GROUP_POPUP 6
+
+typedef struct {
+    int type;     // MENU_ACTION_*
+    size_t index; // Preset entry, monitor or the first preset entry of a group
+    size_t arg;   // Orientation or the end of a preset group
+} menu_action_t;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    menu_action_t *actions; // Command ID is NOTIF_MENU_DYNAMIC_BASE + index
+} menu_action_table_t;
+
+typedef struct {
+    UINT generation; // Changes whenever the menu contents change
+    size_t preset_count;
+    size_t preset_capacity;
+    tray_menu_preset_t *presets; // Applicable presets
+    size_t monitor_count;
+    size_t monitor_capacity;
+    tray_menu_monitor_t *monitors;
+    BOOL can_revert;
+} tray_menu_model_t;
+
+// Display topology queried by populate_display_data, never modified once published
+typedef struct {
+    rcu_object_t head;
+    size_t monitor_count;
+    monitor_t *monitors;
+    monitor_info_t *monitor_info;
+    size_t *monitor_order;
+    UINT primary_monitor_idx;
+    POINTL min_monitor_pos;
+    virt_size_t display_virtual_size;
+    UINT64 topology_fingerprint;
+    UINT64 display_set_fingerprint;
+} published_topology_t;
+
+// Parsed config file, replaced as a whole when the file is read again and never modified once published
+// The per-topology state of its presets is kept apart in the main thread's preset_states
+typedef struct {
+    rcu_object_t head;
     app_config_t config;
+} published_config_t;
+
+typedef struct {
+    HINSTANCE hinstance;
+    BOOL headless; // No tray icon, windows or dialogs, errors only go to the log and the metrics
+    rcu_domain_t configs;
+    app_config_t *config; // The current published config, other threads use acquire_config()
+    preset_state_t *preset_states; // Indexed like the presets of the current config, main thread only
     wchar_t *config_file_path;
+    FILETIME config_write_time; // Last write time of the config file when it was read
+    config_watch_t config_watch;
+    reactor_t reactor; // Event sources of the main loop besides the window messages
     virt_size_t display_virtual_size;
     HMENU notif_menu;
+    tray_menu_model_t menu_model;
+    UINT notif_menu_generation; // Model generation the tray menu was materialized from
+    menu_action_table_t menu_actions;
     GUID notify_guid;
     UINT tray_creation_retries;
     HWND main_window_hwnd;
+    stage_timer_t startup_timer;
+    BOOL deferred_init_done; // Non-critical initialization has run
+    BOOL idle;               // Rebuildable state has been released after a period of inactivity
+    trace_writer_t trace;    // Display queries and events are recorded here with --record
     BOOL display_update_in_progress;
     HANDLE instance_mutex;
+    rcu_domain_t topologies;
+    // The monitor, position and fingerprint fields are the main thread's view of the current published topology,
+    // other threads use acquire_topology(). While a new topology is being built they refer to its private arrays.
     size_t monitor_count;
-    monitor_t *monitors;
+    size_t monitor_capacity;
+    monitor_t *monitors;         // In enumeration order
+    monitor_info_t *monitor_info; // monitors[i].info points to monitor_info[i]
+    size_t *monitor_order;       // Indices of the monitors from the leftmost to the rightmost
+    monitor_cache_t monitor_cache; // Friendly names of known monitors, persisted in AppData
+    wchar_t *monitor_cache_path;   // NULL if the cache isn't persisted
+    UINT monitor_names_seq;        // Latest friendly name verification pass
     UINT primary_monitor_idx;
     POINTL min_monitor_pos;
+    mode_catalogue_cache_t mode_catalogues; // Enumerated lazily, dropped when the monitor goes away
+    UINT64 topology_fingerprint;
+    UINT64 display_generation;      // Incremented on every display query, the current settings may have changed
+    UINT64 display_set_fingerprint; // Order independent hash of the connected device paths
+    UINT64 rule_fingerprint;        // Display set the rules were last evaluated for
+    preflight_cache_t preflight_cache; // Kept over config reloads, keyed by topology and preset contents
     HFONT align_pattern_font;
+    HBITMAP align_pattern_bitmap;         // Rasterized alignment pattern, NULL when not cached
+    pattern_surface_t align_pattern_surface; // Pixels of the cached bitmap
+    size_t registered_hotkey_count;
+    preset_search_index_t search_index;
+    wchar_t *recent_presets[RECENT_PRESET_COUNT]; // Folded names, most recently used first
+    size_t recent_preset_count;
+    HWND launcher_hwnd;
+    apply_plan_t *snapshots[SNAPSHOT_COUNT]; // Ring of display states captured before applying presets
+    size_t snapshot_next;                    // Ring position of the next snapshot
+    size_t snapshot_count;
+    BOOL auto_revert_pending; // The last change hasn't been confirmed yet
+    LONGLONG settle_start;    // latency_now() when the last change started
+    LONGLONG settle_last;     // latency_now() of the last display change notification after it
+    BOOL confirm_box_open;
 } app_ctx_t;
 
 #endif
\ No newline at end of file
@@ -23,15 +23,40 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define UNICODE
 
 #include "app.h"
+#include "plan.h"
+#include "trace.h"
+
+typedef struct monitor_names_result monitor_names_result_t;
 
 void free_monitors(app_ctx_t *ctx);
+// Other threads take a reference to the current topology or config and drop it with rcu_release()
+const published_topology_t *acquire_topology(app_ctx_t *ctx);
+const published_config_t *acquire_config(app_ctx_t *ctx);
+void publish_config(app_ctx_t *ctx, published_config_t *config); // Main thread only
+void free_configs(app_ctx_t *ctx);
+preset_state_t *get_preset_state(app_ctx_t *ctx, const display_preset_t *preset); // Main thread only
 void populate_display_data(app_ctx_t *ctx);
+void replay_display_data(app_ctx_t *ctx, const trace_monitor_t *monitors, size_t monitor_count);
 BOOL change_display_orientation(app_ctx_t *ctx, monitor_t *mon, BYTE orientation);
 int read_config(app_ctx_t *ctx, BOOL reload);
 void flag_matching_presets(app_ctx_t *ctx);
+void compile_applicable_presets(app_ctx_t *ctx);
+void release_apply_plans(app_ctx_t *ctx);
 void reload(app_ctx_t *ctx);
+void reload_changed_config(app_ctx_t *ctx);
+void watch_config_file(app_ctx_t *ctx);
+void unwatch_config_file(app_ctx_t *ctx);
 void apply_preset(app_ctx_t *ctx, display_preset_t *preset);
 void apply_preset_by_name(app_ctx_t *ctx, const wchar_t *name);
+display_preset_t *first_applicable_preset(app_ctx_t *ctx, int preset_idx); // NULL if none of the chain applies
+display_preset_t *find_applicable_preset(app_ctx_t *ctx, const wchar_t *name);
+apply_plan_t *get_apply_plan(app_ctx_t *ctx, display_preset_t *preset);
 void save_current_config(app_ctx_t *ctx);
+void free_recent_presets(app_ctx_t *ctx);
+void revert_display_changes(app_ctx_t *ctx);
+void free_snapshots(app_ctx_t *ctx);
+void apply_matching_rule(app_ctx_t *ctx);
+display_preset_t *get_rule_preset(app_ctx_t *ctx);
+void apply_monitor_names(app_ctx_t *ctx, monitor_names_result_t *result);
 
 #endif
@@ -0,0 +1,37 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _IDLE_H_
+#define _IDLE_H_
+
+#include "app.h"
+
+typedef struct {
+    SIZE_T private_bytes;
+    SIZE_T working_set;
+    DWORD user_handles;
+    DWORD gdi_handles;
+} memory_usage_t;
+
+void get_memory_usage(memory_usage_t *usage);
+void log_memory_usage(const wchar_t *when);
+void note_activity(app_ctx_t *ctx);
+void enter_idle_mode(app_ctx_t *ctx);
+
+#endif
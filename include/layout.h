@@ -0,0 +1,38 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <windows.h>
+
+// Desktop layout checks of display rectangles in virtual screen coordinates
+// The rectangles are built from the final DEVMODEs, whose size is already swapped for the orientation
+
+#define LAYOUT_VALID 0
+#define LAYOUT_OVERLAP 1      // Two displays cover the same pixels
+#define LAYOUT_DISCONNECTED 2 // The displays don't form one desktop connected by shared edges
+
+int layout_check(const RECT *rects, size_t count); // returns LAYOUT_*
+size_t layout_anchor(const RECT *rects, size_t count); // Index of the display at the origin, or 0
+size_t layout_snap(RECT *rects, size_t count, size_t anchor,
+                   size_t fixed_from); // returns the number of displays moved, the ones from fixed_from stay
+const wchar_t *layout_result_name(int result);
+
+#endif
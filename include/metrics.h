@@ -0,0 +1,64 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <windows.h>
+
+// Process-wide counters and latency histograms, safe to update from any thread
+
+typedef enum {
+    METRIC_RELOADS,           // Display data and config reloads
+    METRIC_DISPLAY_CHANGES,   // WM_DISPLAYCHANGE notifications
+    METRIC_DROPPED_UPDATES,   // Requests ignored because a display update was in progress
+    METRIC_PRESETS_APPLIED,   // Presets applied successfully
+    METRIC_APPLY_FAILURES,    // Presets that failed to apply
+    METRIC_PREFLIGHT_REJECTS, // Presets the driver rejected in the dry run
+    METRIC_REVERTS,           // Reverted display changes
+    METRIC_CONFIG_ERRORS,     // Config files that failed to read
+    METRIC_CONFIG_SAVES,      // Config files saved
+    METRIC_IPC_REQUESTS,      // Requests from other processes
+    METRIC_HOTKEYS,           // Hotkeys pressed
+    METRIC_ERRORS,            // Errors reported with show_error_message
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_ENUMERATION, // populate_display_data
+    METRIC_CONFIG_READ, // Reading and parsing the config file
+    METRIC_RELOAD,      // Whole reload
+    METRIC_MODE_SET,    // A single ChangeDisplaySettingsEx call
+    METRIC_APPLY,       // Executing a plan or a revert
+    METRIC_SETTLE,      // From the start of a change to the last display change notification it caused
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+// Four buckets per power of two microseconds, the last one also collects everything above about 2 minutes
+#define METRIC_BUCKET_COUNT 104
+// Size of the text returned by metrics_format, in bytes
+#define METRICS_TEXT_SIZE 4096
+
+void metric_inc(metric_counter_t counter);
+void metric_record(metric_histogram_t histogram, LONGLONG start, LONGLONG end); // latency_now() ticks
+void metric_since(metric_histogram_t histogram, LONGLONG start);                 // Until now
+void metrics_format(wchar_t *buf, size_t buf_size); // One line per counter and histogram
+void metrics_log(void);                              // Logs metrics_format at info level
+
+#endif
@@ -0,0 +1,68 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MODES_H_
+#define _MODES_H_
+
+#include "app.h"
+
+// Wildcard for the refresh rate and bit depth in mode lookups
+#define MODE_ANY 0
+
+typedef struct {
+    DWORD width; // In the native (landscape) orientation of the display
+    DWORD height;
+    DWORD frequency;
+    DWORD bits_per_pel;
+    DWORD display_flags;
+} display_mode_t;
+
+typedef struct {
+    UINT64 key;       // Packed width, height, frequency and bit depth, 0 marks an empty slot
+    UINT32 mode_idx;  // Best mode for the key
+} mode_index_slot_t;
+
+typedef struct {
+    wchar_t device_id[128];
+    wchar_t name[CCHDEVICENAME]; // GDI device name the modes were enumerated from
+    size_t mode_count;
+    display_mode_t *modes;
+    size_t index_size;
+    mode_index_slot_t *index; // Open addressing hash table, includes wildcard keys
+} mode_catalogue_t;
+
+typedef struct trace_writer trace_writer_t;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    mode_catalogue_t **catalogues;
+    trace_writer_t *trace; // Enumerated mode lists are recorded here, NULL if not recording
+    BOOL replay;           // Only recorded mode lists are used, the displays are never enumerated
+} mode_catalogue_cache_t;
+
+const mode_catalogue_t *mode_catalogue_get(mode_catalogue_cache_t *cache, const monitor_t *monitor);
+const display_mode_t *mode_catalogue_find(const mode_catalogue_t *catalogue, DWORD width, DWORD height,
+                                          DWORD orientation, DWORD frequency, DWORD bits_per_pel);
+void mode_catalogue_add(mode_catalogue_cache_t *cache, const wchar_t *device_id, const wchar_t *name,
+                        const display_mode_t *modes, size_t mode_count); // Recorded modes, ignored if known
+void mode_catalogue_prune(mode_catalogue_cache_t *cache, const monitor_t *monitors, size_t monitor_count);
+void mode_catalogue_cache_destroy(mode_catalogue_cache_t *cache);
+
+#endif
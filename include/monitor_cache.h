@@ -0,0 +1,48 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MONITOR_CACHE_H_
+#define _MONITOR_CACHE_H_
+
+#include <windows.h>
+
+#define MONITOR_CACHE_NAME L"monitors.json"
+
+typedef struct {
+    wchar_t *device_path;
+    wchar_t friendly_name[64]; // Empty if the OS doesn't know a name
+    LUID adapter_id;           // Target the monitor was last seen on
+    UINT32 target_id;
+} monitor_cache_entry_t;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    monitor_cache_entry_t *entries;
+    BOOL dirty; // Changed since it was loaded or saved
+} monitor_cache_t;
+
+BOOL monitor_cache_load(monitor_cache_t *cache, const wchar_t *path);
+BOOL monitor_cache_save(monitor_cache_t *cache, const wchar_t *path);
+const monitor_cache_entry_t *monitor_cache_find(const monitor_cache_t *cache, const wchar_t *device_path);
+void monitor_cache_update(monitor_cache_t *cache, const wchar_t *device_path, const wchar_t *friendly_name,
+                          LUID adapter_id, UINT32 target_id);
+void monitor_cache_destroy(monitor_cache_t *cache);
+
+#endif
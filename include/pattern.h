@@ -0,0 +1,41 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+// The pattern kernel doesn't depend on Windows headers so it can be built and checked on any platform
+#include <stddef.h>
+#include <stdint.h>
+
+#define PATTERN_TILE_SIZE 100
+
+typedef struct {
+    uint32_t *pixels; // Top-down rows of 0x00RRGGBB pixels
+    size_t stride;    // Pixels per row
+    int width;
+    int height;
+} pattern_surface_t;
+
+// Fill the rectangle [x, x + width) × [y, y + height) of the surface with the alignment pattern
+// Tile (row, column) gets color (row + 1 + column) % color_count
+void pattern_fill(const pattern_surface_t *surface, int x, int y, int width, int height, int tile_size,
+                  const uint32_t *colors, size_t color_count);
+
+#endif
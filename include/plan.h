@@ -0,0 +1,40 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+#include "app.h"
+
+typedef struct {
+    wchar_t name[CCHDEVICENAME]; // GDI device name of the matched monitor
+    DWORD changes;               // DM_* fields that differ from the current settings
+    DEVMODE devmode;             // Final settings of the display
+} apply_plan_step_t;
+
+// A preset compiled against the current topology, allocated as a single block
+struct apply_plan {
+    UINT64 topology;         // Topology fingerprint the plan was compiled for
+    UINT64 generation;       // Display query the plan was compiled against, the skipped steps depend on it
+    UINT64 target;           // preflight_target_hash() of the desktop the plan leads to
+    size_t step_count;       // Displays that need a change
+    apply_plan_step_t steps[];
+};
+
+#endif
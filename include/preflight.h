@@ -0,0 +1,51 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _PREFLIGHT_H_
+#define _PREFLIGHT_H_
+
+#include "app.h"
+
+#define PREFLIGHT_UNKNOWN 0
+#define PREFLIGHT_OK 1
+#define PREFLIGHT_FAILED 2
+
+#define PREFLIGHT_FAILED_RETRY_MS 60000 // Failed results are tested again after this
+
+typedef struct {
+    UINT64 topology; // Topology fingerprint, 0 marks an empty slot
+    UINT64 preset;   // Hash of the target settings of every display
+    int result;      // PREFLIGHT_*
+    DWORD tick;      // When the result was stored
+} preflight_entry_t;
+
+typedef struct {
+    size_t count;
+    size_t size;
+    preflight_entry_t *entries; // Open addressing hash table
+} preflight_cache_t;
+
+UINT64 preflight_topology_fingerprint(const monitor_t *monitors, size_t monitor_count);
+const DEVMODE *preflight_target_devmode(const monitor_info_t *info, const apply_plan_t *plan);
+UINT64 preflight_target_hash(const monitor_info_t *monitor_info, size_t monitor_count, const apply_plan_t *plan);
+int preflight_cache_get(const preflight_cache_t *cache, UINT64 topology, UINT64 preset); // returns PREFLIGHT_*
+void preflight_cache_put(preflight_cache_t *cache, UINT64 topology, UINT64 preset, int result);
+void preflight_cache_destroy(preflight_cache_t *cache);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+#include <windows.h>
+
+#define PROBE_DEFAULT_ITERATIONS 20
+
+// Time the display queries and dry run the applicable presets, print the latency percentiles
+// Doesn't change any display settings, returns the process exit code
+int run_probe(const wchar_t *config_path, int iterations);
+
+#endif
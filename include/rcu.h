@@ -0,0 +1,51 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include <windows.h>
+
+// Read-copy-update publication of immutable objects
+// One writer thread publishes new versions, readers on any thread take a reference to the current one without
+// locking. A replaced object is destroyed once its last reader has released it.
+
+typedef struct rcu_object rcu_object_t;
+typedef void (*rcu_destroy_t)(rcu_object_t *object);
+
+// Embedded as the first member of a published object
+struct rcu_object {
+    volatile LONG refs;         // Readers holding the object
+    rcu_destroy_t destroy;
+    rcu_object_t *retired_next; // Only touched by the writer
+};
+
+typedef struct {
+    rcu_object_t *volatile current;
+    volatile LONG acquiring; // Readers between loading current and taking their reference
+    rcu_object_t *retired;   // Replaced objects that may still have readers
+} rcu_domain_t;
+
+void rcu_publish(rcu_domain_t *domain, rcu_object_t *object); // Writer only, retires the previous object
+rcu_object_t *rcu_acquire(rcu_domain_t *domain);              // NULL if nothing has been published
+void rcu_release(rcu_object_t *object);
+void rcu_reclaim(rcu_domain_t *domain);        // Writer only, destroys the retired objects without readers
+void rcu_domain_destroy(rcu_domain_t *domain); // Writer only, once every reader has finished
+
+#endif
@@ -0,0 +1,50 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <windows.h>
+
+// Main loop that waits for window messages and kernel objects at the same time
+// Handlers run on the main thread, so event sources don't need threads of their own
+
+#define REACTOR_MAX_SOURCES (MAXIMUM_WAIT_OBJECTS - 1) // One wait slot is taken by the message queue
+
+typedef void (*reactor_handler_t)(void *data);
+
+typedef struct {
+    reactor_handler_t handler;
+    void *data;
+} reactor_source_t;
+
+typedef struct {
+    size_t count;
+    HANDLE handles[REACTOR_MAX_SOURCES];
+    reactor_source_t sources[REACTOR_MAX_SOURCES];
+} reactor_t;
+
+// Call handler(data) on the main thread whenever handle is signaled
+// Auto-reset events and handles that the handler resets can be added, returns FALSE if the reactor is full
+BOOL reactor_add(reactor_t *reactor, HANDLE handle, reactor_handler_t handler, void *data);
+void reactor_remove(reactor_t *reactor, HANDLE handle);
+// Dispatch messages and events until WM_QUIT, returns its exit code
+int reactor_run(reactor_t *reactor);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include "app.h"
+
+typedef struct {
+    UINT64 trigram;
+    UINT32 offset; // Offset of the posting list in the postings array
+    UINT32 length; // Length of the posting list, 0 marks an empty slot
+} search_trigram_t;
+
+typedef struct {
+    size_t preset_count;
+    display_preset_t **presets; // Borrowed from the config
+    size_t table_size;
+    search_trigram_t *table; // Open addressing hash table of trigrams
+    UINT32 *postings;        // Sorted preset indices of each trigram
+} preset_search_index_t;
+
+void search_index_build(preset_search_index_t *index, const app_config_t *config);
+void search_index_destroy(preset_search_index_t *index);
+// The states are indexed like the presets and rank the applicable ones first
+size_t search_index_query(const preset_search_index_t *index, const preset_state_t *states, const wchar_t *folded_query,
+                          const int *recent, size_t recent_count, int *results,
+                          size_t max_results); // returns the number of results, best match first
+
+#endif
@@ -0,0 +1,87 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include "app.h"
+#include "modes.h"
+
+#define TRACE_MAGIC 0x43525444 // "DTRC"
+#define TRACE_VERSION 2
+// Records start at 8 byte boundaries
+#define TRACE_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+#define TRACE_EVENT_MONITORS 1       // trace_monitors_t followed by the trace_monitor_t records
+#define TRACE_EVENT_DISPLAY_CHANGE 2 // No payload
+#define TRACE_EVENT_COPYDATA 3       // DWORD IPC type followed by the request data
+#define TRACE_EVENT_MODES 4          // trace_modes_t followed by the display_mode_t records
+
+typedef struct {
+    DWORD magic;
+    DWORD version;
+    LONGLONG frequency; // Performance counter ticks per second
+} trace_header_t;
+
+typedef struct {
+    DWORD type;
+    DWORD size;    // Payload size without the padding
+    LONGLONG time; // Performance counter ticks since the recording started
+} trace_record_t;
+
+typedef struct {
+    LONGLONG query_ticks; // Time the display queries took
+    DWORD monitor_count;
+} trace_monitors_t;
+
+typedef struct {
+    RECT rect;
+    BOOL primary;
+    monitor_info_t info;
+} trace_monitor_t;
+
+typedef struct {
+    wchar_t device_id[128];
+    wchar_t name[CCHDEVICENAME]; // GDI device name the modes were enumerated from
+    DWORD mode_count;
+} trace_modes_t;
+
+struct trace_writer {
+    FILE *file; // NULL when not recording
+    LONGLONG start;
+};
+
+typedef struct {
+    BYTE *data;
+    size_t size;
+    size_t pos;
+    LONGLONG frequency;
+} trace_reader_t;
+
+BOOL trace_open(trace_writer_t *trace, const wchar_t *path);
+void trace_write(trace_writer_t *trace, DWORD type, const void *head, DWORD head_size, const void *body,
+                 DWORD body_size);
+void trace_close(trace_writer_t *trace);
+BOOL trace_reader_open(trace_reader_t *reader, const wchar_t *path);
+BOOL trace_next(trace_reader_t *reader, const trace_record_t **record_out, const BYTE **payload_out);
+void trace_rewind(trace_reader_t *reader); // Back to the first record
+void trace_reader_close(trace_reader_t *reader);
+
+#endif
@@ -29,12 +29,19 @@ typedef struct {
     BOOL cancel;
 } preset_dialog_data_t;
 
-void create_tray_menu(app_ctx_t *ctx);
+void update_tray_menu(app_ctx_t *ctx);
+void free_tray_menu(app_ctx_t *ctx);
+void free_align_pattern_cache(app_ctx_t *ctx);
+void release_ui_caches(app_ctx_t *ctx);
 void show_notification_message(app_ctx_t *ctx, STRSAFE_LPCWSTR format, ...);
+void show_error_message(app_ctx_t *ctx, STRSAFE_LPCWSTR format, ...);
 void show_save_dialog(app_ctx_t *ctx, preset_dialog_data_t *data);
 HWND init_main_window(app_ctx_t *ctx);
 int init_virt_desktop_window(app_ctx_t *ctx);
 HWND show_virt_desktop_window(app_ctx_t *ctx);
 int create_tray_icon(app_ctx_t *ctx);
+void run_deferred_init(app_ctx_t *ctx);
+void register_hotkeys(app_ctx_t *ctx);
+void unregister_hotkeys(app_ctx_t *ctx);
 
 #endif
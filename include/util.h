@@ -21,6 +21,21 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <windows.h>
 
+#define HASH_FNV1A64_INIT 14695981039346656037ULL
+
+typedef struct {
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER last; // End of the previous stage
+} stage_timer_t;
+
 void get_error_msg(const int err_code, wchar_t **out_msg);
+wchar_t *mbstowcsdup(const char *src, size_t *dest_sz);          // caller frees the returned string
+const char *wcstombs_alloc(const wchar_t *src, size_t *dest_sz); // caller frees the returned string
+UINT64 hash_fnv1a64(UINT64 hash, const void *data, size_t size); // start with HASH_FNV1A64_INIT
+UINT64 hash_mix64(UINT64 hash);
+UINT64 hash_display_set_add(UINT64 set_hash, const wchar_t *device_path); // start with the display count
+void stage_timer_start(stage_timer_t *timer);
+void stage_timer_log(stage_timer_t *timer, const wchar_t *stage); // Logs the time since the previous stage
 
 #endif
\ No newline at end of file
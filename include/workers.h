@@ -0,0 +1,37 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include <windows.h>
+
+typedef void (*parallel_task_t)(void *data, size_t idx);
+
+// Run task(data, 0) ... task(data, count - 1) on the process thread pool and wait for all of them
+// The tasks must only write to their own slots of data
+void parallel_for(size_t count, parallel_task_t task, void *data);
+
+typedef void (*background_task_t)(void *data);
+
+// Run task(data) on the process thread pool without waiting for it
+// Returns FALSE if the task couldn't be submitted, the caller still owns data then
+BOOL run_in_background(background_task_t task, void *data);
+
+#endif
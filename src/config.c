@@ -18,51 +18,99 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define UNICODE
 #include <shlwapi.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wctype.h>
 #include <Windows.h>
 #include <Strsafe.h>
 #include <shlobj.h>
 #include <jansson.h>
 #include "config.h"
 #include "log.h"
+#include "util.h"
+#include "latency.h"
+#include "metrics.h"
+
+#ifndef MOD_NOREPEAT
+#define MOD_NOREPEAT 0x4000
+#endif
+
+wchar_t *disp_config_fold_name(const wchar_t *name) {
+    // Fold the name case using the invariant locale so that all name lookups use the same matching rules
+    int folded_len = LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_LOWERCASE, name, -1, NULL, 0, NULL, NULL, 0);
+    if (folded_len == 0) {
+        int err = GetLastError();
+        wchar_t *err_msg;
+        get_error_msg(err, &err_msg);
+        log_error(L"Failed to fold preset name: %s (0x%08X)", err_msg, err);
+        LocalFree(err_msg);
+        return NULL;
+    }
+    wchar_t *folded = calloc(folded_len, sizeof(wchar_t));
+    LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_LOWERCASE, name, -1, folded, folded_len, NULL, NULL, 0);
+    return folded;
+}
 
-static wchar_t *mbstowcsdup(const char *src, size_t *dest_sz) {
-    int wbuf_size = mbstowcs(NULL, src, 0);
-    if (wbuf_size < 0) {
-        // TODO: Return NULL instead?
-        log_error(L"wbuf_size query failed");
-        abort();
+static UINT32 hash_preset_name(const wchar_t *folded) {
+    // FNV-1a
+    UINT32 hash = 2166136261u;
+    for (const wchar_t *c = folded; *c != L'\0'; c++) {
+        hash ^= (UINT32) *c;
+        hash *= 16777619u;
     }
-    // Allocate memory
-    // TODO: Don't trust the src size (user controllable)
-    wchar_t *tmp;
-    tmp = calloc(wbuf_size + 1, sizeof(wchar_t));
-    if (mbstowcs(tmp, src, wbuf_size + 1) <= 0) {
-        // TODO: Return NULL instead?
-        log_error(L"mbstowcs failed");
-        abort();
+    return hash;
+}
+
+static int prepare_preset_name(display_preset_t *preset) {
+    preset->name_folded = disp_config_fold_name(preset->name);
+    if (preset->name_folded == NULL) {
+        return DISP_CONFIG_ERROR_GENERAL;
     }
-    if (dest_sz != NULL) {
-        *dest_sz = wbuf_size;
+    preset->name_hash = hash_preset_name(preset->name_folded);
+    preset->next_same_name = -1;
+    return DISP_CONFIG_SUCCESS;
+}
+
+static void name_index_insert(app_config_t *config, int preset_idx) {
+    display_preset_t *preset = config->presets[preset_idx];
+    size_t mask = config->name_index_size - 1;
+    for (size_t slot = preset->name_hash & mask;; slot = (slot + 1) & mask) {
+        int idx = config->name_index[slot];
+        if (idx == -1) {
+            config->name_index[slot] = preset_idx;
+            return;
+        }
+        display_preset_t *other = config->presets[idx];
+        if (other->name_hash == preset->name_hash && wcscmp(other->name_folded, preset->name_folded) == 0) {
+            // Same name as an existing preset, chain it after the existing ones
+            while (other->next_same_name != -1) {
+                other = config->presets[other->next_same_name];
+            }
+            other->next_same_name = preset_idx;
+            return;
+        }
     }
-    return tmp;
 }
 
-static const char *wcstombs_alloc(const wchar_t *src, size_t *dest_sz) {
-    // Convert (wchar_t *) name to (char *)
-    size_t converted_count = 0;
-    size_t src_sz = wcslen(src) + 1;
-    size_t result_sz = (src_sz * sizeof(char)) * 2; // Each multibyte character is two bytes
-    char *result = calloc(src_sz, result_sz);
-    if (wcstombs_s(&converted_count, result, result_sz, src, _TRUNCATE) != 0) {
-        log_error(L"wcstombs_s failed: 0x%04X", errno);
-        abort();
+static void name_index_build(app_config_t *config, size_t capacity) {
+    // Keep the load factor at or below 1/2
+    size_t size = 16;
+    while (size < capacity * 2) {
+        size *= 2;
+    }
+    free(config->name_index);
+    config->name_index = malloc(size * sizeof(int));
+    config->name_index_size = size;
+    for (size_t i = 0; i < size; i++) {
+        config->name_index[i] = -1;
     }
-    if (dest_sz != NULL) {
-        *dest_sz = converted_count;
+    for (size_t i = 0; i < config->preset_count; i++) {
+        config->presets[i]->next_same_name = -1;
+    }
+    for (size_t i = 0; i < config->preset_count; i++) {
+        name_index_insert(config, (int) i);
     }
-    return result;
 }
 
 static void set_error_info(app_config_t *app_config, const json_error_t *json_err) {
@@ -88,18 +136,63 @@ static void disp_config_preset_destroy(display_preset_t *preset) {
     if (preset == NULL) {
         return;
     }
-    if (preset->display_count > 0) {
-        for (size_t a = 0; a < preset->display_count; a++) {
-            free((wchar_t *) preset->display_conf[a]->device_path);
-            free(preset->display_conf[a]);
-        }
-        free(preset->display_conf);
-    }
+    json_decref(preset->displays_json);
     free((wchar_t *) preset->name);
+    free((wchar_t *) preset->name_folded);
     free(preset);
 }
 
+static json_t *pack_display_settings(const display_settings_t *disp_settings, json_error_t *json_err) {
+    // Display path
+    const char *display_path = wcstombs_alloc(disp_settings->device_path, NULL);
+
+    // Create the JSON object
+    json_t *display_obj = json_pack_ex(
+        json_err, 0, "{s: s, s: i, s: {s: i, s: i}, s: {s: i, s: i}}", "display", display_path, "orientation",
+        disp_settings->orientation, "position", "x", disp_settings->pos_x, "y", disp_settings->pos_y, "resolution",
+        "width", disp_settings->width, "height", disp_settings->height);
+
+    free((char *) display_path);
+
+    if (display_obj && disp_settings->has_refresh_rate) {
+        json_object_set_new(display_obj, "refresh_rate", json_integer(disp_settings->refresh_rate));
+    }
+    return display_obj;
+}
+
+static void disp_config_hotkeys_destroy(app_config_t *config) {
+    for (size_t i = 0; i < config->hotkey_count; i++) {
+        free((wchar_t *) config->hotkeys[i].keys);
+        free((wchar_t *) config->hotkeys[i].preset_name);
+    }
+    free(config->hotkeys);
+    config->hotkeys = NULL;
+    config->hotkey_count = 0;
+}
+
+static void disp_config_rules_destroy(app_config_t *config) {
+    for (size_t i = 0; i < config->rule_count; i++) {
+        display_rule_t *rule = &(config->rules[i]);
+        for (size_t a = 0; a < rule->display_count; a++) {
+            free((wchar_t *) rule->displays[a]);
+        }
+        free(rule->displays);
+        free((wchar_t *) rule->preset_name);
+    }
+    free(config->rules);
+    config->rules = NULL;
+    config->rule_count = 0;
+    free(config->rule_index);
+    config->rule_index = NULL;
+    config->rule_index_size = 0;
+}
+
 void disp_config_destroy(app_config_t *config) {
+    disp_config_hotkeys_destroy(config);
+    disp_config_rules_destroy(config);
+    free(config->name_index);
+    config->name_index = NULL;
+    config->name_index_size = 0;
     if (config->preset_count > 0) {
         if (config->presets == NULL) {
             return;
@@ -110,9 +203,340 @@ void disp_config_destroy(app_config_t *config) {
         }
         free(config->presets);
     }
+    config->presets = NULL;
+    config->preset_count = 0;
+    for (size_t i = 0; i < config->device_count; i++) {
+        free((wchar_t *) config->devices[i]);
+    }
+    free(config->devices);
+    config->devices = NULL;
+    config->device_count = 0;
+    free((wchar_t *) config->source_path);
+    config->source_path = NULL;
 }
 
-int disp_config_get_appdata_path(wchar_t **config_path_out) {
+static int get_device_bit(const app_config_t *config, const wchar_t *device_path) {
+    // Returns the mask bit of the device or -1 if no subset preset uses it
+    for (size_t i = 0; i < config->device_count; i++) {
+        if (wcscmp(config->devices[i], device_path) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+static int add_device_bit(app_config_t *config, const wchar_t *device_path) {
+    // Returns the mask bit of the device, adding it to the table if needed, or -1 if the table is full
+    int bit = get_device_bit(config, device_path);
+    if (bit >= 0) {
+        return bit;
+    }
+    if (config->device_count == MAX_SUBSET_DEVICES) {
+        return -1;
+    }
+    if (config->devices == NULL) {
+        config->devices = calloc(MAX_SUBSET_DEVICES, sizeof(wchar_t *));
+    }
+    config->devices[config->device_count] = wcsdup(device_path);
+    return (int) config->device_count++;
+}
+
+static const struct {
+    const wchar_t *name;
+    UINT vk;
+} hotkey_key_names[] = {
+    {L"Space", VK_SPACE},     {L"Enter", VK_RETURN},   {L"Tab", VK_TAB},       {L"Insert", VK_INSERT},
+    {L"Delete", VK_DELETE},   {L"Home", VK_HOME},      {L"End", VK_END},       {L"PageUp", VK_PRIOR},
+    {L"PageDown", VK_NEXT},   {L"Left", VK_LEFT},      {L"Right", VK_RIGHT},   {L"Up", VK_UP},
+    {L"Down", VK_DOWN},       {L"Pause", VK_PAUSE},    {L"Add", VK_ADD},       {L"Subtract", VK_SUBTRACT},
+    {L"Multiply", VK_MULTIPLY}, {L"Divide", VK_DIVIDE}, {L"Decimal", VK_DECIMAL},
+};
+
+static const char *hotkey_action_names[] = {"apply_preset", "show_launcher", "revert"};
+static const size_t hotkey_action_count = sizeof(hotkey_action_names) / sizeof(hotkey_action_names[0]);
+
+static int parse_hotkey_keys(const wchar_t *keys, UINT *modifiers_out, UINT *vk_out) {
+    // Parse a key combination such as "Ctrl+Alt+1" or "Win+Shift+F5"
+    UINT modifiers = MOD_NOREPEAT;
+    UINT vk = 0;
+
+    wchar_t *keys_copy = _wcsdup(keys);
+    wchar_t *tok_ctx = NULL;
+    wchar_t *tok = wcstok_s(keys_copy, L"+", &tok_ctx);
+    while (tok != NULL) {
+        if (vk != 0) {
+            // The key must be the last element
+            free(keys_copy);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        size_t tok_len = wcslen(tok);
+        if (_wcsicmp(tok, L"Ctrl") == 0 || _wcsicmp(tok, L"Control") == 0) {
+            modifiers |= MOD_CONTROL;
+        } else if (_wcsicmp(tok, L"Alt") == 0) {
+            modifiers |= MOD_ALT;
+        } else if (_wcsicmp(tok, L"Shift") == 0) {
+            modifiers |= MOD_SHIFT;
+        } else if (_wcsicmp(tok, L"Win") == 0) {
+            modifiers |= MOD_WIN;
+        } else if (tok_len == 1 && tok[0] < 0x80 && iswalnum(tok[0])) {
+            // Letters and digits map directly to their virtual key codes
+            vk = towupper(tok[0]);
+        } else if ((tok[0] == L'F' || tok[0] == L'f') && tok_len <= 3 && iswdigit(tok[1]) &&
+                   (tok_len == 2 || iswdigit(tok[2]))) {
+            // Function keys F1-F24
+            int fn = _wtoi(tok + 1);
+            if (fn < 1 || fn > 24) {
+                free(keys_copy);
+                return DISP_CONFIG_ERROR_GENERAL;
+            }
+            vk = VK_F1 + fn - 1;
+        } else if (_wcsnicmp(tok, L"Numpad", 6) == 0 && tok_len == 7 && iswdigit(tok[6])) {
+            vk = VK_NUMPAD0 + (tok[6] - L'0');
+        } else {
+            for (size_t i = 0; i < sizeof(hotkey_key_names) / sizeof(hotkey_key_names[0]); i++) {
+                if (_wcsicmp(tok, hotkey_key_names[i].name) == 0) {
+                    vk = hotkey_key_names[i].vk;
+                    break;
+                }
+            }
+            if (vk == 0) {
+                // Unknown key name
+                free(keys_copy);
+                return DISP_CONFIG_ERROR_GENERAL;
+            }
+        }
+        tok = wcstok_s(NULL, L"+", &tok_ctx);
+    }
+    free(keys_copy);
+
+    if (vk == 0 || modifiers == MOD_NOREPEAT) {
+        // A key and at least one modifier is required
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    *modifiers_out = modifiers;
+    *vk_out = vk;
+    return DISP_CONFIG_SUCCESS;
+}
+
+static int read_hotkeys(json_t *hotkey_arr, app_config_t *app_config) {
+    json_error_t json_err;
+
+    if (!json_is_array(hotkey_arr)) {
+        StringCbPrintf(app_config->error_str, 512, L"Invalid hotkey list type, expected array");
+        log_error(app_config->error_str);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    size_t hotkey_arr_size = json_array_size(hotkey_arr);
+    app_config->hotkeys = calloc(hotkey_arr_size, sizeof(hotkey_t));
+
+    for (size_t i = 0; i < hotkey_arr_size; i++) {
+        json_t *elem = json_array_get(hotkey_arr, i);
+        char *keys_str;
+        char *action_str = "apply_preset";
+        char *preset_str = NULL;
+
+        // Validate and unpack the hotkey entry {"keys": "<str>", "action": "<str>", "preset": "<str>"}
+        if (json_unpack_ex(elem, &json_err, 0, "{s: s, s?: s, s?: s}", "keys", &keys_str, "action", &action_str,
+                           "preset", &preset_str) != 0) {
+            set_error_info(app_config, &json_err);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+
+        hotkey_t *hotkey = &(app_config->hotkeys[i]);
+        // Count the entry right away so that it gets freed on error
+        app_config->hotkey_count++;
+        hotkey->keys = mbstowcsdup(keys_str, NULL);
+        hotkey->preset_idx = -1;
+
+        if (parse_hotkey_keys(hotkey->keys, &(hotkey->modifiers), &(hotkey->vk)) != DISP_CONFIG_SUCCESS) {
+            StringCbPrintf(app_config->error_str, 512, L"Invalid hotkey \"%s\"", hotkey->keys);
+            log_error(app_config->error_str);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+
+        hotkey->action = -1;
+        for (size_t a = 0; a < hotkey_action_count; a++) {
+            if (strcmp(action_str, hotkey_action_names[a]) == 0) {
+                hotkey->action = (int) a;
+                break;
+            }
+        }
+        if (hotkey->action == -1) {
+            const wchar_t *action_wstr = mbstowcsdup(action_str, NULL);
+            StringCbPrintf(app_config->error_str, 512, L"Unknown hotkey action \"%s\"", action_wstr);
+            free((wchar_t *) action_wstr);
+            log_error(app_config->error_str);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        if (hotkey->action == HOTKEY_ACTION_APPLY_PRESET && preset_str == NULL) {
+            StringCbPrintf(app_config->error_str, 512, L"Hotkey \"%s\" is missing the preset name", hotkey->keys);
+            log_error(app_config->error_str);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+
+        if (preset_str != NULL) {
+            hotkey->preset_name = mbstowcsdup(preset_str, NULL);
+        }
+    }
+
+    return DISP_CONFIG_SUCCESS;
+}
+
+static void resolve_hotkeys(app_config_t *app_config) {
+    // Resolve the hotkey targets to preset indices so that a keypress doesn't need a name lookup
+    for (size_t i = 0; i < app_config->hotkey_count; i++) {
+        hotkey_t *hotkey = &(app_config->hotkeys[i]);
+        if (hotkey->preset_name == NULL) {
+            continue;
+        }
+        int idx = disp_config_get_preset_idx(app_config, hotkey->preset_name);
+        if (idx < 0) {
+            log_warning(L"Hotkey \"%s\" refers to an unknown preset \"%s\"", hotkey->keys, hotkey->preset_name);
+            continue;
+        }
+        hotkey->preset_idx = idx;
+    }
+}
+
+static const char *rule_policy_names[] = {"preset", "last_used"};
+static const size_t rule_policy_count = sizeof(rule_policy_names) / sizeof(rule_policy_names[0]);
+
+static int read_rules(json_t *rule_arr, app_config_t *app_config) {
+    json_error_t json_err;
+
+    if (!json_is_array(rule_arr)) {
+        StringCbPrintf(app_config->error_str, 512, L"Invalid rule list type, expected array");
+        log_error(app_config->error_str);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    size_t rule_arr_size = json_array_size(rule_arr);
+    app_config->rules = calloc(rule_arr_size, sizeof(display_rule_t));
+
+    for (size_t i = 0; i < rule_arr_size; i++) {
+        json_t *elem = json_array_get(rule_arr, i);
+        json_t *display_arr;
+        char *preset_str = NULL;
+        char *policy_str = "preset";
+        int priority = 0;
+
+        // Validate and unpack {"displays": [...], "preset": "<str>", "policy": "<str>", "priority": <int>}
+        if (json_unpack_ex(elem, &json_err, 0, "{s: o, s?: s, s?: s, s?: i}", "displays", &display_arr, "preset",
+                           &preset_str, "policy", &policy_str, "priority", &priority) != 0) {
+            set_error_info(app_config, &json_err);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        if (!json_is_array(display_arr) || json_array_size(display_arr) == 0) {
+            StringCbPrintf(app_config->error_str, 512, L"Rule %u needs a non-empty display list", (UINT) i + 1);
+            log_error(app_config->error_str);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+
+        display_rule_t *rule = &(app_config->rules[i]);
+        // Count the entry right away so that it gets freed on error
+        app_config->rule_count++;
+        rule->preset_idx = -1;
+        rule->priority = priority;
+
+        rule->policy = -1;
+        for (size_t a = 0; a < rule_policy_count; a++) {
+            if (strcmp(policy_str, rule_policy_names[a]) == 0) {
+                rule->policy = (int) a;
+                break;
+            }
+        }
+        if (rule->policy == -1) {
+            const wchar_t *policy_wstr = mbstowcsdup(policy_str, NULL);
+            StringCbPrintf(app_config->error_str, 512, L"Unknown rule policy \"%s\"", policy_wstr);
+            free((wchar_t *) policy_wstr);
+            log_error(app_config->error_str);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        if (rule->policy == RULE_POLICY_PRESET && preset_str == NULL) {
+            StringCbPrintf(app_config->error_str, 512, L"Rule %u is missing the preset name", (UINT) i + 1);
+            log_error(app_config->error_str);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        if (preset_str != NULL) {
+            rule->preset_name = mbstowcsdup(preset_str, NULL);
+        }
+
+        size_t display_count = json_array_size(display_arr);
+        rule->displays = calloc(display_count, sizeof(wchar_t *));
+        rule->fingerprint = display_count;
+        for (size_t a = 0; a < display_count; a++) {
+            const char *path_str = json_string_value(json_array_get(display_arr, a));
+            if (path_str == NULL) {
+                StringCbPrintf(app_config->error_str, 512, L"Invalid display of rule %u, expected string",
+                               (UINT) i + 1);
+                log_error(app_config->error_str);
+                return DISP_CONFIG_ERROR_GENERAL;
+            }
+            rule->displays[a] = mbstowcsdup(path_str, NULL);
+            rule->display_count++;
+            rule->fingerprint = hash_display_set_add(rule->fingerprint, rule->displays[a]);
+        }
+    }
+
+    return DISP_CONFIG_SUCCESS;
+}
+
+static void resolve_rules(app_config_t *app_config) {
+    // Resolve the rule presets and index the rules by fingerprint
+    size_t size = 16;
+    while (size < app_config->rule_count * 2) {
+        size *= 2;
+    }
+    app_config->rule_index_size = size;
+    app_config->rule_index = malloc(size * sizeof(int));
+    memset(app_config->rule_index, -1, size * sizeof(int));
+
+    for (size_t i = 0; i < app_config->rule_count; i++) {
+        display_rule_t *rule = &(app_config->rules[i]);
+        if (rule->preset_name != NULL) {
+            rule->preset_idx = disp_config_get_preset_idx(app_config, rule->preset_name);
+            if (rule->preset_idx < 0) {
+                log_warning(L"Rule %u refers to an unknown preset \"%s\"", (UINT) i + 1, rule->preset_name);
+            }
+        }
+
+        // Keep only the highest priority rule of each fingerprint, the first one wins ties
+        size_t mask = size - 1;
+        for (size_t slot = (size_t) hash_mix64(rule->fingerprint) & mask;; slot = (slot + 1) & mask) {
+            int idx = app_config->rule_index[slot];
+            if (idx == -1) {
+                app_config->rule_index[slot] = (int) i;
+                break;
+            }
+            if (app_config->rules[idx].fingerprint == rule->fingerprint) {
+                if (rule->priority > app_config->rules[idx].priority) {
+                    app_config->rule_index[slot] = (int) i;
+                }
+                break;
+            }
+        }
+    }
+}
+
+const display_rule_t *disp_config_find_rule(const app_config_t *config, UINT64 fingerprint) {
+    if (config->rule_index == NULL) {
+        return NULL;
+    }
+    size_t mask = config->rule_index_size - 1;
+    for (size_t slot = (size_t) hash_mix64(fingerprint) & mask; config->rule_index[slot] != -1;
+         slot = (slot + 1) & mask) {
+        const display_rule_t *rule = &(config->rules[config->rule_index[slot]]);
+        if (rule->fingerprint == fingerprint) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+int disp_config_get_appdata_file(const wchar_t *file_name, wchar_t **path_out) {
+    // Path of a file in the AppData folder of the application, the folder is created if needed
     wchar_t conf_path[MAX_PATH] = {0};
 
     // Get local AppData folder path
@@ -148,8 +572,8 @@ int disp_config_get_appdata_path(wchar_t **config_path_out) {
         }
     }
 
-    // Append the config filename
-    if (!PathAppend((wchar_t *) conf_path, APPDATA_CONFIG_NAME)) {
+    // Append the filename
+    if (!PathAppend((wchar_t *) conf_path, file_name)) {
         // Failure
         int err = GetLastError();
         wchar_t *err_msg;
@@ -161,19 +585,161 @@ int disp_config_get_appdata_path(wchar_t **config_path_out) {
     // Copy the path to a dynamically allocated buffer
     // The caller is responsible for freeing the memory
     wchar_t *dyn_config_path = _wcsdup((wchar_t *) conf_path);
-    *config_path_out = dyn_config_path;
+    *path_out = dyn_config_path;
 
     return DISP_CONFIG_SUCCESS;
 }
 
-int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
-    json_t *conf_root;
+int disp_config_get_appdata_path(wchar_t **config_path_out) {
+    return disp_config_get_appdata_file(APPDATA_CONFIG_NAME, config_path_out);
+}
+
+static char *read_file_bytes(const wchar_t *path, size_t offset, size_t *length) {
+    // Reads *length bytes from offset, or the rest of the file if *length is 0
+    // Returns NULL if the file can't be read or is too short, the caller frees the buffer
+    FILE *file = _wfopen(path, L"rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (*length == 0) {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        if (size < 0 || (size_t) size < offset) {
+            fclose(file);
+            return NULL;
+        }
+        *length = (size_t) size - offset;
+    }
+    char *data = malloc(*length + 1);
+    size_t read_count = fseek(file, (long) offset, SEEK_SET) == 0 ? fread(data, 1, *length, file) : 0;
+    fclose(file);
+    if (read_count != *length) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static size_t skip_json_space(const char *text, size_t length, size_t pos) {
+    while (pos < length && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+        pos++;
+    }
+    return pos;
+}
+
+static size_t skip_json_value(const char *text, size_t length, size_t pos) {
+    // Returns the position after the value that starts at pos, the parser has already validated the text
+    int depth = 0;
+    do {
+        if (pos >= length) {
+            return length;
+        }
+        char c = text[pos];
+        if (c == '"') {
+            for (pos++; pos < length && text[pos] != '"'; pos++) {
+                if (text[pos] == '\\') {
+                    pos++;
+                }
+            }
+            pos++;
+        } else if (c == '{' || c == '[') {
+            depth++;
+            pos++;
+        } else if (c == '}' || c == ']') {
+            depth--;
+            pos++;
+        } else if (depth == 0) {
+            // Number or literal
+            while (pos < length && text[pos] != ',' && text[pos] != '}' && text[pos] != ']' &&
+                   skip_json_space(text, length, pos) == pos) {
+                pos++;
+            }
+        } else {
+            pos++;
+        }
+    } while (depth > 0);
+    return pos;
+}
+
+static int index_preset_sources(const char *text, size_t length, app_config_t *app_config) {
+    // Record the byte range of every preset object so that the parsed document doesn't have to be kept
+    // The last "presets" member is the one the parser keeps, escaped member names aren't recognized
+    size_t pos = skip_json_space(text, length, 0);
+    size_t presets_pos = length;
+    if (pos < length && text[pos] == '{') {
+        pos++;
+        while ((pos = skip_json_space(text, length, pos)) < length && text[pos] == '"') {
+            size_t key_pos = pos;
+            pos = skip_json_value(text, length, pos);
+            BOOL is_presets = pos - key_pos == 9 && memcmp(text + key_pos, "\"presets\"", 9) == 0;
+            // Skip the colon
+            pos = skip_json_space(text, length, skip_json_space(text, length, pos) + 1);
+            if (is_presets) {
+                presets_pos = pos;
+            }
+            pos = skip_json_space(text, length, skip_json_value(text, length, pos));
+            if (pos >= length || text[pos] != ',') {
+                break;
+            }
+            pos++;
+        }
+    }
+    if (presets_pos >= length || text[presets_pos] != '[') {
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    pos = presets_pos + 1;
+    for (size_t i = 0; i < app_config->preset_count; i++) {
+        pos = skip_json_space(text, length, pos);
+        if (i > 0) {
+            if (pos >= length || text[pos] != ',') {
+                return DISP_CONFIG_ERROR_GENERAL;
+            }
+            pos = skip_json_space(text, length, pos + 1);
+        }
+        if (pos >= length || text[pos] != '{') {
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        size_t end = skip_json_value(text, length, pos);
+        display_preset_t *preset = app_config->presets[i];
+        preset->source_offset = pos;
+        preset->source_length = end - pos;
+        preset->source_hash = hash_fnv1a64(HASH_FNV1A64_INIT, text + pos, end - pos);
+        pos = end;
+    }
+    return DISP_CONFIG_SUCCESS;
+}
+
+static json_t *load_preset_source(const app_config_t *config, const display_preset_t *preset) {
+    // Parse the preset object again from its byte range of the config file, NULL on error
+    size_t length = preset->source_length;
+    char *text = config->source_path != NULL
+                     ? read_file_bytes(config->source_path, preset->source_offset, &length)
+                     : NULL;
+    if (text == NULL) {
+        log_error(L"Failed to read preset \"%s\" from the config file", preset->name);
+        return NULL;
+    }
+    if (hash_fnv1a64(HASH_FNV1A64_INIT, text, length) != preset->source_hash) {
+        // The file is read again once the change is noticed
+        log_warning(L"The config file has changed since it was read, can't read preset \"%s\"", preset->name);
+        free(text);
+        return NULL;
+    }
     json_error_t json_err;
+    json_t *preset_obj = json_loadb(text, length, 0, &json_err);
+    free(text);
+    if (preset_obj == NULL) {
+        log_error(L"Failed to parse preset \"%s\" from the config file", preset->name);
+    }
+    return preset_obj;
+}
 
-    const char *path = wcstombs_alloc(wpath, NULL);
+static int read_config_text(const char *text, size_t length, app_config_t *app_config) {
+    json_t *conf_root;
+    json_error_t json_err;
 
-    conf_root = json_load_file(path, 0, &json_err);
-    free((char *) path);
+    conf_root = json_loadb(text, length, 0, &json_err);
 
     if (!conf_root) {
         set_error_info(app_config, &json_err);
@@ -182,20 +748,50 @@ int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
 
     // TODO: Use JSON_STRICT when unpacking?
 
-    json_t *app_obj, *disp_presets;
-    // Validate and unpack {"app": ..., "presets": ...}
-    if (json_unpack_ex(conf_root, &json_err, 0, "{s: o, s: o}", "app", &app_obj, "presets", &disp_presets) != 0) {
+    json_t *app_obj, *disp_presets, *rule_arr = NULL;
+    // Validate and unpack {"app": ..., "presets": ..., "rules": ...}
+    if (json_unpack_ex(conf_root, &json_err, 0, "{s: o, s: o, s?: o}", "app", &app_obj, "presets", &disp_presets,
+                       "rules", &rule_arr) != 0) {
         set_error_info(app_config, &json_err);
         json_decref(conf_root);
         return DISP_CONFIG_ERROR_GENERAL;
     }
 
-    // Read app.notify_on_start
-    if (json_unpack_ex(app_obj, &json_err, 0, "{s: b}", "notify_on_start", &(app_config->notify_on_start)) != 0) {
+    // Read app.notify_on_start, app.auto_revert_seconds, app.idle_timeout_seconds, app.snap_layouts and app.hotkeys
+    json_t *hotkey_arr = NULL;
+    app_config->idle_timeout_seconds = DEFAULT_IDLE_TIMEOUT_SECONDS;
+    if (json_unpack_ex(app_obj, &json_err, 0, "{s: b, s?: i, s?: i, s?: b, s?: o}", "notify_on_start",
+                       &(app_config->notify_on_start), "auto_revert_seconds", &(app_config->auto_revert_seconds),
+                       "idle_timeout_seconds", &(app_config->idle_timeout_seconds), "snap_layouts",
+                       &(app_config->snap_layouts), "hotkeys", &hotkey_arr) != 0) {
         set_error_info(app_config, &json_err);
         json_decref(conf_root);
         return DISP_CONFIG_ERROR_GENERAL;
     }
+    if (app_config->auto_revert_seconds < 0) {
+        StringCbPrintf(app_config->error_str, 512, L"Invalid auto_revert_seconds, expected a non-negative integer");
+        log_error(app_config->error_str);
+        json_decref(conf_root);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+    if (app_config->idle_timeout_seconds < 0) {
+        StringCbPrintf(app_config->error_str, 512, L"Invalid idle_timeout_seconds, expected a non-negative integer");
+        log_error(app_config->error_str);
+        json_decref(conf_root);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    if (hotkey_arr != NULL && read_hotkeys(hotkey_arr, app_config) != DISP_CONFIG_SUCCESS) {
+        json_decref(conf_root);
+        disp_config_destroy(app_config);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    if (rule_arr != NULL && read_rules(rule_arr, app_config) != DISP_CONFIG_SUCCESS) {
+        json_decref(conf_root);
+        disp_config_destroy(app_config);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
 
     // Get preset configs
     size_t disp_presets_size = json_array_size(disp_presets);
@@ -205,7 +801,7 @@ int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
 
     for (size_t i = 0; i < disp_presets_size; i++) {
         display_preset_t *preset_entry = calloc(1, sizeof(display_preset_t));
-        preset_entry->applicable = 0;
+        preset_entry->idx = (int) i;
 
         // Parse the preset entry
         json_t *elem = json_array_get(disp_presets, i);
@@ -219,8 +815,9 @@ int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
         json_t *disp_settings;
         char *temp_name;
 
-        // Validate and unpack the preset entry structure {"name": "<str>", "displays": [...]}
-        if (json_unpack_ex(elem, &json_err, 0, "{s: s, s: o}", "name", &temp_name, "displays", &disp_settings) != 0) {
+        // Validate and unpack the preset entry structure {"name": "<str>", "displays": [...], "subset": <bool>}
+        if (json_unpack_ex(elem, &json_err, 0, "{s: s, s: o, s?: b}", "name", &temp_name, "displays", &disp_settings,
+                           "subset", &(preset_entry->subset)) != 0) {
             set_error_info(app_config, &json_err);
             json_decref(conf_root);
             disp_config_destroy(app_config);
@@ -228,6 +825,14 @@ int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
         }
 
         preset_entry->name = mbstowcsdup(temp_name, NULL);
+        // Store the preset right away so that it gets freed on error
+        app_config->presets[i] = preset_entry;
+        if (prepare_preset_name(preset_entry) != DISP_CONFIG_SUCCESS) {
+            StringCbPrintf(app_config->error_str, 512, L"Invalid preset name \"%s\"", preset_entry->name);
+            json_decref(conf_root);
+            disp_config_destroy(app_config);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
 
         // Displays
         if (!json_is_array(disp_settings)) {
@@ -237,53 +842,140 @@ int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
             return DISP_CONFIG_ERROR_GENERAL;
         }
 
+        // Only index the display set here, the entries are materialized when the preset matches
         size_t disp_settings_size = json_array_size(disp_settings);
         preset_entry->display_count = disp_settings_size;
-        preset_entry->display_conf = calloc(disp_settings_size, sizeof(display_settings_t *));
-
+        preset_entry->display_set_fingerprint = disp_settings_size;
         for (size_t a = 0; a < disp_settings_size; a++) {
-            display_settings_t *display_entry = calloc(1, sizeof(display_settings_t));
-
-            json_t *disp_elem = json_array_get(disp_settings, a);
-            if (!json_is_object(disp_elem)) {
-                log_error(L"Invalid display type, expected object");
+            const char *display_path;
+            if (json_unpack_ex(json_array_get(disp_settings, a), &json_err, 0, "{s: s}", "display", &display_path) !=
+                0) {
+                set_error_info(app_config, &json_err);
                 json_decref(conf_root);
                 disp_config_destroy(app_config);
                 return DISP_CONFIG_ERROR_GENERAL;
             }
-
-            // Validate and unpack the display settings
-            char *display_path;
-            int res = json_unpack_ex(disp_elem, &json_err, 0, "{s: s, s: i, s: {s: i, s: i}, s: {s: i, s: i}}",
-                                     "display", &display_path, "orientation", &(display_entry->orientation), "position",
-                                     "x", &(display_entry->pos_x), "y", &(display_entry->pos_y), "resolution", "width",
-                                     &(display_entry->width), "height", &(display_entry->height));
-
-            if (res != 0) {
-                set_error_info(app_config, &json_err);
+            // The fingerprint, the device mask and the layout check count every display once
+            for (size_t b = 0; b < a; b++) {
+                json_t *other = json_object_get(json_array_get(disp_settings, b), "display");
+                if (strcmp(json_string_value(other), display_path) == 0) {
+                    StringCbPrintf(app_config->error_str, 512, L"Preset \"%s\" has display %u more than once",
+                                   preset_entry->name, (UINT) a + 1);
+                    log_error(app_config->error_str);
+                    json_decref(conf_root);
+                    disp_config_destroy(app_config);
+                    return DISP_CONFIG_ERROR_GENERAL;
+                }
+            }
+            const wchar_t *device_path = mbstowcsdup(display_path, NULL);
+            preset_entry->display_set_fingerprint =
+                hash_display_set_add(preset_entry->display_set_fingerprint, device_path);
+            int bit = preset_entry->subset ? add_device_bit(app_config, device_path) : 0;
+            free((wchar_t *) device_path);
+            if (bit < 0) {
+                StringCbPrintf(app_config->error_str, 512, L"The subset presets use more than %d displays",
+                               MAX_SUBSET_DEVICES);
+                log_error(app_config->error_str);
                 json_decref(conf_root);
                 disp_config_destroy(app_config);
                 return DISP_CONFIG_ERROR_GENERAL;
             }
-
-            display_entry->device_path = mbstowcsdup(display_path, NULL);
-
-            preset_entry->display_conf[a] = display_entry;
+            if (preset_entry->subset) {
+                preset_entry->device_mask |= 1ULL << bit;
+            }
         }
-
-        app_config->presets[i] = preset_entry;
     }
 
     json_decref(conf_root);
 
+    name_index_build(app_config, app_config->preset_count);
+    resolve_hotkeys(app_config);
+    resolve_rules(app_config);
+
     return DISP_CONFIG_SUCCESS;
 }
 
+static int read_config_file(const wchar_t *wpath, app_config_t *app_config) {
+    size_t length = 0;
+    char *text = read_file_bytes(wpath, 0, &length);
+    if (text == NULL) {
+        StringCbPrintf(app_config->error_str, 512, L"Unable to read %s", wpath);
+        log_error(app_config->error_str);
+        return DISP_CONFIG_ERROR_IO;
+    }
+
+    // Only the location of each preset is kept, the document is freed once it has been read
+    int ret = read_config_text(text, length, app_config);
+    if (ret == DISP_CONFIG_SUCCESS && index_preset_sources(text, length, app_config) != DISP_CONFIG_SUCCESS) {
+        StringCbPrintf(app_config->error_str, 512, L"Failed to locate the presets in %s", wpath);
+        log_error(app_config->error_str);
+        disp_config_destroy(app_config);
+        ret = DISP_CONFIG_ERROR_GENERAL;
+    }
+    if (ret == DISP_CONFIG_SUCCESS) {
+        app_config->source_path = wcsdup(wpath);
+    }
+    free(text);
+    return ret;
+}
+
+static void destroy_published_config(rcu_object_t *object) {
+    published_config_t *published = (published_config_t *) object;
+    disp_config_destroy(&(published->config));
+    free(published);
+}
+
+published_config_t *disp_config_create_published(void) {
+    published_config_t *published = calloc(1, sizeof(published_config_t));
+    published->head.destroy = destroy_published_config;
+    published->config.idle_timeout_seconds = DEFAULT_IDLE_TIMEOUT_SECONDS; // Written to a new config file
+    return published;
+}
+
+int disp_config_read_file(const wchar_t *wpath, app_config_t *app_config) {
+    LONGLONG start = latency_now();
+    int ret = read_config_file(wpath, app_config);
+    metric_since(METRIC_CONFIG_READ, start);
+    if (ret != DISP_CONFIG_SUCCESS) {
+        metric_inc(METRIC_CONFIG_ERRORS);
+    }
+    return ret;
+}
+
 int disp_config_save_file(const wchar_t *wpath, app_config_t *app_config) {
     json_error_t json_err;
 
+    // Hotkeys
+    json_t *hotkey_arr = json_array();
+
+    for (size_t i = 0; i < app_config->hotkey_count; i++) {
+        hotkey_t *hotkey = &(app_config->hotkeys[i]);
+
+        const char *keys_str = wcstombs_alloc(hotkey->keys, NULL);
+        json_t *hotkey_obj = json_pack_ex(&json_err, 0, "{s: s, s: s}", "keys", keys_str, "action",
+                                          hotkey_action_names[hotkey->action]);
+        free((char *) keys_str);
+
+        if (hotkey_obj != NULL && hotkey->preset_name != NULL) {
+            const char *preset_str = wcstombs_alloc(hotkey->preset_name, NULL);
+            json_object_set_new(hotkey_obj, "preset", json_string(preset_str));
+            free((char *) preset_str);
+        }
+
+        if (!hotkey_obj || json_array_append_new(hotkey_arr, hotkey_obj) != 0) {
+            log_error(L"Failed to pack hotkey");
+            set_error_info(app_config, &json_err);
+            json_decref(hotkey_arr);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+    }
+
     // App settings
-    json_t *app_conf = json_pack_ex(&json_err, 0, "{s: b}", "notify_on_start", app_config->notify_on_start);
+    json_t *app_conf = json_pack_ex(&json_err, 0, "{s: b, s: i, s: i, s: b, s: o}", "notify_on_start",
+                                    app_config->notify_on_start, "auto_revert_seconds",
+                                    app_config->auto_revert_seconds, "idle_timeout_seconds",
+                                    app_config->idle_timeout_seconds, "snap_layouts", app_config->snap_layouts,
+                                    "hotkeys", hotkey_arr);
     if (!app_conf) {
         log_error(L"Failed to pack app settings");
         set_error_info(app_config, &json_err);
@@ -296,41 +988,23 @@ int disp_config_save_file(const wchar_t *wpath, app_config_t *app_config) {
     for (size_t i = 0; i < app_config->preset_count; i++) {
         display_preset_t *preset = app_config->presets[i];
 
-        // Display JSON array
-        json_t *display_arr = json_array();
-
-        // Displays
-        for (size_t a = 0; a < preset->display_count; a++) {
-            display_settings_t *disp_settings = preset->display_conf[a];
-
-            // Display path
-            const char *display_path = wcstombs_alloc(disp_settings->device_path, NULL);
-
-            // Create the JSON object
-            json_t *display_obj = json_pack_ex(
-                &json_err, 0, "{s: s, s: i, s: {s: i, s: i}, s: {s: i, s: i}}", "display", display_path, "orientation",
-                disp_settings->orientation, "position", "x", disp_settings->pos_x, "y", disp_settings->pos_y,
-                "resolution", "width", disp_settings->width, "height", disp_settings->height);
-
-            free((char *) display_path);
-
-            if (!display_obj) {
-                log_error(L"Failed to pack display settings");
-                set_error_info(app_config, &json_err);
-                json_decref(display_arr);
-                json_decref(preset_arr);
-                json_decref(app_conf);
-                return DISP_CONFIG_ERROR_GENERAL;
-            }
-
-            // Add the display to the display array
-            if (json_array_append_new(display_arr, display_obj) != 0) {
-                log_error(L"Failed to append to display array");
-                json_decref(display_arr);
+        // The display entries are written back as they were read
+        json_t *display_arr = preset->displays_json;
+        if (display_arr == NULL) {
+            json_t *preset_obj = load_preset_source(app_config, preset);
+            display_arr = json_object_get(preset_obj, "displays");
+            if (display_arr == NULL) {
+                StringCbPrintf(app_config->error_str, 512, L"Failed to read preset \"%s\" from the config file",
+                               preset->name);
+                json_decref(preset_obj);
                 json_decref(preset_arr);
                 json_decref(app_conf);
                 return DISP_CONFIG_ERROR_GENERAL;
             }
+            json_incref(display_arr);
+            json_decref(preset_obj);
+        } else {
+            json_incref(display_arr);
         }
 
         // Name
@@ -340,6 +1014,10 @@ int disp_config_save_file(const wchar_t *wpath, app_config_t *app_config) {
         json_t *preset_entry = json_pack_ex(&json_err, 0, "{s: s, s: o}", "name", name_str, "displays", display_arr);
         free((char *) name_str);
 
+        if (preset_entry && preset->subset) {
+            json_object_set_new(preset_entry, "subset", json_true());
+        }
+
         if (!preset_entry) {
             log_error(L"Failed to pack preset entry");
             set_error_info(app_config, &json_err);
@@ -368,6 +1046,35 @@ int disp_config_save_file(const wchar_t *wpath, app_config_t *app_config) {
         return DISP_CONFIG_ERROR_GENERAL;
     }
 
+    // Rules
+    if (app_config->rule_count > 0) {
+        json_t *rule_arr = json_array();
+        for (size_t i = 0; i < app_config->rule_count; i++) {
+            display_rule_t *rule = &(app_config->rules[i]);
+            json_t *display_arr = json_array();
+            for (size_t a = 0; a < rule->display_count; a++) {
+                const char *display_path = wcstombs_alloc(rule->displays[a], NULL);
+                json_array_append_new(display_arr, json_string(display_path));
+                free((char *) display_path);
+            }
+            json_t *rule_obj = json_pack_ex(&json_err, 0, "{s: o, s: s, s: i}", "displays", display_arr, "policy",
+                                            rule_policy_names[rule->policy], "priority", rule->priority);
+            if (rule_obj != NULL && rule->preset_name != NULL) {
+                const char *preset_str = wcstombs_alloc(rule->preset_name, NULL);
+                json_object_set_new(rule_obj, "preset", json_string(preset_str));
+                free((char *) preset_str);
+            }
+            if (!rule_obj || json_array_append_new(rule_arr, rule_obj) != 0) {
+                log_error(L"Failed to pack rule");
+                set_error_info(app_config, &json_err);
+                json_decref(rule_arr);
+                json_decref(conf_root);
+                return DISP_CONFIG_ERROR_GENERAL;
+            }
+        }
+        json_object_set_new(conf_root, "rules", rule_arr);
+    }
+
     // Config file path
     const char *path = wcstombs_alloc(wpath, NULL);
 
@@ -378,6 +1085,7 @@ int disp_config_save_file(const wchar_t *wpath, app_config_t *app_config) {
     }
 
     json_decref(conf_root);
+    metric_inc(METRIC_CONFIG_SAVES);
 
     return DISP_CONFIG_SUCCESS;
 }
@@ -392,29 +1100,52 @@ int disp_config_get_presets(const app_config_t *config, display_preset_t ***pres
     return config->preset_count;
 }
 
-int disp_config_preset_get_display(const display_preset_t *preset, const wchar_t *path, display_settings_t **settings) {
+int disp_config_preset_get_display(const display_preset_t *preset, const preset_state_t *state, const wchar_t *path,
+                                   display_settings_t **settings) {
     // returns DISP_CONFIG_SUCCESS or error
+    if (state->display_conf == NULL) {
+        // Not materialized
+        return DISP_CONFIG_ERROR_NO_ENTRY;
+    }
     for (size_t i = 0; i < preset->display_count; i++) {
-        if (wcscmp(preset->display_conf[i]->device_path, path) != 0) {
+        if (wcscmp(state->display_conf[i]->device_path, path) != 0) {
             continue;
         }
         // Match
         // TODO: Can this null check fail? settings is probably uninitialized
         if (settings != NULL) {
-            *settings = preset->display_conf[i];
+            *settings = state->display_conf[i];
         }
         return DISP_CONFIG_SUCCESS;
     }
     return DISP_CONFIG_ERROR_NO_ENTRY;
 }
 
-int disp_config_preset_matches_current(const display_preset_t *preset, const app_ctx_t *ctx) {
+int disp_config_preset_matches_current(const display_preset_t *preset, const preset_state_t *state,
+                                       const app_ctx_t *ctx) {
     // Check that the current monitor setup contains all the needed displays
+    if (state->display_conf == NULL) {
+        return DISP_CONFIG_ERROR_NO_MATCH;
+    }
+    if (preset->subset) {
+        // Other displays may be connected too
+        for (size_t i = 0; i < preset->display_count; i++) {
+            BOOL connected = FALSE;
+            for (size_t m = 0; m < ctx->monitor_count && !connected; m++) {
+                connected = wcscmp(ctx->monitor_info[m].device_id, state->display_conf[i]->device_path) == 0;
+            }
+            if (!connected) {
+                return DISP_CONFIG_ERROR_NO_MATCH;
+            }
+        }
+        return DISP_CONFIG_SUCCESS;
+    }
     if (ctx->monitor_count != preset->display_count) {
         return DISP_CONFIG_ERROR_NO_MATCH;
     }
     for (size_t i = 0; i < ctx->monitor_count; i++) {
-        if (disp_config_preset_get_display(preset, ctx->monitors[i].device_id, NULL) == DISP_CONFIG_ERROR_NO_ENTRY) {
+        if (disp_config_preset_get_display(preset, state, ctx->monitor_info[i].device_id, NULL) ==
+            DISP_CONFIG_ERROR_NO_ENTRY) {
             // No match
             return DISP_CONFIG_ERROR_NO_MATCH;
         }
@@ -423,73 +1154,185 @@ int disp_config_preset_matches_current(const display_preset_t *preset, const app
     return DISP_CONFIG_SUCCESS;
 }
 
-static int disp_config_get_preset_idx_by_name(const wchar_t *name, app_ctx_t *ctx) {
-    for (size_t i = 0; i < ctx->config.preset_count; i++) {
-        display_preset_t *preset = ctx->config.presets[i];
-        int cmp_res =
-            CompareStringEx(LOCALE_NAME_INVARIANT, NORM_IGNORECASE, name, -1, preset->name, -1, NULL, NULL, 0);
-        if (cmp_res == 0) {
-            // Comparison failed
-            int err = GetLastError();
-            wchar_t *err_msg;
-            get_error_msg(err, &err_msg);
-            log_error(L"Failed to compare preset names: %s (0x%08X)", err_msg, err);
-            LocalFree(err_msg);
+static void free_display_conf(display_settings_t **display_conf, size_t count) {
+    for (size_t a = 0; a < count; a++) {
+        free((wchar_t *) display_conf[a]->device_path);
+        free(display_conf[a]);
+    }
+    free(display_conf);
+}
+
+int disp_config_preset_materialize(const app_config_t *config, const display_preset_t *preset,
+                                   preset_state_t *state) {
+    // Unpack the display entries of the preset into its state, the config file is only indexed when it is read
+    // returns DISP_CONFIG_SUCCESS or error, the preset matches nothing if its entries are invalid
+    if (state->display_conf != NULL) {
+        return DISP_CONFIG_SUCCESS;
+    }
+
+    json_t *preset_obj = NULL;
+    json_t *displays = preset->displays_json;
+    if (displays == NULL) {
+        preset_obj = load_preset_source(config, preset);
+        displays = json_object_get(preset_obj, "displays");
+    }
+    if (displays == NULL || json_array_size(displays) != preset->display_count) {
+        json_decref(preset_obj);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+
+    json_error_t json_err;
+    display_settings_t **display_conf = calloc(preset->display_count, sizeof(display_settings_t *));
+
+    for (size_t a = 0; a < preset->display_count; a++) {
+        display_settings_t *display_entry = calloc(1, sizeof(display_settings_t));
+
+        // Validate and unpack the display settings
+        char *display_path;
+        json_t *refresh_rate = NULL;
+        int res = json_unpack_ex(json_array_get(displays, a), &json_err, 0,
+                                 "{s: s, s: i, s: {s: i, s: i}, s: {s: i, s: i}, s?: o}", "display", &display_path,
+                                 "orientation", &(display_entry->orientation), "position", "x", &(display_entry->pos_x),
+                                 "y", &(display_entry->pos_y), "resolution", "width", &(display_entry->width),
+                                 "height", &(display_entry->height), "refresh_rate", &refresh_rate);
+        if (res == 0 && refresh_rate != NULL) {
+            if (!json_is_integer(refresh_rate) || json_integer_value(refresh_rate) < 0) {
+                log_error(L"Invalid refresh rate of preset \"%s\", expected a non-negative integer", preset->name);
+                res = -1;
+            } else {
+                display_entry->refresh_rate = (int) json_integer_value(refresh_rate);
+                display_entry->has_refresh_rate = 1;
+            }
+        } else if (res != 0) {
+            const wchar_t *err_str = mbstowcsdup((const char *) json_err.text, NULL);
+            log_error(L"Invalid display %u of preset \"%s\": %s", (UINT) a + 1, preset->name, err_str);
+            free((wchar_t *) err_str);
+        }
+
+        if (res != 0) {
+            // The preset stays unmaterialized and matches nothing
+            free(display_entry);
+            free_display_conf(display_conf, a);
+            json_decref(preset_obj);
             return DISP_CONFIG_ERROR_GENERAL;
         }
-        if (cmp_res == CSTR_EQUAL) {
+
+        display_entry->device_path = mbstowcsdup(display_path, NULL);
+        display_conf[a] = display_entry;
+    }
+
+    json_decref(preset_obj);
+    state->display_conf = display_conf;
+    log_trace(L"Materialized preset \"%s\"", preset->name);
+    return DISP_CONFIG_SUCCESS;
+}
+
+void disp_config_preset_state_release(const display_preset_t *preset, preset_state_t *state) {
+    // Free what was built for the current topology, the preset is evaluated again from a clean state
+    if (state->display_conf != NULL) {
+        free_display_conf(state->display_conf, preset->display_count);
+    }
+    free(state->plan);
+    ZeroMemory(state, sizeof(preset_state_t));
+}
+
+UINT64 disp_config_device_mask(const app_config_t *config, const app_ctx_t *ctx) {
+    // Device mask of the connected displays, a subset preset matches if its mask is contained in this
+    UINT64 mask = 0;
+    for (size_t i = 0; i < ctx->monitor_count && config->device_count > 0; i++) {
+        int bit = get_device_bit(config, ctx->monitor_info[i].device_id);
+        if (bit >= 0) {
+            mask |= 1ULL << bit;
+        }
+    }
+    return mask;
+}
+
+int disp_config_get_preset_idx(const app_config_t *config, const wchar_t *name) {
+    // Returns the index of the first preset with the given name (ignoring case) or error
+    if (config->name_index == NULL) {
+        return DISP_CONFIG_ERROR_NO_MATCH;
+    }
+    wchar_t *folded = disp_config_fold_name(name);
+    if (folded == NULL) {
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
+    UINT32 hash = hash_preset_name(folded);
+    size_t mask = config->name_index_size - 1;
+    int ret = DISP_CONFIG_ERROR_NO_MATCH;
+    for (size_t slot = hash & mask; config->name_index[slot] != -1; slot = (slot + 1) & mask) {
+        display_preset_t *preset = config->presets[config->name_index[slot]];
+        if (preset->name_hash == hash && wcscmp(preset->name_folded, folded) == 0) {
             // Match
-            return i;
+            ret = config->name_index[slot];
+            break;
         }
     }
-    return DISP_CONFIG_ERROR_NO_MATCH;
+    free(folded);
+    return ret;
 }
 
 int disp_config_exists(const wchar_t *name, app_ctx_t *ctx) {
     // Check for existing matching preset (ignore preset name case)
-    int ret = disp_config_get_preset_idx_by_name(name, ctx);
+    int ret = disp_config_get_preset_idx(ctx->config, name);
     if (ret < 0) {
         return ret;
     }
     return DISP_CONFIG_SUCCESS;
 }
 
-int disp_config_create_preset(const wchar_t *name, app_ctx_t *ctx) {
+int disp_config_create_preset(app_config_t *config, const wchar_t *name, const app_ctx_t *ctx) {
+    // Adds the current display settings to config, which must not be published yet
     // Get display count
     size_t display_count = ctx->monitor_count;
 
     display_preset_t *preset = calloc(1, sizeof(display_preset_t));
-    display_settings_t *disp_settings;
-    monitor_t cur_monitor;
+    display_settings_t disp_settings = {0};
+    const monitor_t *cur_monitor;
+    json_error_t json_err;
 
     preset->name = wcsdup(name);
+    if (prepare_preset_name(preset) != DISP_CONFIG_SUCCESS) {
+        disp_config_preset_destroy(preset);
+        return DISP_CONFIG_ERROR_GENERAL;
+    }
     preset->display_count = display_count;
-    // Alloc memory for all display settings
-    preset->display_conf = calloc(display_count, sizeof(display_settings_t *));
+    preset->display_set_fingerprint = display_count;
+    // The entries are packed like the ones read from the file, the preset is only saved
+    preset->displays_json = json_array();
 
     for (size_t i = 0; i < display_count; i++) {
-        cur_monitor = ctx->monitors[i];
-        // Alloc memory for display settings for this monitor
-        disp_settings = calloc(1, sizeof(display_settings_t));
-        // Copy path
-        disp_settings->device_path = wcsdup((wchar_t *) cur_monitor.device_id);
-        // Copy other info
-        disp_settings->orientation = cur_monitor.devmode.dmDisplayOrientation;
-        disp_settings->pos_x = cur_monitor.virt_pos.x;
-        disp_settings->pos_y = cur_monitor.virt_pos.y;
-        disp_settings->width = cur_monitor.rect.right - cur_monitor.rect.left;
-        disp_settings->height = cur_monitor.rect.bottom - cur_monitor.rect.top;
-
-        preset->display_conf[i] = disp_settings;
+        // Save the displays from left to right
+        cur_monitor = &(ctx->monitors[ctx->monitor_order[i]]);
+        disp_settings.device_path = cur_monitor->info->device_id;
+        disp_settings.orientation = cur_monitor->orientation;
+        disp_settings.pos_x = cur_monitor->virt_pos.x;
+        disp_settings.pos_y = cur_monitor->virt_pos.y;
+        // The display mode is in physical pixels unlike the monitor rectangle
+        disp_settings.width = cur_monitor->info->devmode.dmPelsWidth;
+        disp_settings.height = cur_monitor->info->devmode.dmPelsHeight;
+        disp_settings.refresh_rate = cur_monitor->info->devmode.dmDisplayFrequency;
+        disp_settings.has_refresh_rate = 1;
+
+        json_t *display_obj = pack_display_settings(&disp_settings, &json_err);
+        if (!display_obj || json_array_append_new(preset->displays_json, display_obj) != 0) {
+            log_error(L"Failed to pack display settings");
+            set_error_info(config, &json_err);
+            disp_config_preset_destroy(preset);
+            return DISP_CONFIG_ERROR_GENERAL;
+        }
+        preset->display_set_fingerprint = hash_display_set_add(preset->display_set_fingerprint,
+                                                               disp_settings.device_path);
     }
 
     // Add to config presets
-    app_config_t *config = &(ctx->config);
-
     // Get the preset index of the possibly existing preset
-    int ext_preset_idx = disp_config_get_preset_idx_by_name(name, ctx);
+    int ext_preset_idx = disp_config_get_preset_idx(config, name);
     if (ext_preset_idx >= 0) {
         log_debug(L"Replacing existing preset");
+        // Keep the new preset in the same name index chain
+        preset->next_same_name = config->presets[ext_preset_idx]->next_same_name;
+        preset->idx = ext_preset_idx;
         // Free the existing preset
         disp_config_preset_destroy(config->presets[ext_preset_idx]);
         // Update the preset array pointer
@@ -506,8 +1349,16 @@ int disp_config_create_preset(const wchar_t *name, app_ctx_t *ctx) {
         }
         config->presets = realloc_ptr;
 
+        preset->idx = (int) config->preset_count;
         config->presets[config->preset_count] = preset;
         config->preset_count = config->preset_count + 1;
+
+        // Add to the name index, growing it if needed
+        if (config->name_index == NULL || config->preset_count * 2 > config->name_index_size) {
+            name_index_build(config, config->preset_count * 2);
+        } else {
+            name_index_insert(config, (int) (config->preset_count - 1));
+        }
     } else {
         // Error
         disp_config_preset_destroy(preset);
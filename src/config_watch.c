@@ -0,0 +1,98 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <shlwapi.h>
+#include <Strsafe.h>
+#include "app.h"
+#include "config_watch.h"
+
+#define CONFIG_WATCH_FILTER (FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME)
+
+static BOOL issue_read(config_watch_t *watch) {
+    // The result is delivered through the event, nothing blocks here
+    if (!ReadDirectoryChangesW(watch->dir, watch->buffer, sizeof(watch->buffer), FALSE, CONFIG_WATCH_FILTER, NULL,
+                               &(watch->overlapped), NULL)) {
+        log_error(L"ReadDirectoryChangesW failed (0x%08X)", GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL config_watch_start(config_watch_t *watch, const wchar_t *config_path) {
+    ZeroMemory(watch, sizeof(config_watch_t));
+    wchar_t full_path[MAX_PATH];
+    if (GetFullPathName(config_path, MAX_PATH, full_path, NULL) == 0) {
+        log_error(L"Could not resolve the config file path (0x%08X)", GetLastError());
+        return FALSE;
+    }
+    StringCchCopy(watch->file_name, MAX_PATH, PathFindFileName(full_path));
+    PathRemoveFileSpec(full_path);
+
+    watch->dir = CreateFile(full_path, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (watch->dir == INVALID_HANDLE_VALUE) {
+        log_error(L"Could not open %s for watching (0x%08X)", full_path, GetLastError());
+        watch->dir = NULL;
+        return FALSE;
+    }
+    watch->overlapped.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (watch->overlapped.hEvent == NULL || !issue_read(watch)) {
+        config_watch_stop(watch);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL config_watch_check(config_watch_t *watch) {
+    DWORD size = 0;
+    if (!GetOverlappedResult(watch->dir, &(watch->overlapped), &size, FALSE)) {
+        log_error(L"Reading config directory changes failed (0x%08X)", GetLastError());
+        issue_read(watch);
+        return FALSE;
+    }
+    // A zero size means that the buffer overflowed, assume that the config file changed
+    BOOL changed = size == 0;
+    const BYTE *record = (const BYTE *) watch->buffer;
+    while (!changed && record != NULL) {
+        const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION *) record;
+        // Editors often save through a temporary file that is renamed over the original
+        changed = CompareStringOrdinal(info->FileName, (int) (info->FileNameLength / sizeof(wchar_t)),
+                                       watch->file_name, -1, TRUE) == CSTR_EQUAL;
+        record = info->NextEntryOffset != 0 ? record + info->NextEntryOffset : NULL;
+    }
+    issue_read(watch);
+    return changed;
+}
+
+void config_watch_stop(config_watch_t *watch) {
+    if (watch->dir != NULL) {
+        CancelIoEx(watch->dir, &(watch->overlapped));
+        if (watch->overlapped.hEvent != NULL) {
+            // The buffer must stay valid until the cancelled read has completed
+            DWORD size;
+            GetOverlappedResult(watch->dir, &(watch->overlapped), &size, TRUE);
+        }
+        CloseHandle(watch->dir);
+    }
+    if (watch->overlapped.hEvent != NULL) {
+        CloseHandle(watch->overlapped.hEvent);
+    }
+    ZeroMemory(watch, sizeof(config_watch_t));
+}
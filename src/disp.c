@@ -36,11 +36,129 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "config.h"
 #include "resource.h"
 #include "log.h"
+#include "util.h"
 #include "ui.h"
+#include "search.h"
+#include "launcher.h"
+#include "preflight.h"
+#include "plan.h"
+#include "workers.h"
+#include "monitor_cache.h"
+#include "latency.h"
+#include "metrics.h"
+#include "layout.h"
+
+static void destroy_published_topology(rcu_object_t *object) {
+    published_topology_t *topology = (published_topology_t *) object;
+    free(topology->monitors);
+    free(topology->monitor_info);
+    free(topology->monitor_order);
+    free(topology);
+}
 
-void free_monitors(app_ctx_t *ctx) {
-    free(ctx->monitors);
+static void reset_topology_view(app_ctx_t *ctx) {
+    // Start building a new topology, the published one stays intact for its readers
     ctx->monitors = NULL;
+    ctx->monitor_info = NULL;
+    ctx->monitor_order = NULL;
+    ctx->monitor_count = 0;
+    ctx->monitor_capacity = 0;
+    ctx->primary_monitor_idx = 0;
+    ctx->min_monitor_pos.x = 0;
+    ctx->min_monitor_pos.y = 0;
+}
+
+static void copy_topology_view(app_ctx_t *ctx) {
+    // Published topologies are never modified, continue on private copies of the arrays
+    size_t count = ctx->monitor_count;
+    monitor_t *monitors = malloc(count * sizeof(monitor_t));
+    monitor_info_t *monitor_info = malloc(count * sizeof(monitor_info_t));
+    size_t *monitor_order = malloc(count * sizeof(size_t));
+    memcpy(monitors, ctx->monitors, count * sizeof(monitor_t));
+    memcpy(monitor_info, ctx->monitor_info, count * sizeof(monitor_info_t));
+    memcpy(monitor_order, ctx->monitor_order, count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        monitors[i].info = &(monitor_info[i]);
+    }
+    ctx->monitors = monitors;
+    ctx->monitor_info = monitor_info;
+    ctx->monitor_order = monitor_order;
+    ctx->monitor_capacity = count;
+}
+
+static void publish_topology(app_ctx_t *ctx) {
+    // The published topology takes over the arrays of the view
+    published_topology_t *topology = calloc(1, sizeof(published_topology_t));
+    topology->head.destroy = destroy_published_topology;
+    topology->monitor_count = ctx->monitor_count;
+    topology->monitors = ctx->monitors;
+    topology->monitor_info = ctx->monitor_info;
+    topology->monitor_order = ctx->monitor_order;
+    topology->primary_monitor_idx = ctx->primary_monitor_idx;
+    topology->min_monitor_pos = ctx->min_monitor_pos;
+    topology->display_virtual_size = ctx->display_virtual_size;
+    topology->topology_fingerprint = ctx->topology_fingerprint;
+    topology->display_set_fingerprint = ctx->display_set_fingerprint;
+    rcu_publish(&(ctx->topologies), &(topology->head));
+}
+
+const published_topology_t *acquire_topology(app_ctx_t *ctx) {
+    return (const published_topology_t *) rcu_acquire(&(ctx->topologies));
+}
+
+static void release_preset_states(app_ctx_t *ctx) {
+    for (size_t i = 0; ctx->preset_states != NULL && i < ctx->config->preset_count; i++) {
+        disp_config_preset_state_release(ctx->config->presets[i], &(ctx->preset_states[i]));
+    }
+    free(ctx->preset_states);
+    ctx->preset_states = NULL;
+}
+
+void publish_config(app_ctx_t *ctx, published_config_t *config) {
+    // The presets of the new config start unmaterialized, not applicable and with an unknown preflight result
+    release_preset_states(ctx);
+    ctx->preset_states = calloc(config->config.preset_count, sizeof(preset_state_t));
+    rcu_publish(&(ctx->configs), &(config->head));
+    ctx->config = &(config->config);
+}
+
+void free_configs(app_ctx_t *ctx) {
+    // Destroys every config, only when no other thread reads them anymore
+    release_preset_states(ctx);
+    rcu_domain_destroy(&(ctx->configs));
+    ctx->config = NULL;
+}
+
+preset_state_t *get_preset_state(app_ctx_t *ctx, const display_preset_t *preset) {
+    return &(ctx->preset_states[preset->idx]);
+}
+
+const published_config_t *acquire_config(app_ctx_t *ctx) {
+    return (const published_config_t *) rcu_acquire(&(ctx->configs));
+}
+
+void free_monitors(app_ctx_t *ctx) {
+    // Destroys every topology, only when no other thread reads them anymore
+    rcu_domain_destroy(&(ctx->topologies));
+    reset_topology_view(ctx);
+}
+
+static UINT64 hash_device_id(const wchar_t *device_id) {
+    return hash_fnv1a64(HASH_FNV1A64_INIT, device_id, wcslen(device_id) * sizeof(wchar_t));
+}
+
+static BOOL get_matching_monitor(app_ctx_t *ctx, const wchar_t *device_id, monitor_t **monitor_out) {
+    // Compare the hashes first so that only the matching monitor's info is touched
+    UINT64 id = hash_device_id(device_id);
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        monitor_t *monitor = &(ctx->monitors[i]);
+        if (monitor->id == id && wcscmp(monitor->info->device_id, device_id) == 0) {
+            // Found
+            *monitor_out = monitor;
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
 static BOOL CALLBACK monitor_enum_proc(HMONITOR mon, HDC hdc_mon, LPRECT lprc_mon, LPARAM dw_data) {
@@ -49,18 +167,78 @@ static BOOL CALLBACK monitor_enum_proc(HMONITOR mon, HDC hdc_mon, LPRECT lprc_mo
     MONITORINFOEX info = {.cbSize = sizeof(MONITORINFOEX)};
     GetMonitorInfo(mon, (LPMONITORINFO) &info);
 
-    StringCchCopy(ctx->monitors[ctx->monitor_count].name, CCHDEVICENAME, info.szDevice);
+    if (ctx->monitor_count == ctx->monitor_capacity) {
+        ctx->monitor_capacity = ctx->monitor_capacity == 0 ? 4 : ctx->monitor_capacity * 2;
+        ctx->monitors = realloc(ctx->monitors, ctx->monitor_capacity * sizeof(monitor_t));
+        ctx->monitor_info = realloc(ctx->monitor_info, ctx->monitor_capacity * sizeof(monitor_info_t));
+    }
+    // The info pointers are set once the arrays don't move anymore
+    ZeroMemory(&(ctx->monitors[ctx->monitor_count]), sizeof(monitor_t));
+    ZeroMemory(&(ctx->monitor_info[ctx->monitor_count]), sizeof(monitor_info_t));
+
+    StringCchCopy(ctx->monitor_info[ctx->monitor_count].name, CCHDEVICENAME, info.szDevice);
     ctx->monitors[ctx->monitor_count].rect = info.rcMonitor;
+    // The primary monitor is on the primary display device
+    ctx->monitors[ctx->monitor_count].primary = (info.dwFlags & MONITORINFOF_PRIMARY) == MONITORINFOF_PRIMARY;
 
     ctx->monitor_count++;
 
     return TRUE;
 }
 
-static int monitor_coordinate_compare(const void *a, const void *b) {
-    monitor_t *a_mon = (monitor_t *) a;
-    monitor_t *b_mon = (monitor_t *) b;
+static void query_monitor_task(void *data, size_t idx) {
+    // Query the current settings and the device ID of one monitor
+    // Runs on the thread pool, only touches its own monitor_t
+    monitor_t *mon = &(((monitor_t *) data)[idx]);
+    monitor_info_t *info = mon->info;
 
+    DEVMODE tmp = {0};
+    tmp.dmSize = sizeof(DEVMODE);
+    EnumDisplaySettings(info->name, ENUM_CURRENT_SETTINGS, &tmp);
+    memcpy(&(info->devmode), &tmp, sizeof(DEVMODE));
+    memcpy(&(mon->virt_pos), &tmp.dmPosition, sizeof(POINTL));
+    mon->orientation = tmp.dmDisplayOrientation;
+
+    // Enumerate the monitors of the display device to get the device ID
+    DISPLAY_DEVICE dd_mon = {0};
+    dd_mon.cb = sizeof(DISPLAY_DEVICE);
+    int dev_mon = 0;
+    while (EnumDisplayDevices(info->name, dev_mon, &dd_mon, EDD_GET_DEVICE_INTERFACE_NAME)) {
+        // Copy the device ID to the monitor info
+        StringCchCopy(info->device_id, 128, dd_mon.DeviceID);
+
+        dev_mon++;
+        ZeroMemory(&dd_mon, sizeof(DISPLAY_DEVICE));
+        dd_mon.cb = sizeof(DISPLAY_DEVICE);
+    }
+    mon->id = hash_device_id(info->device_id);
+}
+
+typedef struct {
+    DISPLAYCONFIG_MODE_INFO *modes;
+    DISPLAYCONFIG_TARGET_DEVICE_NAME *names; // One slot per mode
+    LONG *results;
+} target_name_query_t;
+
+static void query_target_name_task(void *data, size_t idx) {
+    // Query the name of one display target, runs on the thread pool
+    target_name_query_t *query = (target_name_query_t *) data;
+    if (query->modes[idx].infoType != DISPLAYCONFIG_MODE_INFO_TYPE_TARGET) {
+        query->results[idx] = ERROR_NOT_FOUND;
+        return;
+    }
+
+    DISPLAYCONFIG_TARGET_DEVICE_NAME *device_name = &(query->names[idx]);
+    DISPLAYCONFIG_DEVICE_INFO_HEADER header;
+    header.type = DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME;
+    header.size = sizeof(DISPLAYCONFIG_TARGET_DEVICE_NAME);
+    header.id = query->modes[idx].id;
+    header.adapterId = query->modes[idx].adapterId;
+    device_name->header = header;
+    query->results[idx] = DisplayConfigGetDeviceInfo((DISPLAYCONFIG_DEVICE_INFO_HEADER *) device_name);
+}
+
+static int monitor_coordinate_compare(const monitor_t *a_mon, const monitor_t *b_mon) {
     LONG a_x = a_mon->virt_pos.x;
     LONG a_y = a_mon->virt_pos.y;
     LONG b_x = b_mon->virt_pos.x;
@@ -82,112 +260,34 @@ static int monitor_coordinate_compare(const void *a, const void *b) {
     return 1;
 }
 
-void populate_display_data(app_ctx_t *ctx) {
-    int virt_width = GetSystemMetrics(SM_CXVIRTUALSCREEN);
-    int virt_height = GetSystemMetrics(SM_CYVIRTUALSCREEN);
-
-    ctx->display_virtual_size.width = virt_width;
-    ctx->display_virtual_size.height = virt_height;
-
-    // Free monitor data if needed
-    if (ctx->monitors != NULL) {
-        free_monitors(ctx);
-    }
-
-    ctx->monitor_count = 0;
-    // TODO: Reallocate when needed
-    ctx->monitors = calloc(10, sizeof(monitor_t));
-
-    EnumDisplayMonitors(NULL, NULL, monitor_enum_proc, (LPARAM) ctx);
-
-    for (size_t i = 0; i < ctx->monitor_count; i++) {
-        monitor_t mon = ctx->monitors[i];
-        DEVMODE tmp = {0};
-        tmp.dmSize = sizeof(DEVMODE);
-        EnumDisplaySettings(mon.name, ENUM_CURRENT_SETTINGS, &tmp);
-
-        memcpy(&(ctx->monitors[i].devmode), &tmp, sizeof(DEVMODE));
-        memcpy(&(ctx->monitors[i].virt_pos), &tmp.dmPosition, sizeof(POINTL));
-    }
-
-    // Sort monitors by their coordinates so we can number them (the leftmost is 1, etc.)
-    qsort(ctx->monitors, ctx->monitor_count, sizeof(monitor_t), monitor_coordinate_compare);
-    // Number the monitors and find out the smallest coordinates
-    for (size_t i = 0; i < ctx->monitor_count; i++) {
-        monitor_t *mon = &(ctx->monitors[i]);
-        mon->num = i + 1;
-        if (mon->virt_pos.x < ctx->min_monitor_pos.x) {
-            ctx->min_monitor_pos.x = mon->virt_pos.x;
-        }
-        if (mon->virt_pos.y < ctx->min_monitor_pos.y) {
-            ctx->min_monitor_pos.y = mon->virt_pos.y;
-        }
-    }
-
-    // Get GDI and SetupAPI display names so that we can associate correct friendly monitor names
-    DISPLAY_DEVICE dd = {0};
-    dd.cb = sizeof(DISPLAY_DEVICE);
-    int dev = 0;
-    while (EnumDisplayDevices(NULL, dev, &dd, EDD_GET_DEVICE_INTERFACE_NAME)) {
-        DISPLAY_DEVICE dd_mon = {0};
-        dd_mon.cb = sizeof(DISPLAY_DEVICE);
-        int dev_mon = 0;
-
-        if ((dd.StateFlags & DISPLAY_DEVICE_ACTIVE) != DISPLAY_DEVICE_ACTIVE) {
-            // Skip non-active devices
-            ZeroMemory(&dd, sizeof(DISPLAY_DEVICE));
-            dd.cb = sizeof(DISPLAY_DEVICE);
-            dev++;
-            continue;
-        }
-
-        // Find corresponding monitor_t entry
-        int monitor_idx = -1;
-        for (size_t i = 0; i < ctx->monitor_count; i++) {
-            if (wcscmp(ctx->monitors[i].name, dd.DeviceName) != 0) {
-                continue;
-            }
-            monitor_idx = (int) i;
-        }
-        if (monitor_idx == -1) {
-            // No corresponding monitor, skip
-            log_debug(L"No monitor with name of %s", dd.DeviceName);
-            ZeroMemory(&dd, sizeof(DISPLAY_DEVICE));
-            dd.cb = sizeof(DISPLAY_DEVICE);
-            dev++;
-            continue;
-        }
-
-        if ((dd.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE) == DISPLAY_DEVICE_PRIMARY_DEVICE) {
-            // This is the primary display of the system
-            ctx->monitors[monitor_idx].primary = TRUE;
-            ctx->primary_monitor_idx = (UINT) monitor_idx;
-        } else {
-            ctx->monitors[monitor_idx].primary = FALSE;
-        }
-
-        // Enumerate monitors
-        while (EnumDisplayDevices(dd.DeviceName, dev_mon, &dd_mon, EDD_GET_DEVICE_INTERFACE_NAME)) {
-            // Copy the device ID to the monitor_t entry
-            StringCchCopy(ctx->monitors[monitor_idx].device_id, 128, dd_mon.DeviceID);
-
-            dev_mon++;
-            ZeroMemory(&dd_mon, sizeof(DISPLAY_DEVICE));
-            dd_mon.cb = sizeof(DISPLAY_DEVICE);
-        }
-
-        ZeroMemory(&dd, sizeof(DISPLAY_DEVICE));
-        dd.cb = sizeof(DISPLAY_DEVICE);
-        dev++;
-    }
+typedef struct {
+    wchar_t device_path[128];
+    wchar_t friendly_name[64];
+    LUID adapter_id;
+    UINT32 target_id;
+} monitor_name_t;
+
+struct monitor_names_result {
+    HWND hwnd;
+    UINT seq; // Pass that produced the result, only the latest one is applied
+    size_t count;
+    monitor_name_t *names;
+};
+
+static void free_monitor_names_result(monitor_names_result_t *result) {
+    free(result->names);
+    free(result);
+}
 
-    // Get friendly display name
+static BOOL query_monitor_names(monitor_names_result_t *result) {
+    // Get the friendly display names of the active targets
+    // Doesn't touch the app context so that it can run on the thread pool
     UINT32 num_of_paths;
     UINT32 num_of_modes;
     LONG ret = GetDisplayConfigBufferSizes(QDC_ONLY_ACTIVE_PATHS, &num_of_paths, &num_of_modes);
     if (ret != ERROR_SUCCESS) {
         log_error(L"GetDisplayConfigBufferSizes failed: 0x%04X", ret);
-        return;
+        return FALSE;
     }
 
     // Allocate memory
@@ -202,123 +302,348 @@ void populate_display_data(app_ctx_t *ctx) {
         log_error(L"QueryDisplayConfig failed: 0x%04X", ret);
         free(display_paths);
         free(display_modes);
-        return;
+        return FALSE;
     }
 
+    // Query the target names in parallel and collect them in the mode order
+    target_name_query_t query = {0};
+    query.modes = display_modes;
+    query.names = calloc(num_of_modes, sizeof(DISPLAYCONFIG_TARGET_DEVICE_NAME));
+    query.results = calloc(num_of_modes, sizeof(LONG));
+    parallel_for(num_of_modes, query_target_name_task, &query);
+
+    result->names = calloc(num_of_modes, sizeof(monitor_name_t));
+    result->count = 0;
     for (size_t o = 0; o < num_of_modes; o++) {
-        DISPLAYCONFIG_MODE_INFO_TYPE infoType = display_modes[o].infoType;
-        if (infoType != DISPLAYCONFIG_MODE_INFO_TYPE_TARGET) {
+        if (query.results[o] == ERROR_NOT_FOUND) {
+            // Not a target
             continue;
         }
-
-        DISPLAYCONFIG_TARGET_DEVICE_NAME device_name;
-        DISPLAYCONFIG_DEVICE_INFO_HEADER header;
-        header.type = DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME;
-        header.size = sizeof(DISPLAYCONFIG_TARGET_DEVICE_NAME);
-        header.id = display_modes[o].id;
-        header.adapterId = display_modes[o].adapterId;
-        device_name.header = header;
-        ret = DisplayConfigGetDeviceInfo((DISPLAYCONFIG_DEVICE_INFO_HEADER *) &device_name);
-        if (ret != ERROR_SUCCESS) {
-            log_error(L"DisplayConfigGetDeviceInfo failed: 0x%04X", ret);
-            free(display_paths);
-            free(display_modes);
-            return;
-        }
-        // Find corresponding monitor entry and set the friendly name
-        BOOL found_monitor = FALSE;
-        for (size_t i = 0; i < ctx->monitor_count; i++) {
-            if (wcscmp(ctx->monitors[i].device_id, device_name.monitorDevicePath) != 0) {
-                continue;
-            }
-            if (device_name.monitorFriendlyDeviceName == NULL || wcslen(device_name.monitorFriendlyDeviceName) == 0) {
-                // No friendly device name from OS, use numbering
-                StringCbPrintf(ctx->monitors[i].friendly_name, 64, L"Display %u", ctx->monitors[i].num);
-            } else {
-                // Friendly name available, copy it to the monitor entry
-                StringCchCopy(ctx->monitors[i].friendly_name, 64, device_name.monitorFriendlyDeviceName);
-            }
-            found_monitor = TRUE;
+        if (query.results[o] != ERROR_SUCCESS) {
+            log_error(L"DisplayConfigGetDeviceInfo failed: 0x%04X", query.results[o]);
             break;
         }
-        if (!found_monitor) {
-            log_debug(L"No corresponding monitor entry for %s", device_name.monitorDevicePath);
-        }
+        monitor_name_t *name = &(result->names[result->count++]);
+        StringCchCopy(name->device_path, 128, query.names[o].monitorDevicePath);
+        StringCchCopy(name->friendly_name, 64, query.names[o].monitorFriendlyDeviceName);
+        name->adapter_id = display_modes[o].adapterId;
+        name->target_id = display_modes[o].id;
     }
 
+    free(query.names);
+    free(query.results);
     free(display_paths);
     free(display_modes);
+    return TRUE;
 }
 
-int read_config(app_ctx_t *ctx, BOOL reload) {
-    if (reload == TRUE) {
-        // Free previous config
-        log_debug(L"Freeing previous config");
-        disp_config_destroy(&(ctx->config));
+static void query_monitor_names_task(void *data) {
+    monitor_names_result_t *result = (monitor_names_result_t *) data;
+    if (!query_monitor_names(result)) {
+        free_monitor_names_result(result);
+        return;
     }
-    log_info(L"Reading config");
-    if (disp_config_read_file(ctx->config_file_path, &(ctx->config)) != DISP_CONFIG_SUCCESS) {
-        wchar_t err_msg[1024] = {0};
-        StringCbPrintf((wchar_t *) &err_msg, 1024, L"Could not read configuration file:\n%s",
-                       disp_config_get_err_msg(&(ctx->config)));
-        log_error(err_msg);
-        MessageBox(NULL, (wchar_t *) err_msg, APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
-        return 1;
+    // Hand the result over to the main thread
+    if (!PostMessage(result->hwnd, MSG_MONITOR_NAMES, 0, (LPARAM) result)) {
+        // The window is gone
+        free_monitor_names_result(result);
     }
-    return 0;
 }
 
-void flag_matching_presets(app_ctx_t *ctx) {
-    display_preset_t **presets;
-    int preset_count = disp_config_get_presets(&(ctx->config), &presets);
+static BOOL merge_monitor_names(app_ctx_t *ctx, monitor_names_result_t *result) {
+    // Update the monitor cache and the friendly names from a verification pass
+    // Returns TRUE if any of the monitor names changed
+    BOOL changed = FALSE;
+    for (size_t n = 0; n < result->count; n++) {
+        monitor_name_t *name = &(result->names[n]);
+        monitor_cache_update(&(ctx->monitor_cache), name->device_path, name->friendly_name, name->adapter_id,
+                             name->target_id);
 
-    log_trace(L"Got %d presets", preset_count);
+        // Find corresponding monitor entry and set the friendly name
+        monitor_t *mon;
+        if (!get_matching_monitor(ctx, name->device_path, &mon)) {
+            log_debug(L"No corresponding monitor entry for %s", name->device_path);
+            continue;
+        }
+        wchar_t friendly_name[64];
+        if (wcslen(name->friendly_name) == 0) {
+            // No friendly device name from OS, use numbering
+            StringCbPrintf(friendly_name, sizeof(friendly_name), L"Display %u", mon->num);
+        } else {
+            StringCchCopy(friendly_name, 64, name->friendly_name);
+        }
+        if (wcscmp(mon->info->friendly_name, friendly_name) != 0) {
+            StringCchCopy(mon->info->friendly_name, 64, friendly_name);
+            changed = TRUE;
+        }
+    }
 
-    for (int i = 0; i < preset_count; i++) {
-        display_preset_t *preset = presets[i];
+    if (ctx->monitor_cache.dirty && ctx->monitor_cache_path != NULL) {
+        monitor_cache_save(&(ctx->monitor_cache), ctx->monitor_cache_path);
+    }
+    return changed;
+}
 
-        if (disp_config_preset_matches_current(preset, ctx) == DISP_CONFIG_SUCCESS) {
-            log_trace(L"Preset \"%s\" matches with the current monitor setup", preset->name);
-            preset->applicable = 1;
+void apply_monitor_names(app_ctx_t *ctx, monitor_names_result_t *result) {
+    // Called on the main thread when a verification pass has finished
+    if (result->seq != ctx->monitor_names_seq) {
+        // The displays have changed since the pass was started, a newer one is on its way
+        log_debug(L"Dropping stale monitor names from pass %u", result->seq);
+        free_monitor_names_result(result);
+        return;
+    }
+    published_topology_t *published = (published_topology_t *) ctx->topologies.current;
+    copy_topology_view(ctx);
+    if (merge_monitor_names(ctx, result)) {
+        log_debug(L"Monitor names changed, updating the tray menu");
+        publish_topology(ctx);
+        update_tray_menu(ctx);
+    } else {
+        // Nothing changed, go back to the published arrays
+        free(ctx->monitors);
+        free(ctx->monitor_info);
+        free(ctx->monitor_order);
+        ctx->monitors = published->monitors;
+        ctx->monitor_info = published->monitor_info;
+        ctx->monitor_order = published->monitor_order;
+    }
+    free_monitor_names_result(result);
+}
+
+static void refresh_monitor_names(app_ctx_t *ctx) {
+    // Verify the cached friendly names in the background
+    monitor_names_result_t *result = calloc(1, sizeof(monitor_names_result_t));
+    result->hwnd = ctx->main_window_hwnd;
+    result->seq = ++ctx->monitor_names_seq;
+    if (ctx->main_window_hwnd != NULL && run_in_background(query_monitor_names_task, result)) {
+        return;
+    }
+    // No window to post the result to or no thread pool, verify the names right away
+    if (query_monitor_names(result)) {
+        merge_monitor_names(ctx, result);
+    }
+    free_monitor_names_result(result);
+}
+
+static void index_display_data(app_ctx_t *ctx) {
+    // Order and number the queried monitors and compute the fingerprints of the display setup
+    // Sort the monitor indices by the coordinates so we can number them (the leftmost is 1, etc.)
+    // There are only a few monitors, an insertion sort is enough and the records don't move
+    ctx->monitor_order = malloc(ctx->monitor_count * sizeof(size_t));
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        size_t pos = i;
+        while (pos > 0 &&
+               monitor_coordinate_compare(&(ctx->monitors[i]), &(ctx->monitors[ctx->monitor_order[pos - 1]])) < 0) {
+            ctx->monitor_order[pos] = ctx->monitor_order[pos - 1];
+            pos--;
+        }
+        ctx->monitor_order[pos] = i;
+    }
+    // Number the monitors and find out the smallest coordinates
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        monitor_t *mon = &(ctx->monitors[ctx->monitor_order[i]]);
+        mon->num = i + 1;
+        if (mon->virt_pos.x < ctx->min_monitor_pos.x) {
+            ctx->min_monitor_pos.x = mon->virt_pos.x;
+        }
+        if (mon->virt_pos.y < ctx->min_monitor_pos.y) {
+            ctx->min_monitor_pos.y = mon->virt_pos.y;
+        }
+        if (mon->primary) {
+            // This is the primary display of the system
+            ctx->primary_monitor_idx = (UINT) ctx->monitor_order[i];
+        }
+    }
+
+    // Mode catalogues of the monitors that are still connected to the same outputs stay valid
+    mode_catalogue_prune(&(ctx->mode_catalogues), ctx->monitors, ctx->monitor_count);
+    ctx->topology_fingerprint = preflight_topology_fingerprint(ctx->monitors, ctx->monitor_count);
+    ctx->display_generation++;
+    ctx->display_set_fingerprint = ctx->monitor_count;
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        ctx->display_set_fingerprint =
+            hash_display_set_add(ctx->display_set_fingerprint, ctx->monitor_info[i].device_id);
+    }
+}
+
+static void record_display_data(app_ctx_t *ctx, LONGLONG query_ticks) {
+    // Write the query results to the trace so that the session can be replayed
+    trace_monitors_t head = {.query_ticks = query_ticks, .monitor_count = (DWORD) ctx->monitor_count};
+    trace_monitor_t *monitors = calloc(ctx->monitor_count, sizeof(trace_monitor_t));
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        monitors[i].rect = ctx->monitors[i].rect;
+        monitors[i].primary = ctx->monitors[i].primary;
+        memcpy(&(monitors[i].info), &(ctx->monitor_info[i]), sizeof(monitor_info_t));
+    }
+    trace_write(&(ctx->trace), TRACE_EVENT_MONITORS, &head, sizeof(trace_monitors_t), monitors,
+                (DWORD) (ctx->monitor_count * sizeof(trace_monitor_t)));
+    free(monitors);
+}
+
+void populate_display_data(app_ctx_t *ctx) {
+    int virt_width = GetSystemMetrics(SM_CXVIRTUALSCREEN);
+    int virt_height = GetSystemMetrics(SM_CYVIRTUALSCREEN);
+
+    ctx->display_virtual_size.width = virt_width;
+    ctx->display_virtual_size.height = virt_height;
+
+    reset_topology_view(ctx);
+
+    LONGLONG query_start = latency_now();
+    EnumDisplayMonitors(NULL, NULL, monitor_enum_proc, (LPARAM) ctx);
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        ctx->monitors[i].info = &(ctx->monitor_info[i]);
+    }
+
+    // The per-monitor queries are independent and can be slow on some drivers, run them in parallel
+    parallel_for(ctx->monitor_count, query_monitor_task, ctx->monitors);
+    LONGLONG query_ticks = latency_now() - query_start;
+
+    index_display_data(ctx);
+
+    // Serve the friendly names from the monitor cache, a background pass verifies them
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        monitor_t *mon = &(ctx->monitors[i]);
+        const monitor_cache_entry_t *entry = monitor_cache_find(&(ctx->monitor_cache), mon->info->device_id);
+        if (entry != NULL && wcslen(entry->friendly_name) > 0) {
+            StringCchCopy(mon->info->friendly_name, 64, entry->friendly_name);
         } else {
-            log_trace(L"Preset \"%s\" does not match with the current monitor setup", preset->name);
+            // No known friendly device name, use numbering
+            StringCbPrintf(mon->info->friendly_name, 64, L"Display %u", mon->num);
         }
     }
+    if (ctx->trace.file != NULL) {
+        record_display_data(ctx, query_ticks);
+    }
+    refresh_monitor_names(ctx);
+    publish_topology(ctx);
+    metric_since(METRIC_ENUMERATION, query_start);
+}
+
+void replay_display_data(app_ctx_t *ctx, const trace_monitor_t *monitors, size_t monitor_count) {
+    // Load recorded query results in place of querying the displays
+    reset_topology_view(ctx);
+    ctx->monitor_count = monitor_count;
+    ctx->monitor_capacity = monitor_count;
+    ctx->monitors = calloc(monitor_count, sizeof(monitor_t));
+    ctx->monitor_info = calloc(monitor_count, sizeof(monitor_info_t));
+    for (size_t i = 0; i < monitor_count; i++) {
+        monitor_t *mon = &(ctx->monitors[i]);
+        mon->info = &(ctx->monitor_info[i]);
+        memcpy(mon->info, &(monitors[i].info), sizeof(monitor_info_t));
+        mon->rect = monitors[i].rect;
+        mon->primary = monitors[i].primary;
+        memcpy(&(mon->virt_pos), &(mon->info->devmode.dmPosition), sizeof(POINTL));
+        mon->orientation = mon->info->devmode.dmDisplayOrientation;
+        mon->id = hash_device_id(mon->info->device_id);
+    }
+    index_display_data(ctx);
+    publish_topology(ctx);
+}
+
+static BOOL get_config_write_time(const wchar_t *path, FILETIME *write_time) {
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attributes)) {
+        return FALSE;
+    }
+    *write_time = attributes.ftLastWriteTime;
+    return TRUE;
+}
+
+int read_config(app_ctx_t *ctx, BOOL reload) {
+    log_info(L"Reading config");
+    // A broken file is reported once, the next write is read again
+    get_config_write_time(ctx->config_file_path, &(ctx->config_write_time));
+    // Read into a new config, the current one stays in use if the file can't be read
+    published_config_t *config = disp_config_create_published();
+    if (disp_config_read_file(ctx->config_file_path, &(config->config)) != DISP_CONFIG_SUCCESS) {
+        show_error_message(ctx, L"Could not read configuration file:\n%s", disp_config_get_err_msg(&(config->config)));
+        config->head.destroy(&(config->head));
+        return 1;
+    }
+    if (reload == TRUE) {
+        // Free the state built from the previous config
+        log_debug(L"Replacing previous config");
+        unregister_hotkeys(ctx);
+        search_index_destroy(&(ctx->search_index));
+    }
+    // The previous config is destroyed once no other thread reads it
+    publish_config(ctx, config);
+    register_hotkeys(ctx);
+    search_index_build(&(ctx->search_index), ctx->config);
+    refresh_launcher_window(ctx);
+    return 0;
 }
 
 void reload(app_ctx_t *ctx) {
     log_debug(L"Reloading");
+    LONGLONG start = latency_now();
     populate_display_data(ctx);
     read_config(ctx, TRUE);
     flag_matching_presets(ctx);
-    create_tray_menu(ctx);
+    compile_applicable_presets(ctx);
+    update_tray_menu(ctx);
+    metric_inc(METRIC_RELOADS);
+    metric_since(METRIC_RELOAD, start);
 }
 
-static BOOL get_matching_monitor(app_ctx_t *ctx, const wchar_t *device_id, monitor_t **monitor_out) {
-    for (size_t i = 0; i < ctx->monitor_count; i++) {
-        monitor_t *monitor = &(ctx->monitors[i]);
-        // Compare paths
-        if (wcscmp((wchar_t *) monitor->device_id, device_id) == 0) {
-            // Found
-            *monitor_out = monitor;
-            return TRUE;
-        }
+void reload_changed_config(app_ctx_t *ctx) {
+    // Called a moment after the config file was written, editors may write it several times
+    FILETIME write_time;
+    if (!get_config_write_time(ctx->config_file_path, &write_time) ||
+        CompareFileTime(&write_time, &(ctx->config_write_time)) == 0) {
+        // Removed for now or already read, e.g. after saving a preset
+        return;
+    }
+    if (ctx->display_update_in_progress) {
+        // Try again once the update is done
+        log_debug(L"Display update in progress, delaying config reload");
+        SetTimer(ctx->main_window_hwnd, TIMER_CONFIG_CHANGE, CONFIG_CHANGE_DEBOUNCE_MS, NULL);
+        return;
+    }
+    log_info(L"Config file has changed, reloading");
+    ctx->display_update_in_progress = TRUE;
+    reload(ctx);
+    ctx->display_update_in_progress = FALSE;
+}
+
+static void config_watch_handler(void *data) {
+    app_ctx_t *ctx = (app_ctx_t *) data;
+    if (config_watch_check(&(ctx->config_watch))) {
+        SetTimer(ctx->main_window_hwnd, TIMER_CONFIG_CHANGE, CONFIG_CHANGE_DEBOUNCE_MS, NULL);
+    }
+}
+
+void watch_config_file(app_ctx_t *ctx) {
+    // Reload the config when it is edited, the main loop waits for the changes along with the messages
+    if (!config_watch_start(&(ctx->config_watch), ctx->config_file_path)) {
+        log_warning(L"Config file changes won't be noticed");
+        return;
+    }
+    if (!reactor_add(&(ctx->reactor), ctx->config_watch.overlapped.hEvent, config_watch_handler, ctx)) {
+        config_watch_stop(&(ctx->config_watch));
+    }
+}
+
+void unwatch_config_file(app_ctx_t *ctx) {
+    if (ctx->config_watch.dir != NULL) {
+        reactor_remove(&(ctx->reactor), ctx->config_watch.overlapped.hEvent);
+        config_watch_stop(&(ctx->config_watch));
     }
-    return FALSE;
 }
 
-// TODO: Use this when changing the display orientation from the tray menu
 static void change_orientation_devmode(DEVMODE *devmode, int orientation) {
     if ((int) devmode->dmDisplayOrientation == orientation) {
         // No change
         return;
     }
 
+    // Check if we should swap dmPelsHeight and dmPelsWidth (if the change is 90 degrees)
+    // This has to be done before the new orientation is set
+    int diff = abs(orientation - (int) devmode->dmDisplayOrientation) % 2;
     devmode->dmDisplayOrientation = orientation;
     devmode->dmFields |= DM_DISPLAYORIENTATION;
-    // Check if we should swap dmPelsHeight and dmPelsWidth (if the change is 90 degrees)
-    int diff = abs(orientation - devmode->dmDisplayOrientation) % 3;
-    if (diff < 2) {
+    if (diff == 1) {
         // 90 degree change, swap dmPelsHeight and dmPelsWidth
         int tempPelsHeight = devmode->dmPelsHeight;
         devmode->dmPelsHeight = devmode->dmPelsWidth;
@@ -341,8 +666,53 @@ static void change_position_devmode(DEVMODE *devmode, int pos_x, int pos_y) {
     devmode->dmFields |= DM_POSITION;
 }
 
-static BOOL change_display_settings(wchar_t *monitor_name, DEVMODE *devmode) {
-    LONG ret = ChangeDisplaySettingsEx(monitor_name, devmode, NULL, CDS_UPDATEREGISTRY | CDS_GLOBAL, NULL);
+static void change_mode_devmode(app_ctx_t *ctx, const monitor_t *monitor, const display_settings_t *settings,
+                                DEVMODE *devmode) {
+    if (!settings->has_refresh_rate) {
+        // Older presets may have the resolution in scaled pixels, don't touch the mode
+        return;
+    }
+    DWORD width = (DWORD) settings->width;
+    DWORD height = (DWORD) settings->height;
+    DWORD frequency = (DWORD) settings->refresh_rate;
+    if (devmode->dmPelsWidth == width && devmode->dmPelsHeight == height &&
+        (frequency == MODE_ANY || devmode->dmDisplayFrequency == frequency)) {
+        // No change
+        return;
+    }
+
+    const mode_catalogue_t *catalogue = mode_catalogue_get(&(ctx->mode_catalogues), monitor);
+    DWORD orientation = devmode->dmDisplayOrientation;
+    // Keep the current bit depth if possible
+    const display_mode_t *mode =
+        mode_catalogue_find(catalogue, width, height, orientation, frequency, devmode->dmBitsPerPel);
+    if (mode == NULL) {
+        mode = mode_catalogue_find(catalogue, width, height, orientation, frequency, MODE_ANY);
+    }
+    if (mode == NULL) {
+        log_warning(L"Display %s has no %ux%u mode at %u Hz, keeping the current mode", monitor->info->name, width,
+                    height, frequency);
+        return;
+    }
+
+    if (orientation == DMDO_90 || orientation == DMDO_270) {
+        devmode->dmPelsWidth = mode->height;
+        devmode->dmPelsHeight = mode->width;
+    } else {
+        devmode->dmPelsWidth = mode->width;
+        devmode->dmPelsHeight = mode->height;
+    }
+    devmode->dmDisplayFrequency = mode->frequency;
+    devmode->dmBitsPerPel = mode->bits_per_pel;
+    devmode->dmDisplayFlags = mode->display_flags;
+    devmode->dmFields |= DM_PELSWIDTH | DM_PELSHEIGHT | DM_DISPLAYFREQUENCY | DM_BITSPERPEL | DM_DISPLAYFLAGS;
+}
+
+static BOOL change_display_settings(wchar_t *monitor_name, DEVMODE *devmode, DWORD flags) {
+    // flags can add CDS_NORESET to stage the change for commit_display_settings
+    LONGLONG start = latency_now();
+    LONG ret = ChangeDisplaySettingsEx(monitor_name, devmode, NULL, CDS_UPDATEREGISTRY | CDS_GLOBAL | flags, NULL);
+    metric_since(METRIC_MODE_SET, start);
     if (ret != DISP_CHANGE_SUCCESSFUL) {
         log_error(L"Display change failed: 0x%04X", ret);
         return FALSE;
@@ -352,111 +722,599 @@ static BOOL change_display_settings(wchar_t *monitor_name, DEVMODE *devmode) {
     }
 }
 
-void apply_preset(app_ctx_t *ctx, display_preset_t *preset) {
-    // For now we support changing display positions and orientations
+static BOOL commit_display_settings() {
+    // Apply all the staged display changes at once
+    LONGLONG start = latency_now();
+    LONG ret = ChangeDisplaySettingsEx(NULL, NULL, NULL, 0, NULL);
+    metric_since(METRIC_MODE_SET, start);
+    if (ret != DISP_CHANGE_SUCCESSFUL) {
+        log_error(L"Committing display changes failed: 0x%04X", ret);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void remember_recent_preset(app_ctx_t *ctx, const display_preset_t *preset) {
+    // Move the preset to the front of the recently used list
+    size_t pos = 0;
+    while (pos < ctx->recent_preset_count && wcscmp(ctx->recent_presets[pos], preset->name_folded) != 0) {
+        pos++;
+    }
+    if (pos == ctx->recent_preset_count) {
+        // Not in the list yet
+        if (ctx->recent_preset_count < RECENT_PRESET_COUNT) {
+            ctx->recent_preset_count++;
+        } else {
+            // Drop the least recently used preset
+            pos = RECENT_PRESET_COUNT - 1;
+            free(ctx->recent_presets[pos]);
+        }
+        ctx->recent_presets[pos] = _wcsdup(preset->name_folded);
+    }
+    wchar_t *entry = ctx->recent_presets[pos];
+    memmove(&(ctx->recent_presets[1]), &(ctx->recent_presets[0]), pos * sizeof(wchar_t *));
+    ctx->recent_presets[0] = entry;
+}
+
+void free_recent_presets(app_ctx_t *ctx) {
+    for (size_t i = 0; i < ctx->recent_preset_count; i++) {
+        free(ctx->recent_presets[i]);
+    }
+    ctx->recent_preset_count = 0;
+}
+
+static void build_display_devmode(app_ctx_t *ctx, const monitor_t *monitor, const display_settings_t *settings,
+                                  DEVMODE *devmode) {
+    // Copy base DEVMODE from the monitor
+    memcpy(devmode, &(monitor->info->devmode), sizeof(DEVMODE));
+    // Make the needed devmode changes to change the orientation (if needed)
+    change_orientation_devmode(devmode, settings->orientation);
+    // Pick the display mode for the resolution and refresh rate (if needed)
+    change_mode_devmode(ctx, monitor, settings, devmode);
+    // Make the needed position changes
+    change_position_devmode(devmode, settings->pos_x, settings->pos_y);
+}
+
+static DWORD devmode_changes(const DEVMODE *current, const DEVMODE *target) {
+    // DM_* fields of the target that differ from the current settings
+    DWORD changes = 0;
+    if (current->dmDisplayOrientation != target->dmDisplayOrientation) {
+        changes |= DM_DISPLAYORIENTATION;
+    }
+    if (current->dmPelsWidth != target->dmPelsWidth || current->dmPelsHeight != target->dmPelsHeight) {
+        changes |= DM_PELSWIDTH | DM_PELSHEIGHT;
+    }
+    if (current->dmDisplayFrequency != target->dmDisplayFrequency) {
+        changes |= DM_DISPLAYFREQUENCY;
+    }
+    if (current->dmBitsPerPel != target->dmBitsPerPel) {
+        changes |= DM_BITSPERPEL;
+    }
+    if (current->dmPosition.x != target->dmPosition.x || current->dmPosition.y != target->dmPosition.y) {
+        changes |= DM_POSITION;
+    }
+    return changes;
+}
+
+static void devmode_rect(const DEVMODE *devmode, RECT *rect) {
+    // The size is already swapped for the orientation
+    rect->left = devmode->dmPosition.x;
+    rect->top = devmode->dmPosition.y;
+    rect->right = devmode->dmPosition.x + (LONG) devmode->dmPelsWidth;
+    rect->bottom = devmode->dmPosition.y + (LONG) devmode->dmPelsHeight;
+}
+
+static void check_plan_layout(app_ctx_t *ctx, const display_preset_t *preset, apply_plan_step_t *steps,
+                              const monitor_t **targets, size_t count) {
+    // Check the desktop the DEVMODEs form and snap it if that is enabled, Windows would move the displays anyway
+    // The displays a subset preset doesn't cover are part of the desktop as they are
+    RECT *rects = calloc(count + ctx->monitor_count, sizeof(RECT));
+    for (size_t i = 0; i < count; i++) {
+        devmode_rect(&(steps[i].devmode), &(rects[i]));
+    }
+    size_t rect_count = count;
+    for (size_t m = 0; m < ctx->monitor_count && preset->subset; m++) {
+        BOOL covered = FALSE;
+        for (size_t i = 0; i < count && !covered; i++) {
+            covered = targets[i] == &(ctx->monitors[m]);
+        }
+        if (!covered) {
+            devmode_rect(&(ctx->monitors[m].info->devmode), &(rects[rect_count++]));
+        }
+    }
+    int result = layout_check(rects, rect_count);
+    if (result != LAYOUT_VALID && ctx->config->snap_layouts) {
+        size_t moved = layout_snap(rects, rect_count, layout_anchor(rects, rect_count), count);
+        log_info(L"Preset \"%s\" has %s, snapped %u displays", preset->name, layout_result_name(result),
+                 (UINT) moved);
+        for (size_t i = 0; i < count; i++) {
+            change_position_devmode(&(steps[i].devmode), rects[i].left, rects[i].top);
+        }
+    } else if (result != LAYOUT_VALID) {
+        log_warning(L"Preset \"%s\" has %s, Windows will move them", preset->name, layout_result_name(result));
+    }
+    free(rects);
+}
+
+static apply_plan_t *compile_apply_plan(app_ctx_t *ctx, display_preset_t *preset, preset_state_t *state) {
+    // Resolve the monitors of the preset and build the final DEVMODEs
+    // Returns NULL if a display of the preset isn't connected
+    if (disp_config_preset_materialize(ctx->config, preset, state) != DISP_CONFIG_SUCCESS) {
+        return NULL;
+    }
+    apply_plan_t *plan = calloc(1, sizeof(apply_plan_t) + preset->display_count * sizeof(apply_plan_step_t));
+    const monitor_t **targets = calloc(preset->display_count, sizeof(monitor_t *));
+    plan->topology = ctx->topology_fingerprint;
+    plan->generation = ctx->display_generation;
+    for (size_t i = 0; i < preset->display_count; i++) {
+        display_settings_t *settings = state->display_conf[i];
+        monitor_t *monitor;
+        if (get_matching_monitor(ctx, settings->device_path, &monitor) != TRUE) {
+            log_debug(L"Can't compile preset \"%s\": no matching monitor for %s", preset->name,
+                      settings->device_path);
+            free(targets);
+            free(plan);
+            return NULL;
+        }
+        targets[i] = monitor;
+        build_display_devmode(ctx, monitor, settings, &(plan->steps[i].devmode));
+    }
+
+    // The layout is checked with every display, then the ones already in the wanted state are dropped
+    check_plan_layout(ctx, preset, plan->steps, targets, preset->display_count);
+    for (size_t i = 0; i < preset->display_count; i++) {
+        apply_plan_step_t *step = &(plan->steps[plan->step_count]);
+        if (step != &(plan->steps[i])) {
+            memcpy(step, &(plan->steps[i]), sizeof(apply_plan_step_t));
+        }
+        step->changes = devmode_changes(&(targets[i]->info->devmode), &(step->devmode));
+        if (step->changes == 0) {
+            // Already in the wanted state
+            continue;
+        }
+        StringCchCopy(step->name, CCHDEVICENAME, targets[i]->info->name);
+        plan->step_count++;
+    }
+    free(targets);
+    plan->target = preflight_target_hash(ctx->monitor_info, ctx->monitor_count, plan);
+    log_trace(L"Compiled preset \"%s\", %u of %u displays change", preset->name, (UINT) plan->step_count,
+              (UINT) preset->display_count);
+    return plan;
+}
+
+apply_plan_t *get_apply_plan(app_ctx_t *ctx, display_preset_t *preset) {
+    // Return the compiled plan of the preset, compiling it if it is missing or out of date
+    // A rotation, mode change or move keeps the topology, so the plan is only valid for one display query
+    preset_state_t *state = get_preset_state(ctx, preset);
+    if (state->plan == NULL || state->plan->generation != ctx->display_generation) {
+        free(state->plan);
+        state->plan = compile_apply_plan(ctx, preset, state);
+    }
+    return state->plan;
+}
+
+void flag_matching_presets(app_ctx_t *ctx) {
+    display_preset_t **presets;
+    int preset_count = disp_config_get_presets(ctx->config, &presets);
+
+    log_trace(L"Got %d presets", preset_count);
+
+    // Subset presets match when their device mask is contained in the mask of the connected displays
+    UINT64 device_mask = disp_config_device_mask(ctx->config, ctx);
+
+    for (int i = 0; i < preset_count; i++) {
+        display_preset_t *preset = presets[i];
+        preset_state_t *state = &(ctx->preset_states[i]);
+
+        // The state outlives the topology when a reload keeps the previous config, start from a clean state
+        state->applicable = 0;
+        state->preflight = PREFLIGHT_UNKNOWN;
+        if (state->plan != NULL && state->plan->generation != ctx->display_generation) {
+            free(state->plan);
+            state->plan = NULL;
+        }
+
+        // The display set fingerprint or device mask rules out most presets before their displays are materialized
+        BOOL candidate = preset->subset ? (preset->device_mask & ~device_mask) == 0
+                                        : preset->display_set_fingerprint == ctx->display_set_fingerprint;
+        if (candidate && disp_config_preset_materialize(ctx->config, preset, state) == DISP_CONFIG_SUCCESS &&
+            disp_config_preset_matches_current(preset, state, ctx) == DISP_CONFIG_SUCCESS) {
+            log_trace(L"Preset \"%s\" matches with the current monitor setup", preset->name);
+            state->applicable = 1;
+        } else {
+            log_trace(L"Preset \"%s\" does not match with the current monitor setup", preset->name);
+        }
+    }
+}
+
+void compile_applicable_presets(app_ctx_t *ctx) {
+    // Compile the applicable presets so that applying them only executes the plan
+    // Presets that haven't been compiled yet are compiled when they are applied
+    display_preset_t **presets;
+    int preset_count = disp_config_get_presets(ctx->config, &presets);
+    for (int i = 0; i < preset_count; i++) {
+        preset_state_t *state = &(ctx->preset_states[i]);
+        if (state->applicable != 1) {
+            continue;
+        }
+        // Known-bad presets are shown disabled, unknown ones are checked when they are applied
+        apply_plan_t *plan = get_apply_plan(ctx, presets[i]);
+        if (plan != NULL) {
+            state->preflight = preflight_cache_get(&(ctx->preflight_cache), ctx->topology_fingerprint, plan->target);
+        }
+    }
+}
+
+void release_apply_plans(app_ctx_t *ctx) {
+    // Free the compiled plans, they are compiled again when the presets are applied
+    for (size_t i = 0; i < ctx->config->preset_count; i++) {
+        free(ctx->preset_states[i].plan);
+        ctx->preset_states[i].plan = NULL;
+    }
+}
+
+static size_t execute_apply_plan(app_ctx_t *ctx, apply_plan_t *plan) {
+    // Stage all the changes and commit them together so the displays are reconfigured only once
+    // Returns the number of displays that failed
+    // The display change notifications from here on are timed until they settle
+    ctx->settle_start = latency_now();
+    ctx->settle_last = 0;
+    size_t fail_count = 0;
+    size_t staged_count = 0;
+    for (size_t i = 0; i < plan->step_count; i++) {
+        apply_plan_step_t *step = &(plan->steps[i]);
+        if (step->changes == 0) {
+            continue;
+        }
+        if (change_display_settings(step->name, &(step->devmode), CDS_NORESET)) {
+            staged_count++;
+        } else {
+            fail_count++;
+        }
+    }
+    if (staged_count > 0 && !commit_display_settings()) {
+        fail_count += staged_count;
+    }
+    metric_since(METRIC_APPLY, ctx->settle_start);
+    if (ctx->main_window_hwnd != NULL) {
+        // Closes the settle window if the change caused no notifications
+        SetTimer(ctx->main_window_hwnd, TIMER_SETTLE, DISPLAY_CHANGE_DEBOUNCE_MS, NULL);
+    }
+    return fail_count;
+}
+
+static void push_snapshot(app_ctx_t *ctx) {
+    // Capture the current settings of every monitor so that the next change can be reverted
+    apply_plan_t *snapshot = calloc(1, sizeof(apply_plan_t) + ctx->monitor_count * sizeof(apply_plan_step_t));
+    snapshot->topology = ctx->topology_fingerprint;
+    snapshot->step_count = ctx->monitor_count;
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        apply_plan_step_t *step = &(snapshot->steps[i]);
+        StringCchCopy(step->name, CCHDEVICENAME, ctx->monitor_info[i].name);
+        memcpy(&(step->devmode), &(ctx->monitor_info[i].devmode), sizeof(DEVMODE));
+        step->devmode.dmFields |= DM_DISPLAYORIENTATION | DM_PELSWIDTH | DM_PELSHEIGHT | DM_DISPLAYFREQUENCY |
+                                  DM_BITSPERPEL | DM_DISPLAYFLAGS | DM_POSITION;
+    }
+
+    // Overwrite the oldest snapshot when the ring is full
+    free(ctx->snapshots[ctx->snapshot_next]);
+    ctx->snapshots[ctx->snapshot_next] = snapshot;
+    ctx->snapshot_next = (ctx->snapshot_next + 1) % SNAPSHOT_COUNT;
+    if (ctx->snapshot_count < SNAPSHOT_COUNT) {
+        ctx->snapshot_count++;
+    }
+}
+
+static apply_plan_t *pop_snapshot(app_ctx_t *ctx) {
+    if (ctx->snapshot_count == 0) {
+        return NULL;
+    }
+    ctx->snapshot_next = (ctx->snapshot_next + SNAPSHOT_COUNT - 1) % SNAPSHOT_COUNT;
+    apply_plan_t *snapshot = ctx->snapshots[ctx->snapshot_next];
+    ctx->snapshots[ctx->snapshot_next] = NULL;
+    ctx->snapshot_count--;
+    return snapshot;
+}
+
+void free_snapshots(app_ctx_t *ctx) {
+    for (size_t i = 0; i < SNAPSHOT_COUNT; i++) {
+        free(ctx->snapshots[i]);
+        ctx->snapshots[i] = NULL;
+    }
+    ctx->snapshot_next = 0;
+    ctx->snapshot_count = 0;
+}
+
+static void start_auto_revert(app_ctx_t *ctx) {
+    // Revert the change unless the user confirms it in time
+    if (ctx->config->auto_revert_seconds <= 0) {
+        return;
+    }
+    if (ctx->headless) {
+        // Nobody could confirm the change, it would always be reverted
+        log_debug(L"Not asking for confirmation in headless mode");
+        return;
+    }
+    ctx->auto_revert_pending = TRUE;
+    SetTimer(ctx->main_window_hwnd, TIMER_AUTO_REVERT, (UINT) ctx->config->auto_revert_seconds * 1000, NULL);
+    if (!ctx->confirm_box_open) {
+        // Ask after the display change has been processed
+        PostMessage(ctx->main_window_hwnd, MSG_CONFIRM_CHANGE, 0, 0);
+    }
+}
+
+void revert_display_changes(app_ctx_t *ctx) {
+    // Restore the display settings from before the last change
+    if (ctx->display_update_in_progress) {
+        log_warning(L"Display update already in progress, can't revert");
+        metric_inc(METRIC_DROPPED_UPDATES);
+        return;
+    }
+    if (ctx->auto_revert_pending) {
+        KillTimer(ctx->main_window_hwnd, TIMER_AUTO_REVERT);
+        ctx->auto_revert_pending = FALSE;
+    }
+    if (ctx->confirm_box_open) {
+        // Close the confirmation, the change is being reverted anyway
+        HWND confirm_box = GetWindow(ctx->main_window_hwnd, GW_ENABLEDPOPUP);
+        if (confirm_box != NULL) {
+            PostMessage(confirm_box, WM_COMMAND, IDCANCEL, 0);
+        }
+    }
+    apply_plan_t *snapshot = pop_snapshot(ctx);
+    if (snapshot == NULL) {
+        log_info(L"Nothing to revert");
+        show_notification_message(ctx, L"There are no display changes to revert");
+        return;
+    }
+    if (snapshot->topology != ctx->topology_fingerprint) {
+        // The snapshots refer to displays that are no longer connected the same way
+        log_warning(L"Displays have changed since the snapshot, not reverting");
+        show_notification_message(ctx, L"Can't revert, the displays have changed");
+        free(snapshot);
+        free_snapshots(ctx);
+        update_tray_menu(ctx);
+        return;
+    }
+    ctx->display_update_in_progress = TRUE;
+    log_info(L"Reverting display changes");
+
+    // Only the displays that differ from the snapshot need a change, ones that can't be found are skipped
+    size_t change_count = 0;
+    for (size_t i = 0; i < snapshot->step_count; i++) {
+        apply_plan_step_t *step = &(snapshot->steps[i]);
+        step->changes = 0;
+        for (size_t m = 0; m < ctx->monitor_count; m++) {
+            if (wcscmp(ctx->monitor_info[m].name, step->name) == 0) {
+                step->changes = devmode_changes(&(ctx->monitor_info[m].devmode), &(step->devmode));
+                break;
+            }
+        }
+        if (step->changes != 0) {
+            change_count++;
+        }
+    }
+    if (change_count == 0) {
+        log_info(L"The displays already have the settings of the snapshot");
+        show_notification_message(ctx, L"There are no display changes to revert");
+        free(snapshot);
+        update_tray_menu(ctx);
+        ctx->display_update_in_progress = FALSE;
+        return;
+    }
+    size_t fail_count = execute_apply_plan(ctx, snapshot);
+    free(snapshot);
+
+    if (fail_count == 0) {
+        log_info(L"Display changes reverted");
+        metric_inc(METRIC_REVERTS);
+        show_notification_message(ctx, L"Reverted display changes");
+    } else {
+        log_warning(L"Reverting display changes failed, %u fails", (UINT) fail_count);
+        metric_inc(METRIC_APPLY_FAILURES);
+        show_notification_message(ctx, L"Failed to revert display changes");
+    }
+
+    // Reload display info and config to check for applicable presets
+    reload(ctx);
+
+    ctx->display_update_in_progress = FALSE;
+}
+
+static int preflight_preset(app_ctx_t *ctx, display_preset_t *preset, const apply_plan_t *plan) {
+    // Dry run the changes of the plan, nothing is changed
+    // The result is cached for the topology and the whole target desktop so repeated switches skip the dry run
+    int result = preflight_cache_get(&(ctx->preflight_cache), ctx->topology_fingerprint, plan->target);
+    if (result != PREFLIGHT_UNKNOWN) {
+        log_debug(L"Using the cached preflight result of preset \"%s\"", preset->name);
+        get_preset_state(ctx, preset)->preflight = result;
+        return result;
+    }
+
+    // Ask the driver whether the target settings of every display would be accepted without changing anything
+    // The displays the plan doesn't change are tested too, so the result only depends on the cache key
+    result = PREFLIGHT_OK;
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        const monitor_info_t *info = &(ctx->monitor_info[i]);
+        const DEVMODE *devmode = preflight_target_devmode(info, plan);
+        LONG ret = ChangeDisplaySettingsEx(info->name, (DEVMODE *) devmode, NULL, CDS_TEST, NULL);
+        if (ret != DISP_CHANGE_SUCCESSFUL) {
+            log_error(L"Preflight failed: display %s rejected the settings: 0x%04X", info->name, ret);
+            result = PREFLIGHT_FAILED;
+            break;
+        }
+    }
+    log_debug(L"Preflight of preset \"%s\" %s", preset->name, result == PREFLIGHT_OK ? L"passed" : L"failed");
+
+    preflight_cache_put(&(ctx->preflight_cache), ctx->topology_fingerprint, plan->target, result);
+    get_preset_state(ctx, preset)->preflight = result;
+    return result;
+}
+
+static void apply_preset_plan(app_ctx_t *ctx, display_preset_t *preset) {
+    // For now we support changing display positions, orientations, resolutions and refresh rates
 
     if (ctx->display_update_in_progress) {
         // TODO: What to do? Can't sleep because it will block the whole application
         // Just give up for now
         log_warning(L"Display update already in progress, can't change settings");
+        metric_inc(METRIC_DROPPED_UPDATES);
         return;
     }
     ctx->display_update_in_progress = TRUE;
     log_info(L"Applying preset \"%s\"", preset->name);
 
-    size_t success_count = 0;
-    for (size_t i = 0; i < preset->display_count; i++) {
-        display_settings_t *settings = preset->display_conf[i];
-
-        // Find the matching current monitor
-        // TODO: Check that all the monitors match before applying so that we don't end up in a inconsistent state
-        monitor_t *monitor;
-        if (get_matching_monitor(ctx, settings->device_path, &monitor) != TRUE) {
-            // No matching monitor (this shouldn't happen as we check the monitors on WM_DISPLAYCHANGE)
-            log_error(L"Failed to apply preset: no matching monitor");
-            MessageBox(ctx->main_window_hwnd, L"Failed to apply preset: no matching monitor", APP_NAME,
-                       MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
-            ctx->display_update_in_progress = FALSE;
-            return;
-        }
-        // monitor now contains the matching monitor_t
-        // Copy base DEVMODE from the monitor
-        DEVMODE tmp = {0};
-        memcpy(&tmp, &(monitor->devmode), sizeof(DEVMODE));
-        // Make the needed devmode changes to change the orientation (if needed)
-        change_orientation_devmode(&tmp, settings->orientation);
-        // Make the needed position changes
-        change_position_devmode(&tmp, settings->pos_x, settings->pos_y);
-        // Apply the devmode
-        if (change_display_settings(monitor->name, &tmp)) {
-            // Success
-            success_count++;
-        }
+    // Check that all the monitors match and the settings are valid before changing anything
+    // A missing plan means a display isn't connected, that isn't a verdict of the driver and isn't cached
+    apply_plan_t *plan = get_apply_plan(ctx, preset);
+    if (plan == NULL || preflight_preset(ctx, preset, plan) != PREFLIGHT_OK) {
+        log_error(L"Failed to apply preset: the current displays don't accept it");
+        metric_inc(METRIC_PREFLIGHT_REJECTS);
+        show_notification_message(ctx, L"Preset \"%s\" can't be applied to the current displays", preset->name);
+        // Show the preset as disabled
+        update_tray_menu(ctx);
+        ctx->display_update_in_progress = FALSE;
+        return;
     }
+    remember_recent_preset(ctx, preset);
+    if (plan->step_count > 0) {
+        // Re-applying the active preset would only push a copy of the current settings and evict a useful one
+        push_snapshot(ctx);
+    }
+
+    size_t fail_count = execute_apply_plan(ctx, plan);
 
-    if (success_count == preset->display_count) {
+    if (fail_count == 0) {
         log_info(L"Display preset changed to %s", preset->name);
+        metric_inc(METRIC_PRESETS_APPLIED);
         // Show a notification
         show_notification_message(ctx, L"Changed display preset to \"%s\"", preset->name);
-        // TODO: Auto-revert period?
+        if (plan->step_count > 0) {
+            start_auto_revert(ctx);
+        }
     } else {
-        log_warning(L"Display preset change failed, %d fails", (preset->display_count - success_count));
-        // One or more changes failed
+        log_warning(L"Display preset change failed, %u fails", (UINT) fail_count);
+        metric_inc(METRIC_APPLY_FAILURES);
+        // One or more changes failed, go back to the previous settings
         show_notification_message(ctx, L"Failed to change display preset to \"%s\"", preset->name);
-        // TODO: Try to revert?
+        ctx->display_update_in_progress = FALSE;
+        reload(ctx);
+        revert_display_changes(ctx);
+        return;
     }
 
-    // Reload display info
-    populate_display_data(ctx);
-    create_tray_menu(ctx);
-    // Reload config to check for applicable presets
+    // Reload display info and config to check for applicable presets
     reload(ctx);
 
     // All done
     ctx->display_update_in_progress = FALSE;
 }
 
-void apply_preset_by_name(app_ctx_t *ctx, const wchar_t *name) {
+void apply_preset(app_ctx_t *ctx, display_preset_t *preset) {
+    // Applying reloads the config, which may publish a new one while the preset is still in use
+    // The reference keeps the config of the preset alive until the caller gets control back
+    const published_config_t *config = acquire_config(ctx);
+    apply_preset_plan(ctx, preset);
+    if (config != NULL) {
+        rcu_release((rcu_object_t *) &(config->head));
+    }
+}
+
+display_preset_t *first_applicable_preset(app_ctx_t *ctx, int preset_idx) {
+    // Presets with the same name are chained, return the first applicable one
+    while (preset_idx >= 0) {
+        display_preset_t *preset = ctx->config->presets[preset_idx];
+        if (ctx->preset_states[preset_idx].applicable == 1) {
+            return preset;
+        }
+        preset_idx = preset->next_same_name;
+    }
+    return NULL;
+}
+
+display_preset_t *find_applicable_preset(app_ctx_t *ctx, const wchar_t *name) {
     // Find a preset with the given name
     // Use case-insensitive matching
     log_debug(L"Searching for preset \"%s\"", name);
-    BOOL found_preset = FALSE;
-    for (size_t i = 0; i < ctx->config.preset_count; i++) {
-        display_preset_t *preset = ctx->config.presets[i];
-
-        if (_wcsicmp(name, preset->name) == 0 && preset->applicable == 1) {
-            // Matching name
-            log_debug(L"Found matching preset, applying");
-            apply_preset(ctx, preset);
-            found_preset = TRUE;
-            break;
-        }
-    }
-    if (!found_preset) {
+    return first_applicable_preset(ctx, disp_config_get_preset_idx(ctx->config, name));
+}
+
+void apply_preset_by_name(app_ctx_t *ctx, const wchar_t *name) {
+    display_preset_t *preset = find_applicable_preset(ctx, name);
+    if (preset != NULL) {
+        // Matching name
+        log_debug(L"Found matching preset, applying");
+        apply_preset(ctx, preset);
+    } else {
         log_warning(L"No applicable preset found");
         show_notification_message(ctx, L"No applicable preset found");
     }
 }
 
+display_preset_t *get_rule_preset(app_ctx_t *ctx) {
+    // Preset of the rule that matches the connected displays, NULL if there is none
+    const display_rule_t *rule = disp_config_find_rule(ctx->config, ctx->display_set_fingerprint);
+    if (rule == NULL) {
+        log_trace(L"No rule for the connected displays");
+        return NULL;
+    }
+
+    display_preset_t *preset = NULL;
+    if (rule->policy == RULE_POLICY_LAST_USED) {
+        // Most recently used preset that fits the displays
+        for (size_t i = 0; i < ctx->recent_preset_count && preset == NULL; i++) {
+            preset = first_applicable_preset(ctx, disp_config_get_preset_idx(ctx->config, ctx->recent_presets[i]));
+        }
+    }
+    if (preset == NULL) {
+        preset = first_applicable_preset(ctx, rule->preset_idx);
+    }
+    if (preset == NULL) {
+        log_warning(L"A rule matches the connected displays but it has no applicable preset");
+    }
+    return preset;
+}
+
+void apply_matching_rule(app_ctx_t *ctx) {
+    // Apply the preset of the rule that matches the connected displays
+    // The rules are evaluated once per display set so that manual changes aren't overridden
+    if (ctx->display_set_fingerprint == ctx->rule_fingerprint) {
+        return;
+    }
+    ctx->rule_fingerprint = ctx->display_set_fingerprint;
+    display_preset_t *preset = get_rule_preset(ctx);
+    if (preset == NULL) {
+        return;
+    }
+
+    apply_plan_t *plan = get_apply_plan(ctx, preset);
+    if (plan != NULL && plan->step_count == 0) {
+        log_debug(L"Preset \"%s\" of the matching rule is already active", preset->name);
+        return;
+    }
+    log_info(L"Connected displays match a rule, applying preset \"%s\"", preset->name);
+    apply_preset(ctx, preset);
+}
+
 BOOL change_display_orientation(app_ctx_t *ctx, monitor_t *mon, BYTE orientation) {
-    if (mon->devmode.dmDisplayOrientation == orientation) {
+    if (mon->orientation == orientation) {
         // No change
         return TRUE;
     }
 
     DEVMODE tmp = {0};
-    memcpy(&tmp, &(mon->devmode), sizeof(DEVMODE));
+    memcpy(&tmp, &(mon->info->devmode), sizeof(DEVMODE));
     // Make the needed devmode changes to change the orientation (if needed)
     change_orientation_devmode(&tmp, orientation);
 
     // Apply the devmode
-    if (change_display_settings(mon->name, &tmp)) {
+    if (change_display_settings(mon->info->name, &tmp, 0)) {
         // Success
         log_debug(L"Display change was successful");
         // Show a notification
         // TODO: Don't use friendly name as it isn't always available
         LPTSTR orientation_str[4] = {L"Landscape", L"Portrait", L"Landscape (flipped)", L"Portrait (flipped)"};
-        show_notification_message(ctx, L"Changed display %s orientation to %s", mon->friendly_name,
+        show_notification_message(ctx, L"Changed display %s orientation to %s", mon->info->friendly_name,
                                   orientation_str[orientation]);
         return TRUE;
     }
@@ -514,24 +1372,29 @@ void save_current_config(app_ctx_t *ctx) {
         return;
     }
 
-    // Add new preset to the app_config
-    if (disp_config_create_preset(data.preset_name, ctx) != DISP_CONFIG_SUCCESS) {
+    // The published config is never modified, add the new preset to a private copy read from the file
+    app_config_t config = {0};
+    if (disp_config_read_file(ctx->config_file_path, &config) != DISP_CONFIG_SUCCESS ||
+        disp_config_create_preset(&config, data.preset_name, ctx) != DISP_CONFIG_SUCCESS) {
         // Failed
+        disp_config_destroy(&config);
         MessageBox(ctx->main_window_hwnd, L"Preset creation failed", APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
         return;
     }
     // Preset created, save
-    if (disp_config_save_file(ctx->config_file_path, &(ctx->config)) != DISP_CONFIG_SUCCESS) {
+    if (disp_config_save_file(ctx->config_file_path, &config) != DISP_CONFIG_SUCCESS) {
         // Failed
         wchar_t err_msg[600] = {0};
         StringCbPrintf((wchar_t *) err_msg, 600, L"Preset was created, but saving it failed:\n%s",
-                       disp_config_get_err_msg(&(ctx->config)));
+                       disp_config_get_err_msg(&config));
+        disp_config_destroy(&config);
         MessageBox(ctx->main_window_hwnd, err_msg, APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
         // TODO: Handle better
         PostQuitMessage(1);
         return;
     }
-    // Reload config etc.
+    disp_config_destroy(&config);
+    // Reload config etc. to publish the saved config
     reload(ctx);
     // Save done, notify user
     show_notification_message(ctx, L"Preset \"%s\" was saved", data.preset_name);
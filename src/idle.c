@@ -0,0 +1,94 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <Windows.h>
+#include <psapi.h>
+#include "app.h"
+#include "idle.h"
+#include "disp.h"
+#include "ui.h"
+#include "log.h"
+
+void get_memory_usage(memory_usage_t *usage) {
+    HANDLE process = GetCurrentProcess();
+    PROCESS_MEMORY_COUNTERS_EX counters = {0};
+    counters.cb = sizeof(PROCESS_MEMORY_COUNTERS_EX);
+    if (!GetProcessMemoryInfo(process, (PROCESS_MEMORY_COUNTERS *) &counters, sizeof(PROCESS_MEMORY_COUNTERS_EX))) {
+        log_warning(L"GetProcessMemoryInfo failed (0x%08X)", GetLastError());
+    }
+    usage->private_bytes = counters.PrivateUsage;
+    usage->working_set = counters.WorkingSetSize;
+    usage->user_handles = GetGuiResources(process, GR_USEROBJECTS);
+    usage->gdi_handles = GetGuiResources(process, GR_GDIOBJECTS);
+}
+
+void log_memory_usage(const wchar_t *when) {
+    memory_usage_t usage;
+    get_memory_usage(&usage);
+    log_info(L"Memory usage %s: %u KiB private, %u KiB working set, %u USER handles, %u GDI handles", when,
+             (UINT) (usage.private_bytes / 1024), (UINT) (usage.working_set / 1024), usage.user_handles,
+             usage.gdi_handles);
+}
+
+void note_activity(app_ctx_t *ctx) {
+    // Restart the idle countdown, the released state is rebuilt lazily by whatever needs it
+    if (ctx->idle) {
+        log_debug(L"Leaving idle mode");
+        ctx->idle = FALSE;
+    }
+    if (ctx->config->idle_timeout_seconds > 0) {
+        SetTimer(ctx->main_window_hwnd, TIMER_IDLE, (UINT) ctx->config->idle_timeout_seconds * 1000, NULL);
+    } else {
+        KillTimer(ctx->main_window_hwnd, TIMER_IDLE);
+    }
+}
+
+void enter_idle_mode(app_ctx_t *ctx) {
+    // Release the state that can be rebuilt on demand and give the memory back to the system
+    KillTimer(ctx->main_window_hwnd, TIMER_IDLE);
+    if (ctx->idle) {
+        return;
+    }
+    GUITHREADINFO gui_info = {.cbSize = sizeof(GUITHREADINFO)};
+    BOOL in_menu = GetGUIThreadInfo(0, &gui_info) && (gui_info.flags & GUI_INMENUMODE);
+    if (ctx->display_update_in_progress || ctx->auto_revert_pending || ctx->launcher_hwnd != NULL || in_menu ||
+        GetWindow(ctx->main_window_hwnd, GW_ENABLEDPOPUP) != NULL) {
+        // Busy, try again later
+        note_activity(ctx);
+        return;
+    }
+    log_memory_usage(L"before entering idle mode");
+
+    // The tray menu and the alignment pattern are rebuilt when they are shown
+    release_ui_caches(ctx);
+    // Mode lists are enumerated again and presets are compiled again when they are applied
+    mode_catalogue_cache_destroy(&(ctx->mode_catalogues));
+    release_apply_plans(ctx);
+    // Replaced configs and topologies whose readers have finished since
+    rcu_reclaim(&(ctx->configs));
+    rcu_reclaim(&(ctx->topologies));
+
+    HeapCompact(GetProcessHeap(), 0);
+    if (!EmptyWorkingSet(GetCurrentProcess())) {
+        log_warning(L"EmptyWorkingSet failed (0x%08X)", GetLastError());
+    }
+    ctx->idle = TRUE;
+    log_memory_usage(L"in idle mode");
+}
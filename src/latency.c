@@ -0,0 +1,70 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdio.h>
+#include <stdlib.h>
+#include "latency.h"
+
+LONGLONG latency_now(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+double latency_ms(LONGLONG start, LONGLONG end) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (double) (end - start) * 1000.0 / (double) frequency.QuadPart;
+}
+
+void latency_add(latency_samples_t *samples, double ms) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity == 0 ? 16 : samples->capacity * 2;
+        samples->ms = realloc(samples->ms, samples->capacity * sizeof(double));
+    }
+    samples->ms[samples->count++] = ms;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double a_val = *(const double *) a;
+    double b_val = *(const double *) b;
+    return a_val < b_val ? -1 : (a_val > b_val ? 1 : 0);
+}
+
+static double percentile(const latency_samples_t *samples, int pct) {
+    // Nearest rank on sorted samples
+    size_t rank = (samples->count * (size_t) pct + 99) / 100;
+    return samples->ms[rank == 0 ? 0 : rank - 1];
+}
+
+void latency_print(const wchar_t *label, latency_samples_t *samples) {
+    if (samples->count == 0) {
+        wprintf(L"  %-32s no samples\n", label);
+        return;
+    }
+    qsort(samples->ms, samples->count, sizeof(double), compare_double);
+    wprintf(L"  %-32s n=%-5u p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f ms\n", label, (UINT) samples->count,
+            percentile(samples, 50), percentile(samples, 90), percentile(samples, 99), samples->ms[samples->count - 1]);
+}
+
+void latency_free(latency_samples_t *samples) {
+    free(samples->ms);
+    ZeroMemory(samples, sizeof(latency_samples_t));
+}
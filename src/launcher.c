@@ -0,0 +1,293 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define UNICODE
+#include <Windows.h>
+#include <windowsx.h>
+#include <Commctrl.h>
+#include <strsafe.h>
+#include "app.h"
+#include "launcher.h"
+#include "search.h"
+#include "disp.h"
+#include "ui.h"
+
+#define IDC_LAUNCHER_QUERY 100
+#define IDC_LAUNCHER_RESULTS 101
+
+#define LAUNCHER_WIDTH 420
+#define LAUNCHER_HEIGHT 320
+
+static WNDPROC launcher_edit_orig_proc = NULL;
+
+static void close_launcher(app_ctx_t *ctx) {
+    // Clear the handle first so that the deactivation during DestroyWindow doesn't close it again
+    HWND hwnd = ctx->launcher_hwnd;
+    ctx->launcher_hwnd = NULL;
+    DestroyWindow(hwnd);
+}
+
+static void update_results(app_ctx_t *ctx) {
+    HWND query_ctrl = GetDlgItem(ctx->launcher_hwnd, IDC_LAUNCHER_QUERY);
+    HWND results_ctrl = GetDlgItem(ctx->launcher_hwnd, IDC_LAUNCHER_RESULTS);
+
+    LARGE_INTEGER freq, start, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    wchar_t query[128] = {0};
+    GetWindowText(query_ctrl, query, 128);
+    wchar_t *folded_query = disp_config_fold_name(query);
+    if (folded_query == NULL) {
+        return;
+    }
+
+    // Resolve the recently used presets of this config
+    int recent[RECENT_PRESET_COUNT];
+    size_t recent_count = 0;
+    for (size_t i = 0; i < ctx->recent_preset_count; i++) {
+        int idx = disp_config_get_preset_idx(ctx->config, ctx->recent_presets[i]);
+        if (idx >= 0) {
+            recent[recent_count++] = idx;
+        }
+    }
+
+    int results[LAUNCHER_MAX_RESULTS];
+    size_t result_count =
+        search_index_query(&(ctx->search_index), ctx->preset_states, folded_query, recent, recent_count, results,
+                           LAUNCHER_MAX_RESULTS);
+    free(folded_query);
+
+    QueryPerformanceCounter(&end);
+
+    // Fill the list without redrawing it for every entry
+    SetWindowRedraw(results_ctrl, FALSE);
+    ListBox_ResetContent(results_ctrl);
+    for (size_t i = 0; i < result_count; i++) {
+        display_preset_t *preset = ctx->config->presets[results[i]];
+        wchar_t entry[200];
+        if (ctx->preset_states[results[i]].applicable == 1) {
+            StringCbCopy(entry, sizeof(entry), preset->name);
+        } else {
+            StringCbPrintf(entry, sizeof(entry), L"%s (not applicable)", preset->name);
+        }
+        int pos = ListBox_AddString(results_ctrl, entry);
+        ListBox_SetItemData(results_ctrl, pos, results[i]);
+    }
+    if (result_count > 0) {
+        ListBox_SetCurSel(results_ctrl, 0);
+    }
+    SetWindowRedraw(results_ctrl, TRUE);
+    InvalidateRect(results_ctrl, NULL, TRUE);
+
+    log_trace(L"Launcher query \"%s\": %u results in %.3f ms", query, (UINT) result_count,
+              (double) (end.QuadPart - start.QuadPart) * 1000.0 / (double) freq.QuadPart);
+}
+
+static void apply_selection(app_ctx_t *ctx) {
+    HWND results_ctrl = GetDlgItem(ctx->launcher_hwnd, IDC_LAUNCHER_RESULTS);
+    int sel = ListBox_GetCurSel(results_ctrl);
+    if (sel == LB_ERR) {
+        return;
+    }
+    int preset_idx = (int) ListBox_GetItemData(results_ctrl, sel);
+    display_preset_t *preset = ctx->config->presets[preset_idx];
+
+    // Close the launcher before applying as the apply reloads the config
+    close_launcher(ctx);
+
+    if (ctx->preset_states[preset_idx].applicable != 1) {
+        log_warning(L"Preset \"%s\" is not applicable", preset->name);
+        show_notification_message(ctx, L"Preset \"%s\" is not applicable", preset->name);
+        return;
+    }
+    log_debug(L"User wants to apply preset %d (\"%s\") from the launcher", preset_idx, preset->name);
+    apply_preset(ctx, preset);
+}
+
+static void move_selection(app_ctx_t *ctx, int delta) {
+    HWND results_ctrl = GetDlgItem(ctx->launcher_hwnd, IDC_LAUNCHER_RESULTS);
+    int count = ListBox_GetCount(results_ctrl);
+    if (count <= 0) {
+        return;
+    }
+    int sel = ListBox_GetCurSel(results_ctrl) + delta;
+    if (sel < 0) {
+        sel = 0;
+    } else if (sel >= count) {
+        sel = count - 1;
+    }
+    ListBox_SetCurSel(results_ctrl, sel);
+}
+
+static LRESULT CALLBACK launcher_edit_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    // The query field handles the list navigation keys so that the focus can stay in the field
+    app_ctx_t *ctx = (app_ctx_t *) GetWindowLongPtr(GetParent(hwnd), GWLP_USERDATA);
+
+    switch (umsg) {
+        case WM_KEYDOWN:
+            switch (wparam) {
+                case VK_UP:
+                    move_selection(ctx, -1);
+                    return 0;
+                case VK_DOWN:
+                    move_selection(ctx, 1);
+                    return 0;
+                case VK_RETURN:
+                    apply_selection(ctx);
+                    return 0;
+                case VK_ESCAPE:
+                    close_launcher(ctx);
+                    return 0;
+            }
+            break;
+
+        case WM_CHAR:
+            if (wparam == L'\r' || wparam == 0x1B) {
+                // Already handled in WM_KEYDOWN, don't let the edit control beep
+                return 0;
+            }
+            break;
+    }
+    return CallWindowProc(launcher_edit_orig_proc, hwnd, umsg, wparam, lparam);
+}
+
+static LRESULT CALLBACK launcher_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    // Get window pointer that points to the app context
+    app_ctx_t *ctx = (app_ctx_t *) GetWindowLongPtr(hwnd, GWLP_USERDATA);
+    if (ctx == NULL) {
+        // The context is set after the window is created
+        return DefWindowProc(hwnd, umsg, wparam, lparam);
+    }
+
+    switch (umsg) {
+        case WM_COMMAND:
+            if (LOWORD(wparam) == IDC_LAUNCHER_QUERY && HIWORD(wparam) == EN_CHANGE) {
+                // Query changed, filter again
+                update_results(ctx);
+            } else if (LOWORD(wparam) == IDC_LAUNCHER_RESULTS && HIWORD(wparam) == LBN_DBLCLK) {
+                apply_selection(ctx);
+            }
+            break;
+
+        case WM_ACTIVATE:
+            if (LOWORD(wparam) == WA_INACTIVE && ctx->launcher_hwnd == hwnd) {
+                // Close when the user clicks elsewhere
+                close_launcher(ctx);
+            }
+            break;
+
+        case WM_DESTROY:
+            if (ctx->launcher_hwnd == hwnd) {
+                ctx->launcher_hwnd = NULL;
+            }
+            break;
+
+        default:
+            return DefWindowProc(hwnd, umsg, wparam, lparam);
+    }
+    return 0;
+}
+
+int init_launcher_window(app_ctx_t *ctx) {
+    WNDCLASSEX wcex = {0};
+    wcex.cbSize = sizeof(WNDCLASSEX);
+    wcex.style = CS_HREDRAW | CS_VREDRAW | CS_DROPSHADOW;
+    wcex.lpfnWndProc = launcher_wnd_proc;
+    wcex.hInstance = ctx->hinstance;
+    wcex.hCursor = LoadCursor(NULL, IDC_ARROW);
+    wcex.hbrBackground = GetSysColorBrush(COLOR_3DFACE);
+    wcex.lpszClassName = LAUNCHER_WND_CLASS;
+
+    if (!RegisterClassEx(&wcex)) {
+        int err = GetLastError();
+        wchar_t *err_msg;
+        get_error_msg(err, &err_msg);
+        log_error(L"RegisterClassEx failed for launcher window: %s (0x%08X)", err_msg, err);
+        LocalFree(err_msg);
+        return 1;
+    }
+    return 0;
+}
+
+HWND show_launcher_window(app_ctx_t *ctx) {
+    if (ctx->launcher_hwnd != NULL) {
+        // Already open
+        SetForegroundWindow(ctx->launcher_hwnd);
+        return ctx->launcher_hwnd;
+    }
+
+    // Center on the work area of the primary monitor
+    RECT work_area;
+    SystemParametersInfo(SPI_GETWORKAREA, 0, &work_area, 0);
+    int x = work_area.left + (work_area.right - work_area.left - LAUNCHER_WIDTH) / 2;
+    int y = work_area.top + (work_area.bottom - work_area.top - LAUNCHER_HEIGHT) / 3;
+
+    HWND hwnd = CreateWindowEx(WS_EX_TOOLWINDOW | WS_EX_TOPMOST, LAUNCHER_WND_CLASS, L"Find preset",
+                               WS_POPUP | WS_CAPTION | WS_SYSMENU, x, y, LAUNCHER_WIDTH, LAUNCHER_HEIGHT, NULL, NULL,
+                               ctx->hinstance, NULL);
+    if (!hwnd) {
+        int err = GetLastError();
+        wchar_t *err_msg;
+        get_error_msg(err, &err_msg);
+        log_error(L"CreateWindowEx failed for launcher window: %s (0x%08X)", err_msg, err);
+        LocalFree(err_msg);
+        return NULL;
+    }
+
+    RECT client;
+    GetClientRect(hwnd, &client);
+    int client_width = client.right - client.left;
+    int client_height = client.bottom - client.top;
+
+    HWND query_ctrl =
+        CreateWindowEx(WS_EX_CLIENTEDGE, L"EDIT", NULL, WS_CHILD | WS_VISIBLE | WS_TABSTOP | ES_AUTOHSCROLL, 8, 8,
+                       client_width - 16, 24, hwnd, (HMENU) IDC_LAUNCHER_QUERY, ctx->hinstance, NULL);
+    HWND results_ctrl = CreateWindowEx(WS_EX_CLIENTEDGE, L"LISTBOX", NULL,
+                                       WS_CHILD | WS_VISIBLE | WS_VSCROLL | LBS_NOTIFY | LBS_NOINTEGRALHEIGHT, 8, 40,
+                                       client_width - 16, client_height - 48, hwnd, (HMENU) IDC_LAUNCHER_RESULTS,
+                                       ctx->hinstance, NULL);
+
+    HFONT font = GetStockFont(DEFAULT_GUI_FONT);
+    SetWindowFont(query_ctrl, font, FALSE);
+    SetWindowFont(results_ctrl, font, FALSE);
+    Edit_SetCueBannerText(query_ctrl, L"Type to filter presets");
+
+    // Subclass the query field for the navigation keys
+    launcher_edit_orig_proc = (WNDPROC) SetWindowLongPtr(query_ctrl, GWLP_WNDPROC, (LONG_PTR) launcher_edit_proc);
+
+    // Set app context as the window user data so the window procedure can access the context without global variables
+    SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR) ctx);
+    SetWindowPos(hwnd, 0, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER);
+    ctx->launcher_hwnd = hwnd;
+
+    update_results(ctx);
+
+    ShowWindow(hwnd, SW_SHOW);
+    SetForegroundWindow(hwnd);
+    SetFocus(query_ctrl);
+
+    return hwnd;
+}
+
+void refresh_launcher_window(app_ctx_t *ctx) {
+    // The result list refers to preset indices, so filter again when the config changes
+    if (ctx->launcher_hwnd != NULL) {
+        update_results(ctx);
+    }
+}
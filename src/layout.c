@@ -0,0 +1,235 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdlib.h>
+#include "layout.h"
+
+// Two displays are adjacent when they share a part of an edge, touching corners don't join desktops
+
+static size_t find_set(size_t *parents, size_t i) {
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+static const RECT *sort_rects; // qsort has no context argument
+
+static int compare_left(const void *a, const void *b) {
+    LONG left_a = sort_rects[*(const size_t *) a].left;
+    LONG left_b = sort_rects[*(const size_t *) b].left;
+    return (left_a > left_b) - (left_a < left_b);
+}
+
+static BOOL rects_overlap(const RECT *a, const RECT *b) {
+    return a->left < b->right && b->left < a->right && a->top < b->bottom && b->top < a->bottom;
+}
+
+static BOOL rects_adjacent(const RECT *a, const RECT *b) {
+    BOOL x_shared = a->left < b->right && b->left < a->right;
+    BOOL y_shared = a->top < b->bottom && b->top < a->bottom;
+    return (x_shared && (a->bottom == b->top || b->bottom == a->top)) ||
+           (y_shared && (a->right == b->left || b->right == a->left));
+}
+
+int layout_check(const RECT *rects, size_t count) {
+    // Sweep the rectangles from left to right, only the ones whose right edge reaches the sweep line can touch
+    // O(n log n) for the sort plus the pairs that share x coordinates, which is small for real desktops
+    if (count <= 1) {
+        return LAYOUT_VALID;
+    }
+    size_t *order = calloc(count, sizeof(size_t));
+    size_t *active = calloc(count, sizeof(size_t));
+    size_t *parents = calloc(count, sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+        parents[i] = i;
+    }
+    sort_rects = rects;
+    qsort(order, count, sizeof(size_t), compare_left);
+
+    int result = LAYOUT_VALID;
+    size_t active_count = 0;
+    size_t sets = count;
+    for (size_t i = 0; i < count && result == LAYOUT_VALID; i++) {
+        const RECT *rect = &(rects[order[i]]);
+        size_t kept = 0;
+        for (size_t a = 0; a < active_count; a++) {
+            const RECT *other = &(rects[active[a]]);
+            if (other->right < rect->left) {
+                // Left behind by the sweep line
+                continue;
+            }
+            active[kept++] = active[a];
+            if (rects_overlap(rect, other)) {
+                result = LAYOUT_OVERLAP;
+            } else if (rects_adjacent(rect, other)) {
+                size_t set_a = find_set(parents, order[i]);
+                size_t set_b = find_set(parents, active[a]);
+                if (set_a != set_b) {
+                    parents[set_a] = set_b;
+                    sets--;
+                }
+            }
+        }
+        active_count = kept;
+        active[active_count++] = order[i];
+    }
+    if (result == LAYOUT_VALID && sets > 1) {
+        result = LAYOUT_DISCONNECTED;
+    }
+
+    free(order);
+    free(active);
+    free(parents);
+    return result;
+}
+
+size_t layout_anchor(const RECT *rects, size_t count) {
+    // The primary display is at the origin and stays in place
+    for (size_t i = 0; i < count; i++) {
+        if (rects[i].left == 0 && rects[i].top == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static BOOL overlaps_placed(const RECT *rect, const RECT *rects, const BOOL *placed, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (placed[i] && rects_overlap(rect, &(rects[i]))) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL adjacent_to_placed(const RECT *rect, const RECT *rects, const BOOL *placed, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (placed[i] && rects_adjacent(rect, &(rects[i]))) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static LONG clamp_long(LONG value, LONG min, LONG max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+static void move_rect(RECT *rect, LONG left, LONG top) {
+    rect->right += left - rect->left;
+    rect->bottom += top - rect->top;
+    rect->left = left;
+    rect->top = top;
+}
+
+static void snap_rect(RECT *rect, const RECT *rects, const BOOL *placed, size_t count) {
+    // Move the rectangle to the closest free spot next to an edge of a placed rectangle
+    // The spot beside the rightmost placed rectangle is always free, so a spot is always found
+    LONG width = rect->right - rect->left;
+    LONG height = rect->bottom - rect->top;
+    RECT best = *rect;
+    LONGLONG best_distance = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (!placed[i]) {
+            continue;
+        }
+        const RECT *other = &(rects[i]);
+        // Keep the offset along the edge when the edges still share a part
+        LONG top = clamp_long(rect->top, other->top - height + 1, other->bottom - 1);
+        LONG left = clamp_long(rect->left, other->left - width + 1, other->right - 1);
+        POINT spots[4] = {{other->right, top}, {other->left - width, top}, {left, other->bottom},
+                          {left, other->top - height}};
+        for (int s = 0; s < 4; s++) {
+            RECT candidate = *rect;
+            move_rect(&candidate, spots[s].x, spots[s].y);
+            LONGLONG distance =
+                llabs((LONGLONG) spots[s].x - rect->left) + llabs((LONGLONG) spots[s].y - rect->top);
+            if ((best_distance < 0 || distance < best_distance) &&
+                !overlaps_placed(&candidate, rects, placed, count)) {
+                best = candidate;
+                best_distance = distance;
+            }
+        }
+    }
+    *rect = best;
+}
+
+size_t layout_snap(RECT *rects, size_t count, size_t anchor, size_t fixed_from) {
+    // Grow the desktop from the anchor: displays that fit where they are keep their position, otherwise the
+    // display closest to the anchor is moved next to the displays placed so far
+    // The rectangles from fixed_from on never move, like the anchor
+    // O(n^3) in the worst case, only run for layouts that failed layout_check
+    if (count <= 1) {
+        return 0;
+    }
+    BOOL *placed = calloc(count, sizeof(BOOL));
+    placed[anchor] = TRUE;
+    size_t placed_count = 1;
+    for (size_t i = fixed_from; i < count; i++) {
+        if (!placed[i]) {
+            placed[i] = TRUE;
+            placed_count++;
+        }
+    }
+    size_t moved = 0;
+    for (; placed_count < count; placed_count++) {
+        size_t next = count;
+        LONGLONG next_distance = -1;
+        for (size_t i = 0; i < count; i++) {
+            if (placed[i]) {
+                continue;
+            }
+            if (!overlaps_placed(&(rects[i]), rects, placed, count) &&
+                adjacent_to_placed(&(rects[i]), rects, placed, count)) {
+                // Fits as is
+                next = i;
+                next_distance = -1;
+                break;
+            }
+            LONGLONG distance = llabs((LONGLONG) rects[i].left - rects[anchor].left) +
+                                llabs((LONGLONG) rects[i].top - rects[anchor].top);
+            if (next_distance < 0 || distance < next_distance) {
+                next = i;
+                next_distance = distance;
+            }
+        }
+        if (next_distance >= 0) {
+            snap_rect(&(rects[next]), rects, placed, count);
+            moved++;
+        }
+        placed[next] = TRUE;
+    }
+    free(placed);
+    return moved;
+}
+
+const wchar_t *layout_result_name(int result) {
+    switch (result) {
+        case LAYOUT_OVERLAP:
+            return L"overlapping displays";
+        case LAYOUT_DISCONNECTED:
+            return L"disconnected displays";
+        default:
+            return L"valid";
+    }
+}
@@ -21,6 +21,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "app.h"
 #include "ui.h"
 #include "disp.h"
+#include "replay.h"
+#include "probe.h"
+#include "metrics.h"
+
+#define METRICS_REPLY_WND_CLASS L"DispMetricsReply"
 
 static void print_help(wchar_t **argv) {
     wprintf(L"Usage: %s [OPTIONS]\n\n", argv[0]);
@@ -35,6 +40,15 @@ static void print_help(wchar_t **argv) {
     wprintf(L"                     disp process running, it will perform the change and the\n");
     wprintf(L"                     commanding process will exit immediately. Otherwise the\n");
     wprintf(L"                     started process will perform the change and keep running.\n");
+    wprintf(L"  -r, --revert       Ask the running disp process to revert the last display\n");
+    wprintf(L"                     change\n");
+    wprintf(L"  --record path      Record the display queries and events to a trace file\n");
+    wprintf(L"  --replay path      Replay a recorded trace without changing any display\n");
+    wprintf(L"  --headless         Run without the tray icon and dialogs, errors are only logged\n");
+    wprintf(L"  --metrics          Print the counters and latency histograms of the running instance\n");
+    wprintf(L"  --probe [N]        Time the display queries and dry run the presets N times (default %d)\n",
+            PROBE_DEFAULT_ITERATIONS);
+    wprintf(L"                     settings, print the stage latencies and exit\n");
     wprintf(L"  -v, --verbose      Verbose output: log all messages to stdout\n");
     wprintf(L"  --color-log        Force colored log output while verbose logging\n");
     wprintf(L"  -l                 Log to file: log all messages to \"disp.log\"\n");
@@ -75,6 +89,71 @@ static int enable_vt_mode() {
     return 0;
 }
 
+static wchar_t *default_config_path(void) {
+    // Check if there exists a config file in the current working directory
+    wchar_t *config_file_path = NULL;
+    if (!PathFileExists(DEFAULT_CONFIG_NAME)) {
+        // No local config file, default to AppData if possible
+        if (disp_config_get_appdata_path(&config_file_path) != DISP_CONFIG_SUCCESS) {
+            log_warning(L"Failed to get AppData config path, using \"" DEFAULT_CONFIG_NAME
+                        "\" relative to the working directory");
+            config_file_path = _wcsdup(DEFAULT_CONFIG_NAME);
+        }
+    } else {
+        config_file_path = _wcsdup(DEFAULT_CONFIG_NAME);
+    }
+    return config_file_path;
+}
+
+static LRESULT CALLBACK metrics_reply_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    if (umsg == WM_COPYDATA) {
+        COPYDATASTRUCT *copydata = (COPYDATASTRUCT *) lparam;
+        if (copydata->dwData == IPC_METRICS_REPLY && copydata->cbData >= sizeof(wchar_t)) {
+            wprintf(L"%.*s", (int) (copydata->cbData / sizeof(wchar_t)), (wchar_t *) copydata->lpData);
+            SetWindowLongPtr(hwnd, GWLP_USERDATA, TRUE);
+            return TRUE;
+        }
+    }
+    return DefWindowProc(hwnd, umsg, wparam, lparam);
+}
+
+static int print_instance_metrics(HINSTANCE h_inst) {
+    // Ask the running instance for its metrics, the reply is sent to us before SendMessage returns
+    HWND existing_main_wnd = FindWindow(MAIN_WND_CLASS, APP_NAME);
+    if (existing_main_wnd == NULL) {
+        wprintf(L"No running instance found\n");
+        return 1;
+    }
+    WNDCLASSEX wc = {0};
+    wc.cbSize = sizeof(WNDCLASSEX);
+    wc.lpfnWndProc = metrics_reply_wnd_proc;
+    wc.hInstance = h_inst;
+    wc.lpszClassName = METRICS_REPLY_WND_CLASS;
+    RegisterClassEx(&wc);
+    HWND reply_hwnd =
+        CreateWindowEx(0, METRICS_REPLY_WND_CLASS, APP_NAME, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, h_inst, NULL);
+    if (reply_hwnd == NULL) {
+        wprintf(L"Could not create a window for the reply\n");
+        return 1;
+    }
+
+    ipc_metrics_request req = {0};
+    req.reply_hwnd = (UINT64) (UINT_PTR) reply_hwnd;
+    COPYDATASTRUCT copydata = {0};
+    copydata.dwData = IPC_METRICS;
+    copydata.cbData = sizeof(ipc_metrics_request);
+    copydata.lpData = &req;
+    SendMessage(existing_main_wnd, WM_COPYDATA, (WPARAM) reply_hwnd, (LPARAM)(LPVOID) &copydata);
+
+    BOOL replied = (BOOL) GetWindowLongPtr(reply_hwnd, GWLP_USERDATA);
+    DestroyWindow(reply_hwnd);
+    if (!replied) {
+        wprintf(L"The running instance didn't reply\n");
+        return 1;
+    }
+    return 0;
+}
+
 int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, int n_show_cmd) {
 
     log_set_level(LOG_WARNING);
@@ -93,6 +172,12 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
 
     wchar_t *config_file_path = NULL;
     wchar_t *apply_preset_name = NULL;
+    BOOL revert = FALSE;
+    wchar_t *record_path = NULL;
+    wchar_t *replay_path = NULL;
+    int probe_iterations = 0;
+    BOOL query_metrics = FALSE;
+    BOOL headless = FALSE;
 
     int is_verbose = 0;
 
@@ -119,6 +204,39 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
             }
             // Read preset name
             apply_preset_name = _wcsdup(argv[++i]);
+        } else if (wcscmp(argv[i], L"--record") == 0 || wcscmp(argv[i], L"--replay") == 0) {
+            // Trace file
+            // A file path should follow
+            if (i + 1 >= argc) {
+                wprintf(L"Missing trace file path\n");
+                print_help(argv);
+                return 1;
+            }
+            if (wcscmp(argv[i], L"--record") == 0) {
+                record_path = _wcsdup(argv[++i]);
+            } else {
+                replay_path = _wcsdup(argv[++i]);
+            }
+        } else if (wcscmp(argv[i], L"--headless") == 0) {
+            // No tray icon, windows or dialogs
+            headless = TRUE;
+        } else if (wcscmp(argv[i], L"--metrics") == 0) {
+            // Metrics of the running instance
+            query_metrics = TRUE;
+        } else if (wcscmp(argv[i], L"--probe") == 0) {
+            // Latency probe, the iteration count is optional
+            probe_iterations = PROBE_DEFAULT_ITERATIONS;
+            if (i + 1 < argc && argv[i + 1][0] >= L'0' && argv[i + 1][0] <= L'9') {
+                probe_iterations = _wtoi(argv[++i]);
+                if (probe_iterations <= 0) {
+                    wprintf(L"Invalid probe iteration count\n");
+                    print_help(argv);
+                    return 1;
+                }
+            }
+        } else if (wcscmp(argv[i], L"-r") == 0 || wcscmp(argv[i], L"--revert") == 0) {
+            // Revert the last change of the running instance
+            revert = TRUE;
         } else if (wcscmp(argv[i], L"-v") == 0 || wcscmp(argv[i], L"--verbose") == 0) {
             // Verbose
             log_set_level(LOG_TRACE);
@@ -142,6 +260,32 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
 
     LocalFree(argv);
 
+    if (query_metrics) {
+        // Only talks to the running instance, keep the console for the report
+        return print_instance_metrics(h_inst);
+    }
+
+    if (probe_iterations > 0) {
+        // Probing only tests the presets, keep the console for the report
+        if (config_file_path == NULL) {
+            config_file_path = default_config_path();
+        }
+        int res = run_probe(config_file_path, probe_iterations);
+        free(config_file_path);
+        return res;
+    }
+
+    if (replay_path != NULL) {
+        // Replaying doesn't touch the displays or the running instance, keep the console for the report
+        if (config_file_path == NULL) {
+            config_file_path = default_config_path();
+        }
+        int res = replay_trace(replay_path, config_file_path);
+        free(replay_path);
+        free(config_file_path);
+        return res;
+    }
+
     if (!is_verbose) {
         // If we're not outputting verbose output, detach the console
         // Otherwise the program would have an open console window floating about
@@ -180,6 +324,19 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
             log_info(L"Sent preset change request to the running process");
             free(apply_preset_name);
         }
+        if (revert) {
+            // Ask the running instance to revert its last change
+            log_info(L"Requesting the running process to revert the last display change");
+            HWND existing_main_wnd = FindWindow(MAIN_WND_CLASS, APP_NAME);
+            if (existing_main_wnd == NULL) {
+                log_error(L"No running instance found even though mutex exists");
+                return 1;
+            }
+            COPYDATASTRUCT copydata = {0};
+            copydata.dwData = IPC_REVERT;
+            SendMessage(existing_main_wnd, WM_COPYDATA, (WPARAM) NULL, (LPARAM)(LPVOID) &copydata);
+            log_info(L"Sent revert request to the running process");
+        }
         log_info(L"An instance is already running, exiting");
         return 0;
     }
@@ -194,7 +351,10 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
                 get_error_msg(err, &err_msg);
                 log_error(L"Failed to open mutex: %s (0x%08X)", err_msg, err);
                 LocalFree(err_msg);
-                MessageBox(NULL, APP_NAME, L"Failed to open mutex, exiting", MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+                if (!headless) {
+                    MessageBox(NULL, APP_NAME, L"Failed to open mutex, exiting",
+                               MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+                }
                 return 1;
             }
         }
@@ -203,7 +363,9 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
         get_error_msg(err, &err_msg);
         log_error(L"Could not create app mutex: %s (0x%08X)", err_msg, err);
         LocalFree(err_msg);
-        MessageBox(NULL, APP_NAME, L"Could not create app mutex, exiting", MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+        if (!headless) {
+            MessageBox(NULL, APP_NAME, L"Could not create app mutex, exiting", MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+        }
         return 1;
     }
 
@@ -214,41 +376,53 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
 
     app_ctx_t app_context = {0};
     app_context.hinstance = h_inst;
+    app_context.headless = headless;
     app_context.display_update_in_progress = FALSE;
     app_context.instance_mutex = instance_mutex;
+    publish_config(&app_context, disp_config_create_published()); // Written to a new config file
+    stage_timer_start(&app_context.startup_timer);
 
+    // Only the stages needed for a usable tray icon run before the message loop, the rest is deferred
     HWND hwnd = init_main_window(&app_context);
-    init_virt_desktop_window(&app_context);
+    stage_timer_log(&app_context.startup_timer, L"main window");
 
-    // Create tray icon
-    create_tray_icon(&app_context);
+    if (!headless) {
+        // Create tray icon
+        create_tray_icon(&app_context);
+        stage_timer_log(&app_context.startup_timer, L"tray icon");
+    }
+
+    if (record_path != NULL) {
+        // The trace starts with the initial display data
+        trace_open(&app_context.trace, record_path);
+        app_context.mode_catalogues.trace = &app_context.trace;
+        free(record_path);
+    }
+
+    // Friendly names of known monitors are served from the cache so that they don't have to be queried first
+    if (disp_config_get_appdata_file(MONITOR_CACHE_NAME, &app_context.monitor_cache_path) == DISP_CONFIG_SUCCESS) {
+        monitor_cache_load(&app_context.monitor_cache, app_context.monitor_cache_path);
+    } else {
+        log_warning(L"Failed to get AppData monitor cache path, monitor names won't be cached");
+    }
 
     // Populate display data
     populate_display_data(&app_context);
+    stage_timer_log(&app_context.startup_timer, L"display data");
 
     // Determine a config file path if it's not supplied in the command line arguments
     if (config_file_path == NULL) {
-        // Check if there exists a config file in the current working directory
-        if (!PathFileExists(DEFAULT_CONFIG_NAME)) {
-            // No local config file, default to AppData if possible
-            if (disp_config_get_appdata_path(&config_file_path) != DISP_CONFIG_SUCCESS) {
-                log_warning(L"Failed to get AppData config path, using \"" DEFAULT_CONFIG_NAME
-                            "\" relative to the working directory");
-                config_file_path = _wcsdup(DEFAULT_CONFIG_NAME);
-            }
-        } else {
-            config_file_path = _wcsdup(DEFAULT_CONFIG_NAME);
-        }
+        config_file_path = default_config_path();
     }
     log_debug(L"Using config file: %s", config_file_path);
 
     // Check if a config file exists
     if (!PathFileExists(config_file_path)) {
         // No config exists, create a config file
-        if (disp_config_save_file(config_file_path, &app_context.config) != DISP_CONFIG_SUCCESS) {
+        if (disp_config_save_file(config_file_path, app_context.config) != DISP_CONFIG_SUCCESS) {
             // Config file creation failed
-            log_error(L"Could not create a config file: %s", disp_config_get_err_msg(&app_context.config));
-            MessageBox(hwnd, L"Could not create a config file", APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+            show_error_message(&app_context, L"Could not create a config file: %s",
+                               disp_config_get_err_msg(app_context.config));
             DestroyWindow(hwnd);
             ReleaseMutex(app_context.instance_mutex);
             log_finish();
@@ -265,18 +439,32 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
         return 1;
     }
     free(config_file_path);
+    stage_timer_log(&app_context.startup_timer, L"config");
 
     flag_matching_presets(&app_context);
 
-    create_tray_menu(&app_context);
+    update_tray_menu(&app_context);
+    stage_timer_log(&app_context.startup_timer, L"tray menu");
 
     // Show a notification
-    if (app_context.config.notify_on_start) {
+    if (app_context.config->notify_on_start) {
         show_notification_message(&app_context, L"Display settings manager is running");
     }
 
     log_info(L"Ready");
 
+    if (revert) {
+        // A new process has nothing to revert
+        log_warning(L"No running instance to revert display changes in");
+    }
+
+    if (apply_preset_name != NULL) {
+        // The requested preset takes priority over the rules
+        app_context.rule_fingerprint = app_context.display_set_fingerprint;
+    } else {
+        apply_matching_rule(&app_context);
+    }
+
     if (apply_preset_name != NULL) {
         // Apply a preset
         log_info(L"Preset change requested, preset name: \"%s\"", apply_preset_name);
@@ -284,21 +472,29 @@ int WINAPI WinMain(HINSTANCE h_inst, HINSTANCE h_previnst, LPSTR lp_cmd_line, in
         free(apply_preset_name);
     }
 
-    // Init OK, start main message loop
-    MSG msg;
-    while (GetMessage(&msg, NULL, 0, 0)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-    }
+    // Init OK, finish the rest of the initialization from the main message loop
+    PostMessage(hwnd, MSG_DEFERRED_INIT, 0, 0);
+    int exit_code = reactor_run(&app_context.reactor);
 
     log_info(L"Cleaning up");
+    unwatch_config_file(&app_context);
+    metrics_log();
     free_monitors(&app_context);
-    disp_config_destroy(&app_context.config);
+    monitor_cache_destroy(&app_context.monitor_cache);
+    free(app_context.monitor_cache_path);
+    mode_catalogue_cache_destroy(&app_context.mode_catalogues);
+    preflight_cache_destroy(&app_context.preflight_cache);
+    free_recent_presets(&app_context);
+    free_snapshots(&app_context);
+    search_index_destroy(&app_context.search_index);
+    free_configs(&app_context);
     free(app_context.config_file_path);
+    free_align_pattern_cache(&app_context);
+    trace_close(&app_context.trace);
     DeleteObject(app_context.align_pattern_font);
     ReleaseMutex(app_context.instance_mutex);
 
     log_info(L"Exiting");
     log_finish();
-    return (int) msg.wParam;
+    return exit_code;
 }
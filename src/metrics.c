@@ -0,0 +1,147 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <Strsafe.h>
+#include "app.h"
+#include "metrics.h"
+#include "latency.h"
+
+typedef struct {
+    LONG64 count;
+    LONG64 sum_us;
+    LONG64 max_us;
+    LONG64 buckets[METRIC_BUCKET_COUNT];
+} histogram_t;
+
+static const wchar_t *counter_names[METRIC_COUNTER_COUNT] = {
+    L"reloads",     L"display_changes", L"dropped_updates", L"presets_applied", L"apply_failures", L"preflight_rejects",
+    L"reverts",     L"config_errors",   L"config_saves",    L"ipc_requests",    L"hotkeys",        L"errors"};
+
+static const wchar_t *histogram_names[METRIC_HISTOGRAM_COUNT] = {L"enumeration", L"config_read", L"reload",
+                                                                 L"mode_set",    L"apply",       L"settle"};
+
+// Updated with interlocked operations only, so no lock is needed
+static LONG64 counters[METRIC_COUNTER_COUNT];
+static histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+
+static LONG64 read_value(LONG64 *value) {
+    // An interlocked read, plain 64-bit reads can tear on 32-bit builds
+    return InterlockedCompareExchange64(value, 0, 0);
+}
+
+static size_t bucket_index(LONG64 us) {
+    // Values below 4 get a bucket each, above that each power of two is split into four buckets
+    if (us < 4) {
+        return (size_t) (us < 0 ? 0 : us);
+    }
+    int octave = 63 - __builtin_clzll((unsigned long long) us);
+    size_t sub = (size_t) (us >> (octave - 2)) & 3;
+    size_t idx = 4 * (size_t) (octave - 1) + sub;
+    return idx < METRIC_BUCKET_COUNT ? idx : METRIC_BUCKET_COUNT - 1;
+}
+
+static LONG64 bucket_upper_bound(size_t idx) {
+    if (idx < 4) {
+        return (LONG64) idx;
+    }
+    int octave = (int) (idx / 4) + 1;
+    LONG64 width = (LONG64) 1 << (octave - 2);
+    return (LONG64) (4 + idx % 4) * width + width - 1;
+}
+
+void metric_inc(metric_counter_t counter) {
+    InterlockedIncrement64(&(counters[counter]));
+}
+
+void metric_record(metric_histogram_t histogram, LONGLONG start, LONGLONG end) {
+    histogram_t *hist = &(histograms[histogram]);
+    LONG64 us = (LONG64) (latency_ms(start, end) * 1000.0);
+    InterlockedIncrement64(&(hist->buckets[bucket_index(us)]));
+    InterlockedExchangeAdd64(&(hist->sum_us), us);
+    InterlockedIncrement64(&(hist->count));
+    LONG64 max_us = read_value(&(hist->max_us));
+    while (us > max_us) {
+        LONG64 prev = InterlockedCompareExchange64(&(hist->max_us), us, max_us);
+        if (prev == max_us) {
+            break;
+        }
+        max_us = prev;
+    }
+}
+
+void metric_since(metric_histogram_t histogram, LONGLONG start) {
+    metric_record(histogram, start, latency_now());
+}
+
+static double percentile_ms(const LONG64 *buckets, LONG64 count, LONG64 max_us, int pct) {
+    // Upper bound of the bucket holding the nearest rank, never above the largest value seen
+    LONG64 rank = (count * pct + 99) / 100;
+    LONG64 seen = 0;
+    for (size_t i = 0; i < METRIC_BUCKET_COUNT; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            LONG64 bound = bucket_upper_bound(i);
+            return (double) (bound < max_us ? bound : max_us) / 1000.0;
+        }
+    }
+    return (double) max_us / 1000.0;
+}
+
+void metrics_format(wchar_t *buf, size_t buf_size) {
+    wchar_t line[200];
+    buf[0] = L'\0';
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        StringCbPrintf(line, sizeof(line), L"%-20s %lld\n", counter_names[i], read_value(&(counters[i])));
+        StringCbCat(buf, buf_size, line);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        histogram_t *hist = &(histograms[i]);
+        // Copy the buckets first, the total is taken from the copy so the percentiles stay consistent
+        LONG64 buckets[METRIC_BUCKET_COUNT];
+        LONG64 count = 0;
+        for (size_t b = 0; b < METRIC_BUCKET_COUNT; b++) {
+            buckets[b] = read_value(&(hist->buckets[b]));
+            count += buckets[b];
+        }
+        if (count == 0) {
+            StringCbPrintf(line, sizeof(line), L"%-20s n=0\n", histogram_names[i]);
+        } else {
+            LONG64 max_us = read_value(&(hist->max_us));
+            StringCbPrintf(line, sizeof(line),
+                           L"%-20s n=%-6lld mean %9.3f  p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f ms\n",
+                           histogram_names[i], count, (double) read_value(&(hist->sum_us)) / 1000.0 / count,
+                           percentile_ms(buckets, count, max_us, 50), percentile_ms(buckets, count, max_us, 90),
+                           percentile_ms(buckets, count, max_us, 99), (double) max_us / 1000.0);
+        }
+        StringCbCat(buf, buf_size, line);
+    }
+}
+
+void metrics_log(void) {
+    wchar_t text[METRICS_TEXT_SIZE / sizeof(wchar_t)];
+    metrics_format(text, sizeof(text));
+    wchar_t *line = text;
+    wchar_t *end;
+    while ((end = wcschr(line, L'\n')) != NULL) {
+        *end = L'\0';
+        log_info(L"Metric %s", line);
+        line = end + 1;
+    }
+}
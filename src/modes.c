@@ -0,0 +1,252 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdlib.h>
+#include <string.h>
+#include <strsafe.h>
+#include "app.h"
+#include "modes.h"
+#include "trace.h"
+#include "log.h"
+
+static BOOL is_rotated(DWORD orientation) {
+    return orientation == DMDO_90 || orientation == DMDO_270;
+}
+
+static UINT64 pack_mode_key(DWORD width, DWORD height, DWORD frequency, DWORD bits_per_pel) {
+    // Widths and heights fit in 16 bits, the top bit keeps real keys nonzero
+    return (1ULL << 63) | ((UINT64) (width & 0xFFFF) << 40) | ((UINT64) (height & 0xFFFF) << 24) |
+           ((UINT64) (frequency & 0xFFFF) << 8) | (UINT64) (bits_per_pel & 0xFF);
+}
+
+static size_t hash_mode_key(UINT64 key) {
+    // Fibonacci hashing, the caller masks the result
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static BOOL is_better_mode(const display_mode_t *a, const display_mode_t *b) {
+    // Prefer higher refresh rates and bit depths for the wildcard keys
+    if (a->frequency != b->frequency) {
+        return a->frequency > b->frequency;
+    }
+    return a->bits_per_pel > b->bits_per_pel;
+}
+
+static void index_insert(mode_catalogue_t *catalogue, UINT64 key, UINT32 mode_idx) {
+    size_t mask = catalogue->index_size - 1;
+    for (size_t slot = hash_mode_key(key) & mask;; slot = (slot + 1) & mask) {
+        mode_index_slot_t *entry = &(catalogue->index[slot]);
+        if (entry->key == 0) {
+            entry->key = key;
+            entry->mode_idx = mode_idx;
+            return;
+        }
+        if (entry->key == key) {
+            if (is_better_mode(&(catalogue->modes[mode_idx]), &(catalogue->modes[entry->mode_idx]))) {
+                entry->mode_idx = mode_idx;
+            }
+            return;
+        }
+    }
+}
+
+static void index_catalogue(mode_catalogue_t *catalogue) {
+    // Every mode is indexed under its exact key and the three wildcard keys, keep the load factor at most 1/2
+    catalogue->index_size = 16;
+    while (catalogue->index_size < catalogue->mode_count * 8) {
+        catalogue->index_size *= 2;
+    }
+    catalogue->index = calloc(catalogue->index_size, sizeof(mode_index_slot_t));
+    for (size_t i = 0; i < catalogue->mode_count; i++) {
+        display_mode_t *mode = &(catalogue->modes[i]);
+        index_insert(catalogue, pack_mode_key(mode->width, mode->height, mode->frequency, mode->bits_per_pel), i);
+        index_insert(catalogue, pack_mode_key(mode->width, mode->height, MODE_ANY, mode->bits_per_pel), i);
+        index_insert(catalogue, pack_mode_key(mode->width, mode->height, mode->frequency, MODE_ANY), i);
+        index_insert(catalogue, pack_mode_key(mode->width, mode->height, MODE_ANY, MODE_ANY), i);
+    }
+}
+
+static mode_catalogue_t *create_catalogue(const wchar_t *device_id, const wchar_t *name) {
+    mode_catalogue_t *catalogue = calloc(1, sizeof(mode_catalogue_t));
+    StringCchCopy(catalogue->device_id, 128, device_id);
+    StringCchCopy(catalogue->name, CCHDEVICENAME, name);
+    return catalogue;
+}
+
+static mode_catalogue_t *build_catalogue(const monitor_t *monitor) {
+    mode_catalogue_t *catalogue = create_catalogue(monitor->info->device_id, monitor->info->name);
+
+    size_t capacity = 64;
+    catalogue->modes = malloc(capacity * sizeof(display_mode_t));
+
+    DEVMODE devmode = {0};
+    devmode.dmSize = sizeof(DEVMODE);
+    for (DWORD i = 0; EnumDisplaySettingsEx(monitor->info->name, i, &devmode, 0); i++) {
+        display_mode_t mode = {0};
+        // Normalize to the native orientation so that rotating the display doesn't change the keys
+        if (is_rotated(devmode.dmDisplayOrientation)) {
+            mode.width = devmode.dmPelsHeight;
+            mode.height = devmode.dmPelsWidth;
+        } else {
+            mode.width = devmode.dmPelsWidth;
+            mode.height = devmode.dmPelsHeight;
+        }
+        mode.frequency = devmode.dmDisplayFrequency;
+        mode.bits_per_pel = devmode.dmBitsPerPel;
+        mode.display_flags = devmode.dmDisplayFlags;
+
+        if (catalogue->mode_count == capacity) {
+            capacity *= 2;
+            catalogue->modes = realloc(catalogue->modes, capacity * sizeof(display_mode_t));
+        }
+        catalogue->modes[catalogue->mode_count++] = mode;
+
+        ZeroMemory(&devmode, sizeof(DEVMODE));
+        devmode.dmSize = sizeof(DEVMODE);
+    }
+
+    index_catalogue(catalogue);
+
+    log_debug(L"Enumerated %u display modes for %s", (UINT) catalogue->mode_count, monitor->info->name);
+    return catalogue;
+}
+
+static void destroy_catalogue(mode_catalogue_t *catalogue) {
+    free(catalogue->modes);
+    free(catalogue->index);
+    free(catalogue);
+}
+
+static mode_catalogue_t *find_catalogue(const mode_catalogue_cache_t *cache, const wchar_t *device_id,
+                                        const wchar_t *name) {
+    for (size_t i = 0; i < cache->count; i++) {
+        mode_catalogue_t *catalogue = cache->catalogues[i];
+        if (wcscmp(catalogue->device_id, device_id) == 0 && wcscmp(catalogue->name, name) == 0) {
+            return catalogue;
+        }
+    }
+    return NULL;
+}
+
+static void cache_append(mode_catalogue_cache_t *cache, mode_catalogue_t *catalogue) {
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity == 0 ? 4 : cache->capacity * 2;
+        cache->catalogues = realloc(cache->catalogues, cache->capacity * sizeof(mode_catalogue_t *));
+    }
+    cache->catalogues[cache->count++] = catalogue;
+}
+
+const mode_catalogue_t *mode_catalogue_get(mode_catalogue_cache_t *cache, const monitor_t *monitor) {
+    // Return the mode catalogue of the monitor, enumerating the modes on first use
+    mode_catalogue_t *catalogue = find_catalogue(cache, monitor->info->device_id, monitor->info->name);
+    if (catalogue != NULL) {
+        return catalogue;
+    }
+    if (cache->replay) {
+        // The trace has no modes for this monitor, it has none so that the result doesn't depend on this machine
+        log_debug(L"No recorded display modes for %s", monitor->info->name);
+        catalogue = create_catalogue(monitor->info->device_id, monitor->info->name);
+    } else {
+        catalogue = build_catalogue(monitor);
+        if (cache->trace != NULL) {
+            trace_modes_t head = {.mode_count = (DWORD) catalogue->mode_count};
+            StringCchCopy(head.device_id, 128, catalogue->device_id);
+            StringCchCopy(head.name, CCHDEVICENAME, catalogue->name);
+            trace_write(cache->trace, TRACE_EVENT_MODES, &head, sizeof(trace_modes_t), catalogue->modes,
+                        (DWORD) (catalogue->mode_count * sizeof(display_mode_t)));
+        }
+    }
+    cache_append(cache, catalogue);
+    return catalogue;
+}
+
+void mode_catalogue_add(mode_catalogue_cache_t *cache, const wchar_t *device_id, const wchar_t *name,
+                        const display_mode_t *modes, size_t mode_count) {
+    // Add a recorded mode list, the first one recorded for a monitor is kept
+    if (find_catalogue(cache, device_id, name) != NULL) {
+        return;
+    }
+    mode_catalogue_t *catalogue = create_catalogue(device_id, name);
+    catalogue->mode_count = mode_count;
+    catalogue->modes = malloc(mode_count * sizeof(display_mode_t) + 1);
+    memcpy(catalogue->modes, modes, mode_count * sizeof(display_mode_t));
+    index_catalogue(catalogue);
+    cache_append(cache, catalogue);
+}
+
+const display_mode_t *mode_catalogue_find(const mode_catalogue_t *catalogue, DWORD width, DWORD height,
+                                          DWORD orientation, DWORD frequency, DWORD bits_per_pel) {
+    // Find a mode with the given size in the given orientation
+    // MODE_ANY frequency or bit depth picks the highest available
+    if (catalogue->index_size == 0) {
+        return NULL;
+    }
+    if (is_rotated(orientation)) {
+        DWORD tmp = width;
+        width = height;
+        height = tmp;
+    }
+    UINT64 key = pack_mode_key(width, height, frequency, bits_per_pel);
+    size_t mask = catalogue->index_size - 1;
+    for (size_t slot = hash_mode_key(key) & mask; catalogue->index[slot].key != 0; slot = (slot + 1) & mask) {
+        if (catalogue->index[slot].key == key) {
+            return &(catalogue->modes[catalogue->index[slot].mode_idx]);
+        }
+    }
+    return NULL;
+}
+
+void mode_catalogue_prune(mode_catalogue_cache_t *cache, const monitor_t *monitors, size_t monitor_count) {
+    // Drop the catalogues of the monitors that are no longer connected to the same output
+    if (cache->replay) {
+        // The recorded mode lists can't be enumerated again
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < cache->count; i++) {
+        mode_catalogue_t *catalogue = cache->catalogues[i];
+        BOOL present = FALSE;
+        for (size_t m = 0; m < monitor_count; m++) {
+            if (wcscmp(catalogue->device_id, monitors[m].info->device_id) == 0 &&
+                wcscmp(catalogue->name, monitors[m].info->name) == 0) {
+                present = TRUE;
+                break;
+            }
+        }
+        if (present) {
+            cache->catalogues[kept++] = catalogue;
+        } else {
+            log_debug(L"Dropping the mode catalogue of %s", catalogue->name);
+            destroy_catalogue(catalogue);
+        }
+    }
+    cache->count = kept;
+}
+
+void mode_catalogue_cache_destroy(mode_catalogue_cache_t *cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        destroy_catalogue(cache->catalogues[i]);
+    }
+    free(cache->catalogues);
+    // The recording and replay settings stay
+    cache->catalogues = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+}
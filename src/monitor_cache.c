@@ -0,0 +1,143 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdlib.h>
+#include <Strsafe.h>
+#include <jansson.h>
+#include "monitor_cache.h"
+#include "util.h"
+#include "log.h"
+
+static monitor_cache_entry_t *add_entry(monitor_cache_t *cache, const wchar_t *device_path) {
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity == 0 ? 8 : cache->capacity * 2;
+        cache->entries = realloc(cache->entries, cache->capacity * sizeof(monitor_cache_entry_t));
+    }
+    monitor_cache_entry_t *entry = &(cache->entries[cache->count++]);
+    ZeroMemory(entry, sizeof(monitor_cache_entry_t));
+    entry->device_path = _wcsdup(device_path);
+    return entry;
+}
+
+BOOL monitor_cache_load(monitor_cache_t *cache, const wchar_t *wpath) {
+    // Read {"monitors": [{"display": ..., "name": ..., "adapter": ..., "target": ...}, ...]}
+    json_error_t json_err;
+    const char *path = wcstombs_alloc(wpath, NULL);
+    json_t *root = json_load_file(path, 0, &json_err);
+    free((char *) path);
+    if (!root) {
+        log_debug(L"No monitor cache loaded from %s", wpath);
+        return FALSE;
+    }
+
+    json_t *monitor_arr;
+    if (json_unpack_ex(root, &json_err, 0, "{s: o}", "monitors", &monitor_arr) != 0 || !json_is_array(monitor_arr)) {
+        log_warning(L"Ignoring invalid monitor cache %s", wpath);
+        json_decref(root);
+        return FALSE;
+    }
+
+    for (size_t i = 0; i < json_array_size(monitor_arr); i++) {
+        char *display_str, *name_str;
+        json_int_t adapter = 0;
+        json_int_t target = 0;
+        if (json_unpack_ex(json_array_get(monitor_arr, i), &json_err, 0, "{s: s, s: s, s?: I, s?: I}", "display",
+                           &display_str, "name", &name_str, "adapter", &adapter, "target", &target) != 0) {
+            log_warning(L"Skipping invalid monitor cache entry %u", (UINT) i);
+            continue;
+        }
+        wchar_t *device_path = mbstowcsdup(display_str, NULL);
+        wchar_t *friendly_name = mbstowcsdup(name_str, NULL);
+        monitor_cache_entry_t *entry = add_entry(cache, device_path);
+        StringCchCopy(entry->friendly_name, 64, friendly_name);
+        entry->adapter_id.LowPart = (DWORD) ((UINT64) adapter & 0xFFFFFFFF);
+        entry->adapter_id.HighPart = (LONG) ((UINT64) adapter >> 32);
+        entry->target_id = (UINT32) target;
+        free(device_path);
+        free(friendly_name);
+    }
+    json_decref(root);
+
+    cache->dirty = FALSE;
+    log_debug(L"Loaded %u monitors from the monitor cache", (UINT) cache->count);
+    return TRUE;
+}
+
+BOOL monitor_cache_save(monitor_cache_t *cache, const wchar_t *wpath) {
+    json_t *monitor_arr = json_array();
+    for (size_t i = 0; i < cache->count; i++) {
+        monitor_cache_entry_t *entry = &(cache->entries[i]);
+        const char *display_str = wcstombs_alloc(entry->device_path, NULL);
+        const char *name_str = wcstombs_alloc(entry->friendly_name, NULL);
+        json_int_t adapter = (json_int_t) (((UINT64) (DWORD) entry->adapter_id.HighPart << 32) |
+                                           entry->adapter_id.LowPart);
+        json_array_append_new(monitor_arr, json_pack("{s: s, s: s, s: I, s: I}", "display", display_str, "name",
+                                                     name_str, "adapter", adapter, "target",
+                                                     (json_int_t) entry->target_id));
+        free((char *) display_str);
+        free((char *) name_str);
+    }
+    json_t *root = json_pack("{s: o}", "monitors", monitor_arr);
+
+    const char *path = wcstombs_alloc(wpath, NULL);
+    int res = json_dump_file(root, path, JSON_INDENT(4));
+    free((char *) path);
+    json_decref(root);
+    if (res != 0) {
+        log_error(L"Failed to write the monitor cache to %s", wpath);
+        return FALSE;
+    }
+    cache->dirty = FALSE;
+    return TRUE;
+}
+
+const monitor_cache_entry_t *monitor_cache_find(const monitor_cache_t *cache, const wchar_t *device_path) {
+    // There are only a handful of monitors, a linear search is enough
+    for (size_t i = 0; i < cache->count; i++) {
+        if (wcscmp(cache->entries[i].device_path, device_path) == 0) {
+            return &(cache->entries[i]);
+        }
+    }
+    return NULL;
+}
+
+void monitor_cache_update(monitor_cache_t *cache, const wchar_t *device_path, const wchar_t *friendly_name,
+                          LUID adapter_id, UINT32 target_id) {
+    monitor_cache_entry_t *entry = (monitor_cache_entry_t *) monitor_cache_find(cache, device_path);
+    if (entry == NULL) {
+        entry = add_entry(cache, device_path);
+        cache->dirty = TRUE;
+    }
+    if (wcsncmp(entry->friendly_name, friendly_name, 63) != 0 || entry->adapter_id.LowPart != adapter_id.LowPart ||
+        entry->adapter_id.HighPart != adapter_id.HighPart || entry->target_id != target_id) {
+        StringCchCopy(entry->friendly_name, 64, friendly_name);
+        entry->adapter_id = adapter_id;
+        entry->target_id = target_id;
+        cache->dirty = TRUE;
+    }
+}
+
+void monitor_cache_destroy(monitor_cache_t *cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        free(cache->entries[i].device_path);
+    }
+    free(cache->entries);
+    ZeroMemory(cache, sizeof(monitor_cache_t));
+}
@@ -0,0 +1,66 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include "pattern.h"
+
+static void fill_span(uint32_t *row, int count, uint32_t color) {
+    // A plain loop storing one value is vectorized by the compiler at -O3
+    for (int i = 0; i < count; i++) {
+        row[i] = color;
+    }
+}
+
+void pattern_fill(const pattern_surface_t *surface, int x, int y, int width, int height, int tile_size,
+                  const uint32_t *colors, size_t color_count) {
+    // Clip to the surface
+    int x_end = x + width < surface->width ? x + width : surface->width;
+    int y_end = y + height < surface->height ? y + height : surface->height;
+    x = x < 0 ? 0 : x;
+    y = y < 0 ? 0 : y;
+    if (x >= x_end || y >= y_end || color_count == 0 || tile_size <= 0) {
+        return;
+    }
+
+    int tile_y = y;
+    while (tile_y < y_end) {
+        int tile_row = tile_y / tile_size;
+        int band_end = (tile_row + 1) * tile_size;
+        band_end = band_end < y_end ? band_end : y_end;
+
+        // Render the first row of the tile band span by span, one span per tile
+        uint32_t *first_row = surface->pixels + (size_t) tile_y * surface->stride;
+        int span_x = x;
+        while (span_x < x_end) {
+            int tile_col = span_x / tile_size;
+            int span_end = (tile_col + 1) * tile_size;
+            span_end = span_end < x_end ? span_end : x_end;
+            uint32_t color = colors[(size_t) (tile_row + 1 + tile_col) % color_count];
+            fill_span(first_row + span_x, span_end - span_x, color);
+            span_x = span_end;
+        }
+
+        // The rest of the band is identical to its first row
+        size_t row_bytes = (size_t) (x_end - x) * sizeof(uint32_t);
+        for (int row_y = tile_y + 1; row_y < band_end; row_y++) {
+            memcpy(surface->pixels + (size_t) row_y * surface->stride + x, first_row + x, row_bytes);
+        }
+        tile_y = band_end;
+    }
+}
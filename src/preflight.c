@@ -0,0 +1,143 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdlib.h>
+#include "app.h"
+#include "preflight.h"
+#include "plan.h"
+#include "util.h"
+#include "log.h"
+
+// The cache is cleared instead of growing past this, results are cheap to recompute
+#define PREFLIGHT_CACHE_MAX_ENTRIES 4096
+
+static UINT64 hash_wstr(UINT64 hash, const wchar_t *str) {
+    // Include the terminator so that consecutive strings can't run together
+    return hash_fnv1a64(hash, str, (wcslen(str) + 1) * sizeof(wchar_t));
+}
+
+static UINT64 hash_int(UINT64 hash, int value) {
+    return hash_fnv1a64(hash, &value, sizeof(int));
+}
+
+UINT64 preflight_topology_fingerprint(const monitor_t *monitors, size_t monitor_count) {
+    // Monitors and the outputs they're connected to, independent of the monitor order
+    UINT64 fingerprint = monitor_count;
+    for (size_t i = 0; i < monitor_count; i++) {
+        UINT64 hash = hash_wstr(HASH_FNV1A64_INIT, monitors[i].info->device_id);
+        hash = hash_wstr(hash, monitors[i].info->name);
+        fingerprint += hash_mix64(hash);
+    }
+    // Keep 0 free for empty cache slots
+    return fingerprint == 0 ? 1 : fingerprint;
+}
+
+const DEVMODE *preflight_target_devmode(const monitor_info_t *info, const apply_plan_t *plan) {
+    // Settings the display has once the plan is applied, the plan only has steps for the displays that change
+    for (size_t i = 0; i < plan->step_count; i++) {
+        if (wcscmp(plan->steps[i].name, info->name) == 0) {
+            return &(plan->steps[i].devmode);
+        }
+    }
+    return &(info->devmode);
+}
+
+UINT64 preflight_target_hash(const monitor_info_t *monitor_info, size_t monitor_count, const apply_plan_t *plan) {
+    // Hash of the whole desktop the plan leads to, including the displays it doesn't change
+    // The snapped positions and the uncovered displays of subset presets are part of it
+    UINT64 target = monitor_count;
+    for (size_t i = 0; i < monitor_count; i++) {
+        const DEVMODE *devmode = preflight_target_devmode(&(monitor_info[i]), plan);
+        UINT64 hash = hash_wstr(HASH_FNV1A64_INIT, monitor_info[i].name);
+        hash = hash_int(hash, (int) devmode->dmDisplayOrientation);
+        hash = hash_int(hash, (int) devmode->dmPosition.x);
+        hash = hash_int(hash, (int) devmode->dmPosition.y);
+        hash = hash_int(hash, (int) devmode->dmPelsWidth);
+        hash = hash_int(hash, (int) devmode->dmPelsHeight);
+        hash = hash_int(hash, (int) devmode->dmDisplayFrequency);
+        hash = hash_int(hash, (int) devmode->dmBitsPerPel);
+        target += hash_mix64(hash);
+    }
+    return target;
+}
+
+static size_t find_slot(const preflight_cache_t *cache, UINT64 topology, UINT64 preset) {
+    // Returns the slot of the entry or the empty slot where it should be inserted
+    size_t mask = cache->size - 1;
+    size_t slot = (size_t) ((topology ^ preset) * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+    while (cache->entries[slot].topology != 0 &&
+           (cache->entries[slot].topology != topology || cache->entries[slot].preset != preset)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+int preflight_cache_get(const preflight_cache_t *cache, UINT64 topology, UINT64 preset) {
+    if (cache->size == 0) {
+        return PREFLIGHT_UNKNOWN;
+    }
+    const preflight_entry_t *entry = &(cache->entries[find_slot(cache, topology, preset)]);
+    if (entry->topology == 0) {
+        return PREFLIGHT_UNKNOWN;
+    }
+    if (entry->result == PREFLIGHT_FAILED && GetTickCount() - entry->tick >= PREFLIGHT_FAILED_RETRY_MS) {
+        // The driver may have refused it only for a moment, test it again
+        return PREFLIGHT_UNKNOWN;
+    }
+    return entry->result;
+}
+
+void preflight_cache_put(preflight_cache_t *cache, UINT64 topology, UINT64 preset, int result) {
+    if (cache->count >= PREFLIGHT_CACHE_MAX_ENTRIES) {
+        // Start over
+        log_debug(L"Preflight cache is full, clearing it");
+        ZeroMemory(cache->entries, cache->size * sizeof(preflight_entry_t));
+        cache->count = 0;
+    } else if ((cache->count + 1) * 2 > cache->size) {
+        // Grow to keep the load factor at most 1/2
+        preflight_cache_t grown = {0};
+        grown.size = cache->size == 0 ? 64 : cache->size * 2;
+        grown.entries = calloc(grown.size, sizeof(preflight_entry_t));
+        for (size_t i = 0; i < cache->size; i++) {
+            preflight_entry_t *old = &(cache->entries[i]);
+            if (old->topology != 0) {
+                grown.entries[find_slot(&grown, old->topology, old->preset)] = *old;
+                grown.count++;
+            }
+        }
+        free(cache->entries);
+        *cache = grown;
+    }
+    preflight_entry_t *entry = &(cache->entries[find_slot(cache, topology, preset)]);
+    if (entry->topology == 0) {
+        entry->topology = topology;
+        entry->preset = preset;
+        cache->count++;
+    }
+    entry->result = result;
+    entry->tick = GetTickCount();
+}
+
+void preflight_cache_destroy(preflight_cache_t *cache) {
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->size = 0;
+    cache->count = 0;
+}
@@ -0,0 +1,316 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdio.h>
+#include <stdlib.h>
+#include <Strsafe.h>
+#include "app.h"
+#include "probe.h"
+#include "latency.h"
+#include "disp.h"
+#include "layout.h"
+#include "search.h"
+#include "launcher.h"
+
+typedef enum {
+    PROBE_STAGE_POPULATE,
+    PROBE_STAGE_DISPLAY_CONFIG,
+    PROBE_STAGE_PRESETS,
+    PROBE_STAGE_LAYOUT_CHECK,
+    PROBE_STAGE_LAYOUT_SNAP,
+    PROBE_STAGE_SEARCH_BUILD,
+    PROBE_STAGE_SEARCH_QUERY,
+    PROBE_STAGE_COUNT
+} probe_stage_t;
+
+static const wchar_t *probe_stage_names[PROBE_STAGE_COUNT] = {
+    L"populate_display_data", L"QueryDisplayConfig", L"preset matching", L"layout check, 64 display wall",
+    L"layout snap, 64 display wall", L"search index build, 50k names", L"search query, 50k names"};
+
+// Simulated video wall for timing the layout engine, the real desktops are too small to measure
+#define PROBE_WALL_COLUMNS 8
+#define PROBE_WALL_ROWS 8
+#define PROBE_WALL_JITTER 100
+
+// Synthetic preset library for timing the launcher search, a query has to stay well under a frame
+#define PROBE_SEARCH_NAMES 50000
+
+static const wchar_t *probe_search_words[] = {L"Desk", L"Home", L"Office", L"Dock", L"Gaming", L"Movie",
+                                              L"Left", L"Right", L"Portrait", L"Wall", L"Travel", L"Meeting"};
+#define PROBE_SEARCH_WORD_COUNT (sizeof(probe_search_words) / sizeof(probe_search_words[0]))
+
+static const wchar_t *probe_search_queries[] = {L"d", L"desk", L"ome", L"gaming 12", L"portrait wall", L"zzz"};
+#define PROBE_SEARCH_QUERY_COUNT (sizeof(probe_search_queries) / sizeof(probe_search_queries[0]))
+
+typedef enum {
+    PROBE_MONITOR_CURRENT_MODE,
+    PROBE_MONITOR_DEVICE_ID,
+    PROBE_MONITOR_MODE_LIST,
+    PROBE_MONITOR_COUNT
+} probe_monitor_stage_t;
+
+static const wchar_t *probe_monitor_stage_names[PROBE_MONITOR_COUNT] = {L"current mode", L"device ID", L"mode list"};
+
+typedef struct {
+    wchar_t label[100];
+    latency_samples_t stages[PROBE_MONITOR_COUNT];
+} probe_monitor_t;
+
+static void probe_display_config(latency_samples_t *samples) {
+    // Time the query that the friendly names are resolved from
+    LONGLONG start = latency_now();
+    UINT32 num_of_paths;
+    UINT32 num_of_modes;
+    if (GetDisplayConfigBufferSizes(QDC_ONLY_ACTIVE_PATHS, &num_of_paths, &num_of_modes) != ERROR_SUCCESS) {
+        return;
+    }
+    DISPLAYCONFIG_PATH_INFO *paths = calloc(num_of_paths, sizeof(DISPLAYCONFIG_PATH_INFO));
+    DISPLAYCONFIG_MODE_INFO *modes = calloc(num_of_modes, sizeof(DISPLAYCONFIG_MODE_INFO));
+    LONG ret = QueryDisplayConfig(QDC_ONLY_ACTIVE_PATHS, &num_of_paths, paths, &num_of_modes, modes, NULL);
+    LONGLONG end = latency_now();
+    free(paths);
+    free(modes);
+    if (ret == ERROR_SUCCESS) {
+        latency_add(samples, latency_ms(start, end));
+    }
+}
+
+static void probe_monitor(const monitor_t *mon, probe_monitor_t *probe) {
+    // Time the per-monitor queries of populate_display_data and the mode enumeration one by one
+    const wchar_t *name = mon->info->name;
+    DEVMODE devmode = {0};
+    devmode.dmSize = sizeof(DEVMODE);
+    LONGLONG start = latency_now();
+    EnumDisplaySettings(name, ENUM_CURRENT_SETTINGS, &devmode);
+    latency_add(&(probe->stages[PROBE_MONITOR_CURRENT_MODE]), latency_ms(start, latency_now()));
+
+    DISPLAY_DEVICE dd_mon = {0};
+    dd_mon.cb = sizeof(DISPLAY_DEVICE);
+    start = latency_now();
+    for (DWORD i = 0; EnumDisplayDevices(name, i, &dd_mon, EDD_GET_DEVICE_INTERFACE_NAME); i++) {
+        ZeroMemory(&dd_mon, sizeof(DISPLAY_DEVICE));
+        dd_mon.cb = sizeof(DISPLAY_DEVICE);
+    }
+    latency_add(&(probe->stages[PROBE_MONITOR_DEVICE_ID]), latency_ms(start, latency_now()));
+
+    start = latency_now();
+    for (DWORD i = 0; EnumDisplaySettingsEx(name, i, &devmode, 0); i++) {
+        devmode.dmSize = sizeof(DEVMODE);
+    }
+    latency_add(&(probe->stages[PROBE_MONITOR_MODE_LIST]), latency_ms(start, latency_now()));
+}
+
+static void probe_layout(latency_samples_t *check_samples, latency_samples_t *snap_samples) {
+    // Jitter a wall of 1920x1080 displays, with every other column rotated, so that it has to be snapped
+    RECT rects[PROBE_WALL_COLUMNS * PROBE_WALL_ROWS];
+    for (int i = 0; i < PROBE_WALL_COLUMNS * PROBE_WALL_ROWS; i++) {
+        int column = i % PROBE_WALL_COLUMNS;
+        LONG width = column % 2 == 0 ? 1920 : 1080;
+        LONG height = column % 2 == 0 ? 1080 : 1920;
+        rects[i].left = (column / 2) * (1920 + 1080) + (column % 2) * 1920;
+        rects[i].top = (i / PROBE_WALL_COLUMNS) * 1920;
+        if (i > 0) {
+            rects[i].left += rand() % (2 * PROBE_WALL_JITTER + 1) - PROBE_WALL_JITTER;
+            rects[i].top += rand() % (2 * PROBE_WALL_JITTER + 1) - PROBE_WALL_JITTER;
+        }
+        rects[i].right = rects[i].left + width;
+        rects[i].bottom = rects[i].top + height;
+    }
+    size_t count = PROBE_WALL_COLUMNS * PROBE_WALL_ROWS;
+    LONGLONG start = latency_now();
+    layout_check(rects, count);
+    LONGLONG check_end = latency_now();
+    layout_snap(rects, count, layout_anchor(rects, count), count);
+    LONGLONG snap_end = latency_now();
+    latency_add(check_samples, latency_ms(start, check_end));
+    latency_add(snap_samples, latency_ms(check_end, snap_end));
+}
+
+static preset_state_t *build_search_library(app_config_t *library) {
+    // Names of two random words and a number, like "Office Dock 1234"
+    // Returns the state of the presets, about every eighth one is applicable
+    library->preset_count = PROBE_SEARCH_NAMES;
+    library->presets = calloc(PROBE_SEARCH_NAMES, sizeof(display_preset_t *));
+    preset_state_t *states = calloc(PROBE_SEARCH_NAMES, sizeof(preset_state_t));
+    for (size_t i = 0; i < PROBE_SEARCH_NAMES; i++) {
+        wchar_t name[64];
+        StringCbPrintf(name, sizeof(name), L"%s %s %u", probe_search_words[rand() % PROBE_SEARCH_WORD_COUNT],
+                       probe_search_words[rand() % PROBE_SEARCH_WORD_COUNT], (UINT) i);
+        display_preset_t *preset = calloc(1, sizeof(display_preset_t));
+        preset->name = wcsdup(name);
+        preset->name_folded = disp_config_fold_name(name);
+        preset->idx = (int) i;
+        states[i].applicable = rand() % 8 == 0;
+        library->presets[i] = preset;
+    }
+    return states;
+}
+
+static void free_search_library(app_config_t *library) {
+    for (size_t i = 0; i < library->preset_count; i++) {
+        free((wchar_t *) library->presets[i]->name);
+        free((wchar_t *) library->presets[i]->name_folded);
+        free(library->presets[i]);
+    }
+    free(library->presets);
+}
+
+static void probe_search(const app_config_t *library, const preset_state_t *states, latency_samples_t *build_samples,
+                         latency_samples_t *query_samples) {
+    // Rebuild the index like a config read does and run the queries the launcher would
+    preset_search_index_t index = {0};
+    LONGLONG start = latency_now();
+    search_index_build(&index, library);
+    latency_add(build_samples, latency_ms(start, latency_now()));
+    int results[LAUNCHER_MAX_RESULTS];
+    for (size_t q = 0; q < PROBE_SEARCH_QUERY_COUNT; q++) {
+        wchar_t *folded_query = disp_config_fold_name(probe_search_queries[q]);
+        start = latency_now();
+        search_index_query(&index, states, folded_query, NULL, 0, results, LAUNCHER_MAX_RESULTS);
+        latency_add(query_samples, latency_ms(start, latency_now()));
+        free(folded_query);
+    }
+    search_index_destroy(&index);
+}
+
+static BOOL test_devmode(const wchar_t *name, const DEVMODE *devmode) {
+    return ChangeDisplaySettingsEx(name, (DEVMODE *) devmode, NULL, CDS_TEST, NULL) == DISP_CHANGE_SUCCESSFUL;
+}
+
+static void probe_preset(app_ctx_t *ctx, display_preset_t *preset, latency_samples_t *samples, size_t *failures) {
+    // Dry run the preset, nothing is changed
+    LONGLONG start = latency_now();
+    apply_plan_t *plan = get_apply_plan(ctx, preset);
+    BOOL ok = plan != NULL;
+    if (plan != NULL && plan->step_count > 0) {
+        for (size_t i = 0; i < plan->step_count && ok; i++) {
+            ok = test_devmode(plan->steps[i].name, &(plan->steps[i].devmode));
+        }
+    } else if (plan != NULL) {
+        // Already active, test the current settings so that the driver still does the same validation
+        for (size_t i = 0; i < ctx->monitor_count && ok; i++) {
+            ok = test_devmode(ctx->monitor_info[i].name, &(ctx->monitor_info[i].devmode));
+        }
+    }
+    latency_add(samples, latency_ms(start, latency_now()));
+    if (!ok) {
+        (*failures)++;
+    }
+}
+
+int run_probe(const wchar_t *config_path, int iterations) {
+    app_ctx_t ctx = {0};
+    published_config_t *config = disp_config_create_published();
+    if (disp_config_read_file(config_path, &(config->config)) != DISP_CONFIG_SUCCESS) {
+        wprintf(L"Could not read configuration file %s:\n%s\n", config_path,
+                disp_config_get_err_msg(&(config->config)));
+        config->head.destroy(&(config->head));
+        return 1;
+    }
+    publish_config(&ctx, config);
+
+    latency_samples_t stages[PROBE_STAGE_COUNT] = {0};
+    size_t probe_monitor_count = 0;
+    probe_monitor_t *monitors = NULL;
+    size_t preset_count = ctx.config->preset_count;
+    latency_samples_t *presets = calloc(preset_count, sizeof(latency_samples_t));
+    size_t *preset_failures = calloc(preset_count, sizeof(size_t));
+
+    app_config_t search_library = {0};
+    preset_state_t *search_states = build_search_library(&search_library);
+
+    wprintf(L"Probing %d iterations...\n", iterations);
+    for (int iter = 0; iter < iterations; iter++) {
+        LONGLONG start = latency_now();
+        populate_display_data(&ctx);
+        latency_add(&(stages[PROBE_STAGE_POPULATE]), latency_ms(start, latency_now()));
+
+        probe_display_config(&(stages[PROBE_STAGE_DISPLAY_CONFIG]));
+
+        if (monitors == NULL) {
+            // Label the monitors by their position in the first iteration
+            probe_monitor_count = ctx.monitor_count;
+            monitors = calloc(probe_monitor_count, sizeof(probe_monitor_t));
+            for (size_t i = 0; i < probe_monitor_count; i++) {
+                const monitor_t *mon = &(ctx.monitors[ctx.monitor_order[i]]);
+                StringCbPrintf(monitors[i].label, sizeof(monitors[i].label), L"%u: %s (%s)", mon->num,
+                               mon->info->friendly_name, mon->info->name);
+            }
+        }
+        for (size_t i = 0; i < probe_monitor_count && i < ctx.monitor_count; i++) {
+            probe_monitor(&(ctx.monitors[ctx.monitor_order[i]]), &(monitors[i]));
+        }
+
+        // Every pass starts from a clean preset state, so a display unplugged while probing isn't tested
+        start = latency_now();
+        flag_matching_presets(&ctx);
+        latency_add(&(stages[PROBE_STAGE_PRESETS]), latency_ms(start, latency_now()));
+
+        probe_layout(&(stages[PROBE_STAGE_LAYOUT_CHECK]), &(stages[PROBE_STAGE_LAYOUT_SNAP]));
+        probe_search(&search_library, search_states, &(stages[PROBE_STAGE_SEARCH_BUILD]),
+                     &(stages[PROBE_STAGE_SEARCH_QUERY]));
+
+        for (size_t i = 0; i < preset_count; i++) {
+            if (ctx.preset_states[i].applicable == 1) {
+                probe_preset(&ctx, ctx.config->presets[i], &(presets[i]), &(preset_failures[i]));
+            }
+        }
+    }
+
+    wprintf(L"\nStages:\n");
+    for (int i = 0; i < PROBE_STAGE_COUNT; i++) {
+        latency_print(probe_stage_names[i], &(stages[i]));
+        latency_free(&(stages[i]));
+    }
+    for (size_t m = 0; m < probe_monitor_count; m++) {
+        wprintf(L"\nDisplay %s:\n", monitors[m].label);
+        for (int i = 0; i < PROBE_MONITOR_COUNT; i++) {
+            latency_print(probe_monitor_stage_names[i], &(monitors[m].stages[i]));
+            latency_free(&(monitors[m].stages[i]));
+        }
+    }
+    wprintf(L"\nPreset dry runs (CDS_TEST):\n");
+    size_t tested = 0;
+    for (size_t i = 0; i < preset_count; i++) {
+        if (presets[i].count == 0) {
+            continue;
+        }
+        tested++;
+        latency_print(ctx.config->presets[i]->name, &(presets[i]));
+        if (preset_failures[i] > 0) {
+            wprintf(L"  %-32s rejected by the driver %u times\n", L"", (UINT) preset_failures[i]);
+        }
+        latency_free(&(presets[i]));
+    }
+    if (tested == 0) {
+        wprintf(L"  No applicable presets\n");
+    }
+
+    free(monitors);
+    free(presets);
+    free(preset_failures);
+    free_search_library(&search_library);
+    free(search_states);
+    free_monitors(&ctx);
+    preflight_cache_destroy(&(ctx.preflight_cache));
+    mode_catalogue_cache_destroy(&(ctx.mode_catalogues));
+    free_configs(&ctx);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include "rcu.h"
+
+void rcu_publish(rcu_domain_t *domain, rcu_object_t *object) {
+    object->refs = 0;
+    object->retired_next = NULL;
+    rcu_object_t *prev = InterlockedExchangePointer((PVOID volatile *) &(domain->current), object);
+    if (prev != NULL) {
+        prev->retired_next = domain->retired;
+        domain->retired = prev;
+    }
+    rcu_reclaim(domain);
+}
+
+rcu_object_t *rcu_acquire(rcu_domain_t *domain) {
+    // While acquiring is raised the writer doesn't destroy anything, so the object can't go away between the load
+    // and the reference
+    InterlockedIncrement(&(domain->acquiring));
+    rcu_object_t *object = InterlockedCompareExchangePointer((PVOID volatile *) &(domain->current), NULL, NULL);
+    if (object != NULL) {
+        InterlockedIncrement(&(object->refs));
+    }
+    InterlockedDecrement(&(domain->acquiring));
+    return object;
+}
+
+void rcu_release(rcu_object_t *object) {
+    // The writer destroys the object on its next reclaim if it has been replaced
+    if (object != NULL) {
+        InterlockedDecrement(&(object->refs));
+    }
+}
+
+void rcu_reclaim(rcu_domain_t *domain) {
+    if (InterlockedCompareExchange(&(domain->acquiring), 0, 0) != 0) {
+        // A reader may be about to reference a retired object, try again on the next publish
+        return;
+    }
+    rcu_object_t **link = &(domain->retired);
+    while (*link != NULL) {
+        rcu_object_t *object = *link;
+        if (InterlockedCompareExchange(&(object->refs), 0, 0) == 0) {
+            *link = object->retired_next;
+            object->destroy(object);
+        } else {
+            link = &(object->retired_next);
+        }
+    }
+}
+
+void rcu_domain_destroy(rcu_domain_t *domain) {
+    rcu_object_t *current = InterlockedExchangePointer((PVOID volatile *) &(domain->current), NULL);
+    if (current != NULL) {
+        current->destroy(current);
+    }
+    while (domain->retired != NULL) {
+        rcu_object_t *object = domain->retired;
+        domain->retired = object->retired_next;
+        object->destroy(object);
+    }
+}
@@ -0,0 +1,83 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include "app.h"
+#include "reactor.h"
+
+BOOL reactor_add(reactor_t *reactor, HANDLE handle, reactor_handler_t handler, void *data) {
+    if (reactor->count == REACTOR_MAX_SOURCES) {
+        log_error(L"Too many event sources");
+        return FALSE;
+    }
+    reactor->handles[reactor->count] = handle;
+    reactor->sources[reactor->count].handler = handler;
+    reactor->sources[reactor->count].data = data;
+    reactor->count++;
+    return TRUE;
+}
+
+void reactor_remove(reactor_t *reactor, HANDLE handle) {
+    for (size_t i = 0; i < reactor->count; i++) {
+        if (reactor->handles[i] == handle) {
+            // Keep the arrays packed, the wait takes them as is
+            reactor->count--;
+            reactor->handles[i] = reactor->handles[reactor->count];
+            reactor->sources[i] = reactor->sources[reactor->count];
+            return;
+        }
+    }
+}
+
+static BOOL pump_messages(int *exit_code) {
+    // Dispatch everything that is queued, returns FALSE on WM_QUIT
+    MSG msg;
+    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+        if (msg.message == WM_QUIT) {
+            *exit_code = (int) msg.wParam;
+            return FALSE;
+        }
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+    return TRUE;
+}
+
+int reactor_run(reactor_t *reactor) {
+    int exit_code = 0;
+    while (1) {
+        // Sleeps until something happens, completion routines of alertable I/O run inside the wait
+        DWORD count = (DWORD) reactor->count;
+        DWORD ret = MsgWaitForMultipleObjectsEx(count, reactor->handles, INFINITE, QS_ALLINPUT,
+                                                MWMO_INPUTAVAILABLE | MWMO_ALERTABLE);
+        if (ret < WAIT_OBJECT_0 + count) {
+            // The handler may remove sources, don't touch the arrays after calling it
+            reactor_source_t source = reactor->sources[ret - WAIT_OBJECT_0];
+            source.handler(source.data);
+        } else if (ret == WAIT_FAILED) {
+            log_error(L"Waiting for events failed (0x%08X)", GetLastError());
+            return 1;
+        }
+        // The wait reports the lowest signaled handle only, pumping after every wake keeps a busy handle from
+        // starving the message queue
+        if (!pump_messages(&exit_code)) {
+            return exit_code;
+        }
+    }
+}
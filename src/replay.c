@@ -0,0 +1,209 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "replay.h"
+#include "trace.h"
+#include "latency.h"
+#include "disp.h"
+#include "ui.h"
+
+typedef enum {
+    STAGE_RECORDED_QUERY,
+    STAGE_RECORDED_SETTLE,
+    STAGE_DISPLAY_DATA,
+    STAGE_PRESETS,
+    STAGE_APPLY_PLANS,
+    STAGE_RULES,
+    STAGE_TRAY_MENU,
+    STAGE_IPC_PRESET,
+    STAGE_COUNT
+} replay_stage_t;
+
+static const wchar_t *stage_names[STAGE_COUNT] = {
+    L"display queries (recorded)", L"change to data ready (recorded)", L"display data", L"preset matching",
+    L"apply plans", L"rules", L"tray menu model", L"IPC preset lookup"};
+
+static void replay_monitors(app_ctx_t *ctx, const BYTE *payload, DWORD size, latency_samples_t *stages) {
+    trace_monitors_t head;
+    if (size < sizeof(trace_monitors_t)) {
+        return;
+    }
+    memcpy(&head, payload, sizeof(trace_monitors_t));
+    if (size < sizeof(trace_monitors_t) + head.monitor_count * sizeof(trace_monitor_t)) {
+        log_warning(L"Ignoring a truncated monitor record");
+        return;
+    }
+    // Copy the records so that they are aligned
+    trace_monitor_t *monitors = malloc(head.monitor_count * sizeof(trace_monitor_t));
+    memcpy(monitors, payload + sizeof(trace_monitors_t), head.monitor_count * sizeof(trace_monitor_t));
+
+    LONGLONG start = latency_now();
+    replay_display_data(ctx, monitors, head.monitor_count);
+    LONGLONG data_end = latency_now();
+    // The config is read once, the matching pass clears what the previous snapshot's topology left behind
+    flag_matching_presets(ctx);
+    LONGLONG presets_end = latency_now();
+    compile_applicable_presets(ctx);
+    LONGLONG plans_end = latency_now();
+    display_preset_t *rule_preset = get_rule_preset(ctx);
+    if (rule_preset != NULL) {
+        get_apply_plan(ctx, rule_preset);
+    }
+    LONGLONG rules_end = latency_now();
+    update_tray_menu(ctx);
+    LONGLONG menu_end = latency_now();
+
+    latency_add(&(stages[STAGE_DISPLAY_DATA]), latency_ms(start, data_end));
+    latency_add(&(stages[STAGE_PRESETS]), latency_ms(data_end, presets_end));
+    latency_add(&(stages[STAGE_APPLY_PLANS]), latency_ms(presets_end, plans_end));
+    latency_add(&(stages[STAGE_RULES]), latency_ms(plans_end, rules_end));
+    latency_add(&(stages[STAGE_TRAY_MENU]), latency_ms(rules_end, menu_end));
+    free(monitors);
+}
+
+static void load_recorded_modes(app_ctx_t *ctx, trace_reader_t *reader) {
+    // A mode list is recorded when it is first needed, which is after the display query that needed it
+    // All of them are loaded up front so that no plan is compiled against the displays of this machine
+    ctx->mode_catalogues.replay = TRUE;
+    const trace_record_t *record;
+    const BYTE *payload;
+    while (trace_next(reader, &record, &payload)) {
+        trace_modes_t head;
+        if (record->type != TRACE_EVENT_MODES || record->size < sizeof(trace_modes_t)) {
+            continue;
+        }
+        memcpy(&head, payload, sizeof(trace_modes_t));
+        if (record->size < sizeof(trace_modes_t) + head.mode_count * sizeof(display_mode_t)) {
+            log_warning(L"Ignoring a truncated mode record");
+            continue;
+        }
+        head.device_id[127] = L'\0';
+        head.name[CCHDEVICENAME - 1] = L'\0';
+        // Copy the records so that they are aligned
+        display_mode_t *modes = malloc(head.mode_count * sizeof(display_mode_t) + 1);
+        memcpy(modes, payload + sizeof(trace_modes_t), head.mode_count * sizeof(display_mode_t));
+        mode_catalogue_add(&(ctx->mode_catalogues), head.device_id, head.name, modes, head.mode_count);
+        free(modes);
+    }
+    trace_rewind(reader);
+}
+
+static void replay_copydata(app_ctx_t *ctx, const BYTE *payload, DWORD size, latency_samples_t *stages) {
+    DWORD ipc_type;
+    if (size < sizeof(DWORD)) {
+        return;
+    }
+    memcpy(&ipc_type, payload, sizeof(DWORD));
+    if (ipc_type != IPC_APPLY_PRESET || size < sizeof(DWORD) + sizeof(ipc_preset_change_request)) {
+        // Reverting doesn't depend on the display data
+        return;
+    }
+    ipc_preset_change_request req;
+    memcpy(&req, payload + sizeof(DWORD), sizeof(ipc_preset_change_request));
+    req.preset_name[127] = L'\0';
+
+    LONGLONG start = latency_now();
+    display_preset_t *preset = find_applicable_preset(ctx, req.preset_name);
+    if (preset != NULL) {
+        get_apply_plan(ctx, preset);
+    }
+    latency_add(&(stages[STAGE_IPC_PRESET]), latency_ms(start, latency_now()));
+}
+
+int replay_trace(const wchar_t *trace_path, const wchar_t *config_path) {
+    app_ctx_t ctx = {0};
+    published_config_t *config = disp_config_create_published();
+    if (disp_config_read_file(config_path, &(config->config)) != DISP_CONFIG_SUCCESS) {
+        wprintf(L"Could not read configuration file %s:\n%s\n", config_path,
+                disp_config_get_err_msg(&(config->config)));
+        config->head.destroy(&(config->head));
+        return 1;
+    }
+    publish_config(&ctx, config);
+    trace_reader_t reader;
+    if (!trace_reader_open(&reader, trace_path)) {
+        wprintf(L"Could not read trace file %s\n", trace_path);
+        free_configs(&ctx);
+        return 1;
+    }
+
+    load_recorded_modes(&ctx, &reader);
+
+    latency_samples_t stages[STAGE_COUNT] = {0};
+    size_t event_counts[TRACE_EVENT_MODES + 1] = {0};
+    LONGLONG last_time = 0;
+    LONGLONG change_time = -1; // First display change since the last monitor record
+    const trace_record_t *record;
+    const BYTE *payload;
+    while (trace_next(&reader, &record, &payload)) {
+        if (record->type <= TRACE_EVENT_MODES) {
+            event_counts[record->type]++;
+        }
+        last_time = record->time;
+        switch (record->type) {
+            case TRACE_EVENT_DISPLAY_CHANGE:
+                if (change_time < 0) {
+                    change_time = record->time;
+                }
+                break;
+
+            case TRACE_EVENT_MONITORS:
+                if (record->size >= sizeof(trace_monitors_t)) {
+                    trace_monitors_t head;
+                    memcpy(&head, payload, sizeof(trace_monitors_t));
+                    latency_add(&(stages[STAGE_RECORDED_QUERY]),
+                                (double) head.query_ticks * 1000.0 / (double) reader.frequency);
+                }
+                if (change_time >= 0) {
+                    // Includes the debounce delay
+                    latency_add(&(stages[STAGE_RECORDED_SETTLE]),
+                                (double) (record->time - change_time) * 1000.0 / (double) reader.frequency);
+                    change_time = -1;
+                }
+                replay_monitors(&ctx, payload, record->size, stages);
+                break;
+
+            case TRACE_EVENT_COPYDATA:
+                replay_copydata(&ctx, payload, record->size, stages);
+                break;
+        }
+    }
+
+    wprintf(L"Replayed %s: %.1f s, %u display snapshots, %u display changes, %u IPC requests, %u mode lists\n\n",
+            trace_path, (double) last_time / (double) reader.frequency, (UINT) event_counts[TRACE_EVENT_MONITORS],
+            (UINT) event_counts[TRACE_EVENT_DISPLAY_CHANGE], (UINT) event_counts[TRACE_EVENT_COPYDATA],
+            (UINT) event_counts[TRACE_EVENT_MODES]);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        latency_print(stage_names[i], &(stages[i]));
+        latency_free(&(stages[i]));
+    }
+
+    trace_reader_close(&reader);
+    free_tray_menu(&ctx);
+    free_monitors(&ctx);
+    preflight_cache_destroy(&(ctx.preflight_cache));
+    mode_catalogue_cache_destroy(&(ctx.mode_catalogues));
+    free_configs(&ctx);
+    return 0;
+}
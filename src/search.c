@@ -0,0 +1,313 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define UNICODE
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "search.h"
+#include "log.h"
+
+// Longest query that is used for the trigram lookup, longer queries are still verified in full
+#define SEARCH_MAX_QUERY_TRIGRAMS 64
+
+typedef struct {
+    UINT64 trigram;
+    UINT32 preset_idx;
+} trigram_entry_t;
+
+typedef struct {
+    UINT64 score;
+    int preset_idx;
+} search_result_t;
+
+static UINT64 make_trigram(const wchar_t *str) {
+    return ((UINT64) (WORD) str[0] << 32) | ((UINT64) (WORD) str[1] << 16) | (UINT64) (WORD) str[2];
+}
+
+static size_t trigram_slot(UINT64 trigram, size_t table_size) {
+    // Mix the bits, trigrams of similar names only differ in the low bits
+    trigram ^= trigram >> 29;
+    trigram *= 0xBF58476D1CE4E5B9ULL;
+    trigram ^= trigram >> 32;
+    return (size_t) trigram & (table_size - 1);
+}
+
+static int trigram_entry_compare(const void *a, const void *b) {
+    const trigram_entry_t *a_ent = (const trigram_entry_t *) a;
+    const trigram_entry_t *b_ent = (const trigram_entry_t *) b;
+    if (a_ent->trigram != b_ent->trigram) {
+        return a_ent->trigram < b_ent->trigram ? -1 : 1;
+    }
+    if (a_ent->preset_idx != b_ent->preset_idx) {
+        return a_ent->preset_idx < b_ent->preset_idx ? -1 : 1;
+    }
+    return 0;
+}
+
+void search_index_destroy(preset_search_index_t *index) {
+    free(index->table);
+    free(index->postings);
+    ZeroMemory(index, sizeof(preset_search_index_t));
+}
+
+void search_index_build(preset_search_index_t *index, const app_config_t *config) {
+    search_index_destroy(index);
+
+    index->preset_count = config->preset_count;
+    index->presets = config->presets;
+
+    // Collect (trigram, preset) pairs of all the preset names
+    size_t entry_count = 0;
+    for (size_t i = 0; i < config->preset_count; i++) {
+        size_t len = wcslen(config->presets[i]->name_folded);
+        if (len >= 3) {
+            entry_count += len - 2;
+        }
+    }
+    trigram_entry_t *entries = calloc(entry_count > 0 ? entry_count : 1, sizeof(trigram_entry_t));
+    size_t pos = 0;
+    for (size_t i = 0; i < config->preset_count; i++) {
+        const wchar_t *name = config->presets[i]->name_folded;
+        size_t len = wcslen(name);
+        for (size_t c = 0; c + 2 < len; c++) {
+            entries[pos].trigram = make_trigram(name + c);
+            entries[pos].preset_idx = (UINT32) i;
+            pos++;
+        }
+    }
+
+    // Sort so that each trigram has a contiguous, sorted posting list
+    qsort(entries, entry_count, sizeof(trigram_entry_t), trigram_entry_compare);
+
+    size_t trigram_count = 0;
+    for (size_t i = 0; i < entry_count; i++) {
+        if (i == 0 || entries[i].trigram != entries[i - 1].trigram) {
+            trigram_count++;
+        }
+    }
+
+    index->table_size = 16;
+    while (index->table_size < trigram_count * 2) {
+        index->table_size *= 2;
+    }
+    index->table = calloc(index->table_size, sizeof(search_trigram_t));
+    index->postings = calloc(entry_count > 0 ? entry_count : 1, sizeof(UINT32));
+
+    size_t posting_count = 0;
+    search_trigram_t *cur = NULL;
+    for (size_t i = 0; i < entry_count; i++) {
+        if (i == 0 || entries[i].trigram != entries[i - 1].trigram) {
+            // New trigram, find a slot for it
+            size_t slot = trigram_slot(entries[i].trigram, index->table_size);
+            while (index->table[slot].length != 0) {
+                slot = (slot + 1) & (index->table_size - 1);
+            }
+            cur = &(index->table[slot]);
+            cur->trigram = entries[i].trigram;
+            cur->offset = (UINT32) posting_count;
+        } else if (entries[i].preset_idx == entries[i - 1].preset_idx) {
+            // The same trigram occurs more than once in the name
+            continue;
+        }
+        index->postings[posting_count++] = entries[i].preset_idx;
+        cur->length++;
+    }
+
+    free(entries);
+
+    log_debug(L"Built preset search index: %u presets, %u trigrams, %u postings", (UINT) config->preset_count,
+              (UINT) trigram_count, (UINT) posting_count);
+}
+
+static const search_trigram_t *find_trigram(const preset_search_index_t *index, UINT64 trigram) {
+    if (index->table == NULL) {
+        return NULL;
+    }
+    size_t slot = trigram_slot(trigram, index->table_size);
+    while (index->table[slot].length != 0) {
+        if (index->table[slot].trigram == trigram) {
+            return &(index->table[slot]);
+        }
+        slot = (slot + 1) & (index->table_size - 1);
+    }
+    return NULL;
+}
+
+static int trigram_length_compare(const void *a, const void *b) {
+    const search_trigram_t *a_tri = *(const search_trigram_t **) a;
+    const search_trigram_t *b_tri = *(const search_trigram_t **) b;
+    return (a_tri->length > b_tri->length) - (a_tri->length < b_tri->length);
+}
+
+static size_t intersect_postings(UINT32 *candidates, size_t candidate_count, const UINT32 *list, size_t list_len) {
+    // The candidates are never more than the list, so step through the list with a binary search per candidate
+    size_t out = 0;
+    size_t lo = 0;
+    for (size_t i = 0; i < candidate_count && lo < list_len; i++) {
+        size_t hi = list_len;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (list[mid] < candidates[i]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < list_len && list[lo] == candidates[i]) {
+            candidates[out++] = candidates[i];
+        }
+    }
+    return out;
+}
+
+static void heap_sift_down(search_result_t *heap, size_t count, size_t pos) {
+    // Min-heap on score, the worst kept result is at the root
+    while (1) {
+        size_t smallest = pos;
+        size_t left = pos * 2 + 1;
+        size_t right = left + 1;
+        if (left < count && heap[left].score < heap[smallest].score) {
+            smallest = left;
+        }
+        if (right < count && heap[right].score < heap[smallest].score) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        search_result_t tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+static void heap_push(search_result_t *heap, size_t *count, size_t max_count, UINT64 score, int preset_idx) {
+    if (*count < max_count) {
+        size_t pos = (*count)++;
+        heap[pos].score = score;
+        heap[pos].preset_idx = preset_idx;
+        while (pos > 0 && heap[(pos - 1) / 2].score > heap[pos].score) {
+            search_result_t tmp = heap[pos];
+            heap[pos] = heap[(pos - 1) / 2];
+            heap[(pos - 1) / 2] = tmp;
+            pos = (pos - 1) / 2;
+        }
+    } else if (score > heap[0].score) {
+        heap[0].score = score;
+        heap[0].preset_idx = preset_idx;
+        heap_sift_down(heap, *count, 0);
+    }
+}
+
+static int result_score_compare(const void *a, const void *b) {
+    const search_result_t *a_res = (const search_result_t *) a;
+    const search_result_t *b_res = (const search_result_t *) b;
+    // Descending
+    return (a_res->score < b_res->score) - (a_res->score > b_res->score);
+}
+
+static UINT64 score_match(const preset_search_index_t *index, const preset_state_t *states, int preset_idx,
+                          const wchar_t *match_pos, const int *recent, size_t recent_count) {
+    // Rank applicable presets first, then recently used ones, then prefix matches, then shorter names
+    const display_preset_t *preset = index->presets[preset_idx];
+    UINT64 score = 0;
+    if (states[preset_idx].applicable == 1) {
+        score |= 1ULL << 63;
+    }
+    for (size_t i = 0; i < recent_count && i < 31; i++) {
+        if (recent[i] == preset_idx) {
+            score |= (UINT64) (31 - i) << 58;
+            break;
+        }
+    }
+    if (match_pos == preset->name_folded) {
+        score |= 1ULL << 57;
+    }
+    size_t len = wcslen(preset->name_folded);
+    score |= (UINT64) (0xFFFF - (len < 0xFFFF ? len : 0xFFFF)) << 41;
+    // Keep the config order for otherwise equal matches
+    score |= 0x1FFFFFFFFFFULL - (UINT64) preset_idx;
+    return score;
+}
+
+size_t search_index_query(const preset_search_index_t *index, const preset_state_t *states, const wchar_t *folded_query,
+                          const int *recent, size_t recent_count, int *results, size_t max_results) {
+    if (max_results == 0 || index->preset_count == 0) {
+        return 0;
+    }
+
+    search_result_t *heap = calloc(max_results, sizeof(search_result_t));
+    size_t heap_count = 0;
+    size_t query_len = wcslen(folded_query);
+
+    if (query_len < 3) {
+        // Too short for the trigram index, check every name
+        for (size_t i = 0; i < index->preset_count; i++) {
+            const wchar_t *match_pos = wcsstr(index->presets[i]->name_folded, folded_query);
+            if (match_pos == NULL) {
+                continue;
+            }
+            heap_push(heap, &heap_count, max_results,
+                      score_match(index, states, (int) i, match_pos, recent, recent_count), (int) i);
+        }
+    } else {
+        // Look up the posting list of every query trigram
+        const search_trigram_t *lists[SEARCH_MAX_QUERY_TRIGRAMS];
+        size_t list_count = 0;
+        for (size_t c = 0; c + 2 < query_len && list_count < SEARCH_MAX_QUERY_TRIGRAMS; c++) {
+            const search_trigram_t *tri = find_trigram(index, make_trigram(folded_query + c));
+            if (tri == NULL) {
+                // No name contains this trigram
+                free(heap);
+                return 0;
+            }
+            lists[list_count++] = tri;
+        }
+
+        // Intersect starting from the shortest list
+        qsort(lists, list_count, sizeof(search_trigram_t *), trigram_length_compare);
+        size_t candidate_count = lists[0]->length;
+        UINT32 *candidates = calloc(candidate_count, sizeof(UINT32));
+        memcpy(candidates, index->postings + lists[0]->offset, candidate_count * sizeof(UINT32));
+        for (size_t l = 1; l < list_count && candidate_count > 0; l++) {
+            candidate_count =
+                intersect_postings(candidates, candidate_count, index->postings + lists[l]->offset, lists[l]->length);
+        }
+
+        // Having all the trigrams doesn't mean that the query is a substring, verify each candidate
+        for (size_t i = 0; i < candidate_count; i++) {
+            int preset_idx = (int) candidates[i];
+            const wchar_t *match_pos = wcsstr(index->presets[preset_idx]->name_folded, folded_query);
+            if (match_pos == NULL) {
+                continue;
+            }
+            heap_push(heap, &heap_count, max_results,
+                      score_match(index, states, preset_idx, match_pos, recent, recent_count), preset_idx);
+        }
+        free(candidates);
+    }
+
+    qsort(heap, heap_count, sizeof(search_result_t), result_score_compare);
+    for (size_t i = 0; i < heap_count; i++) {
+        results[i] = heap[i].preset_idx;
+    }
+    free(heap);
+    return heap_count;
+}
@@ -0,0 +1,136 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdlib.h>
+#include "app.h"
+#include "trace.h"
+#include "log.h"
+
+static LONGLONG query_counter(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+BOOL trace_open(trace_writer_t *trace, const wchar_t *path) {
+    trace->file = _wfopen(path, L"wb");
+    if (trace->file == NULL) {
+        log_error(L"Failed to open trace file %s for writing", path);
+        return FALSE;
+    }
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    trace_header_t header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION, .frequency = frequency.QuadPart};
+    fwrite(&header, sizeof(trace_header_t), 1, trace->file);
+    fflush(trace->file);
+    trace->start = query_counter();
+    log_info(L"Recording a trace to %s", path);
+    return TRUE;
+}
+
+void trace_write(trace_writer_t *trace, DWORD type, const void *head, DWORD head_size, const void *body,
+                 DWORD body_size) {
+    // Write a record with the payload in up to two parts, does nothing when not recording
+    if (trace->file == NULL) {
+        return;
+    }
+    trace_record_t record = {.type = type, .size = head_size + body_size, .time = query_counter() - trace->start};
+    fwrite(&record, sizeof(trace_record_t), 1, trace->file);
+    if (head_size > 0) {
+        fwrite(head, head_size, 1, trace->file);
+    }
+    if (body_size > 0) {
+        fwrite(body, body_size, 1, trace->file);
+    }
+    static const BYTE padding[8] = {0};
+    size_t padding_size = TRACE_ALIGN(record.size) - record.size;
+    if (padding_size > 0) {
+        fwrite(padding, padding_size, 1, trace->file);
+    }
+    // Keep the trace usable if the process doesn't exit cleanly
+    fflush(trace->file);
+}
+
+void trace_close(trace_writer_t *trace) {
+    if (trace->file != NULL) {
+        fclose(trace->file);
+        trace->file = NULL;
+    }
+}
+
+BOOL trace_reader_open(trace_reader_t *reader, const wchar_t *path) {
+    ZeroMemory(reader, sizeof(trace_reader_t));
+    FILE *file = _wfopen(path, L"rb");
+    if (file == NULL) {
+        log_error(L"Failed to open trace file %s", path);
+        return FALSE;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < (long) sizeof(trace_header_t)) {
+        log_error(L"Trace file %s is too short", path);
+        fclose(file);
+        return FALSE;
+    }
+    reader->data = malloc((size_t) size);
+    reader->size = fread(reader->data, 1, (size_t) size, file);
+    fclose(file);
+
+    const trace_header_t *header = (const trace_header_t *) reader->data;
+    if (reader->size < sizeof(trace_header_t) || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->frequency <= 0) {
+        log_error(L"%s is not a supported trace file", path);
+        trace_reader_close(reader);
+        return FALSE;
+    }
+    reader->frequency = header->frequency;
+    reader->pos = sizeof(trace_header_t);
+    return TRUE;
+}
+
+BOOL trace_next(trace_reader_t *reader, const trace_record_t **record_out, const BYTE **payload_out) {
+    // Returns FALSE at the end of the trace, a truncated last record is ignored
+    if (reader->size - reader->pos < sizeof(trace_record_t)) {
+        return FALSE;
+    }
+    const trace_record_t *record = (const trace_record_t *) (reader->data + reader->pos);
+    if (reader->size - reader->pos - sizeof(trace_record_t) < record->size) {
+        log_warning(L"Ignoring a truncated trace record");
+        return FALSE;
+    }
+    *record_out = record;
+    *payload_out = reader->data + reader->pos + sizeof(trace_record_t);
+    reader->pos += sizeof(trace_record_t) + TRACE_ALIGN(record->size);
+    if (reader->pos > reader->size) {
+        // No padding after the last record
+        reader->pos = reader->size;
+    }
+    return TRUE;
+}
+
+void trace_rewind(trace_reader_t *reader) {
+    reader->pos = sizeof(trace_header_t);
+}
+
+void trace_reader_close(trace_reader_t *reader) {
+    free(reader->data);
+    ZeroMemory(reader, sizeof(trace_reader_t));
+}
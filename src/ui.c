@@ -23,6 +23,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "ui.h"
 #include "resource.h"
 #include "disp.h"
+#include "launcher.h"
+#include "idle.h"
+#include "latency.h"
+#include "metrics.h"
 
 const LPTSTR orientation_str[4] = {L"Landscape", L"Portrait", L"Landscape (flipped)", L"Portrait (flipped)"};
 
@@ -30,69 +34,292 @@ const COLORREF align_pattern_colors[6] = {RGB(249, 135, 78), RGB(250, 199, 88),
                                           RGB(83, 179, 166), RGB(102, 145, 204), RGB(197, 135, 196)};
 const size_t align_pattern_color_count = sizeof(align_pattern_colors) / sizeof(COLORREF);
 
-void create_tray_menu(app_ctx_t *ctx) {
-    // Create tray notification menu
+// Maximum number of presets in one menu, larger lists are grouped into submenus
+#define TRAY_MENU_PAGE_SIZE 50
 
-    // Destroy existing menu if needed
+void update_tray_menu(app_ctx_t *ctx) {
+    // Update the tray menu model
+    // The actual menu is built from the model only when it is opened, so this is cheap when nothing has changed
+    if (ctx->headless) {
+        return;
+    }
+    tray_menu_model_t *model = &(ctx->menu_model);
+    BOOL changed = FALSE;
+
+    // Applicable presets
+    display_preset_t **presets;
+    int preset_count = disp_config_get_presets(ctx->config, &presets);
+    if ((size_t) preset_count > model->preset_capacity) {
+        model->presets = realloc(model->presets, preset_count * sizeof(tray_menu_preset_t));
+        ZeroMemory(model->presets + model->preset_capacity,
+                   (preset_count - model->preset_capacity) * sizeof(tray_menu_preset_t));
+        model->preset_capacity = preset_count;
+    }
+    size_t entry_count = 0;
+    for (int i = 0; i < preset_count; i++) {
+        display_preset_t *preset = presets[i];
+        const preset_state_t *state = &(ctx->preset_states[i]);
+        if (state->applicable == 0) {
+            continue;
+        }
+        tray_menu_preset_t *entry = &(model->presets[entry_count++]);
+        BOOL disabled = state->preflight == PREFLIGHT_FAILED;
+        if (entry->name != NULL && entry->preset_idx == i && entry->disabled == disabled &&
+            wcscmp(entry->name, preset->name) == 0) {
+            // Unchanged entry
+            continue;
+        }
+        free(entry->name);
+        entry->preset_idx = i;
+        entry->name = _wcsdup(preset->name);
+        entry->disabled = disabled;
+        changed = TRUE;
+    }
+    for (size_t i = entry_count; i < model->preset_count; i++) {
+        free(model->presets[i].name);
+        model->presets[i].name = NULL;
+    }
+    if (entry_count != model->preset_count) {
+        model->preset_count = entry_count;
+        changed = TRUE;
+    }
+
+    // Monitors
+    if (ctx->monitor_count > model->monitor_capacity) {
+        model->monitors = realloc(model->monitors, ctx->monitor_count * sizeof(tray_menu_monitor_t));
+        model->monitor_capacity = ctx->monitor_count;
+    }
+    if (ctx->monitor_count != model->monitor_count) {
+        model->monitor_count = ctx->monitor_count;
+        changed = TRUE;
+    }
+    for (size_t i = 0; i < ctx->monitor_count; i++) {
+        // The menu entries are in the monitor order
+        monitor_t *mon = &(ctx->monitors[ctx->monitor_order[i]]);
+        tray_menu_monitor_t *entry = &(model->monitors[i]);
+        wchar_t label[100];
+        StringCbPrintf(label, sizeof(label), L"%s (%s)", mon->info->friendly_name, orientation_str[mon->orientation]);
+        if (changed || entry->orientation != mon->orientation || wcscmp(entry->label, label) != 0) {
+            StringCbCopy(entry->label, sizeof(entry->label), label);
+            entry->orientation = mon->orientation;
+            changed = TRUE;
+        }
+    }
+
+    // Revert
+    if (model->can_revert != (ctx->snapshot_count > 0)) {
+        model->can_revert = ctx->snapshot_count > 0;
+        changed = TRUE;
+    }
+
+    if (changed) {
+        model->generation++;
+        log_trace(L"Tray menu model changed, generation %u", model->generation);
+    }
+}
+
+void free_tray_menu(app_ctx_t *ctx) {
+    tray_menu_model_t *model = &(ctx->menu_model);
+    for (size_t i = 0; i < model->preset_count; i++) {
+        free(model->presets[i].name);
+    }
+    free(model->presets);
+    free(model->monitors);
+    ZeroMemory(model, sizeof(tray_menu_model_t));
+    free(ctx->menu_actions.actions);
+    ZeroMemory(&(ctx->menu_actions), sizeof(menu_action_table_t));
     if (ctx->notif_menu != NULL) {
         DestroyMenu(ctx->notif_menu);
+        ctx->notif_menu = NULL;
     }
+}
 
-    ctx->notif_menu = CreatePopupMenu();
-
-    HMENU notif_menu_config = CreatePopupMenu();
-    AppendMenu(notif_menu_config, 0, NOTIF_MENU_CONFIG_SAVE, L"Save current configuration…");
-    AppendMenu(notif_menu_config, MF_SEPARATOR, 0, NULL);
-    AppendMenu(notif_menu_config, MF_GRAYED, 0, L"Saved configurations");
-    AppendMenu(notif_menu_config, MF_SEPARATOR, 0, NULL);
+static UINT alloc_menu_action(app_ctx_t *ctx, int type, size_t index, size_t arg) {
+    // Allocate a command ID for an action, returns 0 if the IDs have run out
+    menu_action_table_t *table = &(ctx->menu_actions);
+    if (table->count >= NOTIF_MENU_DYNAMIC_MAX - NOTIF_MENU_DYNAMIC_BASE) {
+        log_warning(L"Out of menu command IDs");
+        return 0;
+    }
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        table->actions = realloc(table->actions, table->capacity * sizeof(menu_action_t));
+    }
+    menu_action_t *action = &(table->actions[table->count]);
+    action->type = type;
+    action->index = index;
+    action->arg = arg;
+    return NOTIF_MENU_DYNAMIC_BASE + (UINT) table->count++;
+}
 
-    // TODO: Limit listed configurations? Scrollable menu?
-    // TODO: Detect applied preset (even if the settings change wasn't done by this application)
+static menu_action_t *get_menu_action(app_ctx_t *ctx, UINT id) {
+    if (id < NOTIF_MENU_DYNAMIC_BASE || id - NOTIF_MENU_DYNAMIC_BASE >= ctx->menu_actions.count) {
+        return NULL;
+    }
+    return &(ctx->menu_actions.actions[id - NOTIF_MENU_DYNAMIC_BASE]);
+}
 
-    display_preset_t **presets;
-    int preset_count = disp_config_get_presets(&ctx->config, &presets);
+static HMENU create_lazy_popup(app_ctx_t *ctx, int type, size_t index, size_t arg) {
+    // Create an empty popup menu that is filled on WM_INITMENUPOPUP
+    // The menu data holds the command ID of the action that describes the contents
+    HMENU menu = CreatePopupMenu();
+    MENUINFO info = {0};
+    info.cbSize = sizeof(MENUINFO);
+    info.fMask = MIM_MENUDATA;
+    info.dwMenuData = alloc_menu_action(ctx, type, index, arg);
+    SetMenuInfo(menu, &info);
+    return menu;
+}
 
-    if (preset_count > 0) {
-        for (int i = 0; i < preset_count; i++) {
-            display_preset_t *preset = presets[i];
-            if (preset->applicable == 0) {
-                continue;
-            }
-            AppendMenu(notif_menu_config, 0, NOTIF_MENU_CONFIG_SELECT | (i & NOTIF_MENU_CONFIG_INDEX), preset->name);
-        }
+static void materialize_tray_menu(app_ctx_t *ctx) {
+    // Build the top level of the tray menu, the submenus are filled when they are opened
+    tray_menu_model_t *model = &(ctx->menu_model);
+    if (ctx->notif_menu == NULL) {
+        ctx->notif_menu = CreatePopupMenu();
+    } else if (ctx->notif_menu_generation == model->generation) {
+        // Up to date
+        return;
     } else {
-        AppendMenu(notif_menu_config, MF_GRAYED, 0, L"None");
+        // Remove the old items, this destroys the old submenus too
+        while (GetMenuItemCount(ctx->notif_menu) > 0) {
+            DeleteMenu(ctx->notif_menu, 0, MF_BYPOSITION);
+        }
     }
+    log_trace(L"Materializing tray menu, generation %u", model->generation);
+
+    // All the previously allocated command IDs belonged to the destroyed submenus
+    ctx->menu_actions.count = 0;
 
     AppendMenu(ctx->notif_menu, MF_GRAYED, 0, APP_NAME L" " APP_VER);
     AppendMenu(ctx->notif_menu, MF_SEPARATOR, 0, NULL);
 
-    for (size_t i = 0; i < ctx->monitor_count; i++) {
-        monitor_t mon = ctx->monitors[i];
-        // Create monitor -> orientation menu
-        HMENU mon_orient_menu_conf = CreatePopupMenu();
-        for (size_t a = 0; a < 4; a++) {
-            // The monitor index is ORred with the constant
-            UINT itemId = NOTIF_MENU_MONITOR_ORIENTATION_SELECT | i | (a << 10);
-            AppendMenu(mon_orient_menu_conf, (mon.devmode.dmDisplayOrientation == a ? MF_CHECKED : 0), itemId,
-                       orientation_str[a]);
-        }
-        // Create submenu for this monitor
-        HMENU mon_sub_menu_conf = CreatePopupMenu();
-        AppendMenu(mon_sub_menu_conf, MF_POPUP, (UINT_PTR) mon_orient_menu_conf, L"Orientation");
+    for (size_t i = 0; i < model->monitor_count; i++) {
         // Create menu entry for this monitor
-        wchar_t entStr[100];
-        StringCbPrintf(entStr, 100, L"%s (%s)", mon.friendly_name, orientation_str[mon.devmode.dmDisplayOrientation]);
-        AppendMenu(ctx->notif_menu, MF_POPUP, (UINT_PTR) mon_sub_menu_conf, entStr);
+        HMENU mon_sub_menu_conf = create_lazy_popup(ctx, MENU_ACTION_MONITOR_POPUP, i, 0);
+        AppendMenu(ctx->notif_menu, MF_POPUP, (UINT_PTR) mon_sub_menu_conf, model->monitors[i].label);
     }
 
     AppendMenu(ctx->notif_menu, MF_SEPARATOR, 0, NULL);
     AppendMenu(ctx->notif_menu, 0, NOTIF_MENU_ABOUT_DISPLAYS, L"About displays");
-    AppendMenu(ctx->notif_menu, MF_POPUP, (UINT_PTR) notif_menu_config, L"Config");
+    AppendMenu(ctx->notif_menu, MF_POPUP, (UINT_PTR) create_lazy_popup(ctx, MENU_ACTION_CONFIG_POPUP, 0, 0),
+               L"Config");
+    AppendMenu(ctx->notif_menu, 0, NOTIF_MENU_SHOW_LAUNCHER, L"Find preset…");
+    AppendMenu(ctx->notif_menu, model->can_revert ? 0 : MF_GRAYED, NOTIF_MENU_REVERT, L"Revert display changes");
     AppendMenu(ctx->notif_menu, 0, NOTIF_MENU_SHOW_ALIGN_PATTERN, L"Show alignment pattern");
     AppendMenu(ctx->notif_menu, MF_SEPARATOR, 0, NULL);
 
     AppendMenu(ctx->notif_menu, 0, NOTIF_MENU_EXIT, L"Exit");
+
+    ctx->notif_menu_generation = model->generation;
+}
+
+static void append_preset_range(app_ctx_t *ctx, HMENU menu, size_t first, size_t end) {
+    // Append the model preset entries [first, end) to the menu
+    // Long ranges are split into at most TRAY_MENU_PAGE_SIZE groups, which are split again when opened
+    tray_menu_model_t *model = &(ctx->menu_model);
+    size_t count = end - first;
+    if (count <= TRAY_MENU_PAGE_SIZE) {
+        for (size_t i = first; i < end; i++) {
+            tray_menu_preset_t *entry = &(model->presets[i]);
+            UINT id = alloc_menu_action(ctx, MENU_ACTION_APPLY_PRESET, i, 0);
+            AppendMenu(menu, id == 0 || entry->disabled ? MF_GRAYED : 0, id, entry->name);
+        }
+        return;
+    }
+    size_t group_size = TRAY_MENU_PAGE_SIZE;
+    while (group_size * TRAY_MENU_PAGE_SIZE < count) {
+        group_size *= TRAY_MENU_PAGE_SIZE;
+    }
+    for (size_t group_first = first; group_first < end; group_first += group_size) {
+        size_t group_end = group_first + group_size < end ? group_first + group_size : end;
+        wchar_t label[100];
+        StringCbPrintf(label, sizeof(label), L"Presets %u–%u", (UINT) group_first + 1, (UINT) group_end);
+        HMENU group_menu = create_lazy_popup(ctx, MENU_ACTION_PRESET_GROUP_POPUP, group_first, group_end);
+        AppendMenu(menu, MF_POPUP, (UINT_PTR) group_menu, label);
+    }
+}
+
+static void materialize_popup(app_ctx_t *ctx, HMENU menu) {
+    MENUINFO info = {0};
+    info.cbSize = sizeof(MENUINFO);
+    info.fMask = MIM_MENUDATA;
+    if (!GetMenuInfo(menu, &info) || GetMenuItemCount(menu) > 0) {
+        // Already filled
+        return;
+    }
+    menu_action_t *action = get_menu_action(ctx, (UINT) info.dwMenuData);
+    if (action == NULL) {
+        // Not a lazy popup
+        return;
+    }
+    tray_menu_model_t *model = &(ctx->menu_model);
+    // Copy the action as the table can be reallocated while filling
+    int type = action->type;
+    size_t idx = action->index;
+    size_t arg = action->arg;
+
+    switch (type) {
+        case MENU_ACTION_CONFIG_POPUP:
+            AppendMenu(menu, 0, NOTIF_MENU_CONFIG_SAVE, L"Save current configuration…");
+            AppendMenu(menu, MF_SEPARATOR, 0, NULL);
+            AppendMenu(menu, MF_GRAYED, 0, L"Saved configurations");
+            AppendMenu(menu, MF_SEPARATOR, 0, NULL);
+
+            // TODO: Detect applied preset (even if the settings change wasn't done by this application)
+            if (model->preset_count > 0) {
+                append_preset_range(ctx, menu, 0, model->preset_count);
+            } else {
+                AppendMenu(menu, MF_GRAYED, 0, L"None");
+            }
+            break;
+
+        case MENU_ACTION_PRESET_GROUP_POPUP:
+            append_preset_range(ctx, menu, idx, arg);
+            break;
+
+        case MENU_ACTION_MONITOR_POPUP:
+            AppendMenu(menu, MF_POPUP, (UINT_PTR) create_lazy_popup(ctx, MENU_ACTION_ORIENTATION_POPUP, idx, 0),
+                       L"Orientation");
+            break;
+
+        case MENU_ACTION_ORIENTATION_POPUP:
+            for (size_t a = 0; a < 4; a++) {
+                UINT id = alloc_menu_action(ctx, MENU_ACTION_MONITOR_ORIENTATION, idx, a);
+                UINT flags = (model->monitors[idx].orientation == a ? MF_CHECKED : 0) | (id == 0 ? MF_GRAYED : 0);
+                AppendMenu(menu, flags, id, orientation_str[a]);
+            }
+            break;
+    }
+}
+
+static void dispatch_menu_action(app_ctx_t *ctx, UINT id) {
+    menu_action_t *action = get_menu_action(ctx, id);
+    if (action == NULL) {
+        return;
+    }
+    if (ctx->notif_menu_generation != ctx->menu_model.generation) {
+        // The model changed while the menu was open, the action may refer to something else now
+        log_warning(L"Tray menu was out of date, ignoring the selection");
+        return;
+    }
+
+    switch (action->type) {
+        case MENU_ACTION_MONITOR_ORIENTATION:;
+            // User made a monitor orientation selection
+            log_debug(L"User wants to change monitor %u orientation to %u", (UINT) action->index,
+                      (UINT) action->arg);
+            change_display_orientation(ctx, &(ctx->monitors[ctx->monitor_order[action->index]]), (BYTE) action->arg);
+            break;
+
+        case MENU_ACTION_APPLY_PRESET:;
+            // Config selected
+            int config_idx = ctx->menu_model.presets[action->index].preset_idx;
+            display_preset_t *preset = ctx->config->presets[config_idx];
+            log_debug(L"User wants to apply preset %d (\"%s\")", config_idx, preset->name);
+            // Apply preset
+            apply_preset(ctx, preset);
+            break;
+    }
 }
 
 void show_notification_message(app_ctx_t *ctx, STRSAFE_LPCWSTR format, ...) {
@@ -108,10 +335,29 @@ void show_notification_message(app_ctx_t *ctx, STRSAFE_LPCWSTR format, ...) {
     va_start(args, format);
     StringCbVPrintf(nid.szInfo, ARRAYSIZE(nid.szInfo), format, args);
     va_end(args);
+    if (ctx->headless) {
+        // No tray icon to show it on
+        log_info(L"Notification: %s", nid.szInfo);
+        return;
+    }
     // Show the notification
     Shell_NotifyIcon(NIM_MODIFY, &nid);
 }
 
+void show_error_message(app_ctx_t *ctx, STRSAFE_LPCWSTR format, ...) {
+    // Errors are always logged and counted, a headless instance has nobody to close a dialog
+    wchar_t msg[1024];
+    va_list args;
+    va_start(args, format);
+    StringCbVPrintf(msg, sizeof(msg), format, args);
+    va_end(args);
+    log_error(L"%s", msg);
+    metric_inc(METRIC_ERRORS);
+    if (!ctx->headless) {
+        MessageBox(NULL, msg, APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+    }
+}
+
 static LRESULT CALLBACK save_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
 
     switch (umsg) {
@@ -173,6 +419,20 @@ void show_save_dialog(app_ctx_t *ctx, preset_dialog_data_t *data) {
                    (LPARAM) data);
 }
 
+static void send_metrics_reply(HWND reply_hwnd) {
+    if (!IsWindow(reply_hwnd)) {
+        log_warning(L"Metrics request has no reply window");
+        return;
+    }
+    wchar_t text[METRICS_TEXT_SIZE / sizeof(wchar_t)];
+    metrics_format(text, sizeof(text));
+    COPYDATASTRUCT reply = {0};
+    reply.dwData = IPC_METRICS_REPLY;
+    reply.cbData = (DWORD) ((wcslen(text) + 1) * sizeof(wchar_t));
+    reply.lpData = text;
+    SendMessage(reply_hwnd, WM_COPYDATA, (WPARAM) NULL, (LPARAM) (LPVOID) &reply);
+}
+
 static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
 
     // Get window pointer that points to the app context
@@ -193,7 +453,8 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
                 log_error(L"Couldn't delete notifyicon: %s (0x%08X)", err_msg, err);
                 LocalFree(err_msg);
             }
-            DestroyMenu(ctx->notif_menu);
+            free_tray_menu(ctx);
+            unregister_hotkeys(ctx);
             PostQuitMessage(0);
             break;
 
@@ -201,10 +462,13 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
             switch (LOWORD(lparam)) {
                 case WM_CONTEXTMENU:;
                     // Tray icon was right clicked
+                    note_activity(ctx);
                     int menu_x = GET_X_LPARAM(wparam);
                     int menu_y = GET_Y_LPARAM(wparam);
 
                     SetForegroundWindow(hwnd);
+                    // Build the menu if it has changed since it was last shown
+                    materialize_tray_menu(ctx);
                     // Show popup menu
                     if (!TrackPopupMenuEx(ctx->notif_menu, 0, menu_x, menu_y, hwnd, NULL)) {
                         wchar_t *err_msg = NULL;
@@ -220,13 +484,19 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
             }
             break;
 
+        case WM_INITMENUPOPUP:;
+            // A tray submenu is about to be shown, fill it if needed
+            materialize_popup(ctx, (HMENU) wparam);
+            break;
+
         case WM_COMMAND:;
             // User did something with controls
             if (HIWORD(wparam) != 0) {
                 break;
             }
             // Menu item selection
-            SHORT selection = LOWORD(wparam);
+            note_activity(ctx);
+            WORD selection = LOWORD(wparam);
             log_trace(L"User selected: 0x%04X", selection);
 
             switch (selection) {
@@ -245,20 +515,27 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
                     StringCbPrintfEx(end, rem, &end, &rem, 0, L"Virtual resolution: %ldx%ld\n",
                                      ctx->display_virtual_size.width, ctx->display_virtual_size.height);
                     for (size_t i = 0; i < ctx->monitor_count; i++) {
-                        monitor_t mon = ctx->monitors[i];
-                        StringCbPrintfEx(end, rem, &end, &rem, 0, L"%s (%s)", mon.friendly_name, mon.name);
-                        if (mon.primary == TRUE) {
+                        const monitor_t *mon = &(ctx->monitors[ctx->monitor_order[i]]);
+                        const monitor_info_t *info = mon->info;
+                        StringCbPrintfEx(end, rem, &end, &rem, 0, L"%s (%s)", info->friendly_name, info->name);
+                        if (mon->primary == TRUE) {
                             StringCbPrintfEx(end, rem, &end, &rem, 0, L" [primary]");
                         }
                         StringCbPrintfEx(end, rem, &end, &rem, 0, L":\n");
-                        StringCbPrintfEx(end, rem, &end, &rem, 0, L"  Device ID: %s\n", mon.device_id);
+                        StringCbPrintfEx(end, rem, &end, &rem, 0, L"  Device ID: %s\n", info->device_id);
                         StringCbPrintfEx(end, rem, &end, &rem, 0, L"  Resolution: %ldx%ld\n",
-                                         mon.rect.right - mon.rect.left, mon.rect.bottom - mon.rect.top);
+                                         mon->rect.right - mon->rect.left, mon->rect.bottom - mon->rect.top);
                         StringCbPrintfEx(end, rem, &end, &rem, 0, L"  Orientation: %s\n",
-                                         orientation_str[mon.devmode.dmDisplayOrientation]);
-                        StringCbPrintfEx(end, rem, &end, &rem, 0, L"  Virtual position: %ld, %ld\n", mon.virt_pos.x,
-                                         mon.virt_pos.y);
+                                         orientation_str[mon->orientation]);
+                        StringCbPrintfEx(end, rem, &end, &rem, 0, L"  Virtual position: %ld, %ld\n", mon->virt_pos.x,
+                                         mon->virt_pos.y);
                     }
+                    memory_usage_t usage;
+                    get_memory_usage(&usage);
+                    StringCbPrintfEx(end, rem, &end, &rem, 0,
+                                     L"\nMemory: %u KiB private, %u KiB working set\nHandles: %u USER, %u GDI\n",
+                                     (UINT) (usage.private_bytes / 1024), (UINT) (usage.working_set / 1024),
+                                     usage.user_handles, usage.gdi_handles);
                     MessageBox(hwnd, about_str, APP_NAME, MB_OK | MB_ICONINFORMATION | MB_SETFOREGROUND);
                     break;
 
@@ -270,27 +547,26 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
                 case NOTIF_MENU_SHOW_ALIGN_PATTERN:;
                     // Show alignment pattern window
                     log_info(L"Showing alignment pattern window");
+                    run_deferred_init(ctx);
                     show_virt_desktop_window(ctx);
                     break;
-            }
 
-            if ((NOTIF_MENU_MONITOR_ORIENTATION_SELECT & selection) == NOTIF_MENU_MONITOR_ORIENTATION_SELECT) {
-                // User made a monitor orientation selection
-                int monitor_idx = selection & NOTIF_MENU_MONITOR_ORIENTATION_MONITOR;
-                int orientation = (selection & NOTIF_MENU_MONITOR_ORIENTATION_POSITION) >> 10;
-                log_debug(L"User wants to change monitor %d orientation to %d", monitor_idx, orientation);
-                monitor_t mon = ctx->monitors[monitor_idx];
-                change_display_orientation(ctx, &mon, orientation);
-                break;
+                case NOTIF_MENU_SHOW_LAUNCHER:;
+                    // Show preset launcher window
+                    log_info(L"Showing preset launcher window");
+                    run_deferred_init(ctx);
+                    show_launcher_window(ctx);
+                    break;
+
+                case NOTIF_MENU_REVERT:;
+                    // Revert the last display change
+                    log_info(L"User wants to revert the last display change");
+                    revert_display_changes(ctx);
+                    break;
             }
 
-            if ((NOTIF_MENU_CONFIG_SELECT & selection) == NOTIF_MENU_CONFIG_SELECT) {
-                // Config selected
-                int config_idx = selection & NOTIF_MENU_CONFIG_INDEX;
-                display_preset_t *preset = ctx->config.presets[config_idx];
-                log_debug(L"User wants to apply preset %d (\"%s\")", config_idx, preset->name);
-                // Apply preset
-                apply_preset(ctx, preset);
+            if (selection >= NOTIF_MENU_DYNAMIC_BASE) {
+                dispatch_menu_action(ctx, selection);
             }
 
             break;
@@ -298,29 +574,79 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
         case WM_DISPLAYCHANGE:;
             // Display settings have changed
             log_debug(L"WM_DISPLAYCHANGE: Display settings have changed");
+            trace_write(&(ctx->trace), TRACE_EVENT_DISPLAY_CHANGE, NULL, 0, NULL, 0);
+            metric_inc(METRIC_DISPLAY_CHANGES);
+            if (ctx->settle_start != 0) {
+                // Caused by our own change, it has settled once the notifications stop
+                ctx->settle_last = latency_now();
+                SetTimer(hwnd, TIMER_SETTLE, DISPLAY_CHANGE_DEBOUNCE_MS, NULL);
+            }
             if (ctx->display_update_in_progress) {
                 // Display update in progress
                 log_warning(L"Display update in progress, not reloading");
                 break;
             }
-            log_debug(L"Reloading information and config");
-            ctx->display_update_in_progress = TRUE;
-            populate_display_data(ctx);
-            create_tray_menu(ctx);
-            // Reload config to check for applicable presets
-            reload(ctx);
-            ctx->display_update_in_progress = FALSE;
+            // Connecting a dock sends several changes, refresh once they have settled
+            SetTimer(hwnd, TIMER_DISPLAY_CHANGE, DISPLAY_CHANGE_DEBOUNCE_MS, NULL);
+            break;
+
+        case WM_HOTKEY:;
+            // A registered global hotkey was pressed
+            size_t hotkey_idx = (size_t) wparam - HOTKEY_ID_BASE;
+            if (hotkey_idx >= ctx->config->hotkey_count) {
+                log_warning(L"Got unknown hotkey ID %d", (int) wparam);
+                break;
+            }
+            hotkey_t *hotkey = &(ctx->config->hotkeys[hotkey_idx]);
+            log_debug(L"Hotkey \"%s\" pressed", hotkey->keys);
+            note_activity(ctx);
+            metric_inc(METRIC_HOTKEYS);
+            if (hotkey->action == HOTKEY_ACTION_APPLY_PRESET) {
+                if (hotkey->preset_idx < 0) {
+                    show_notification_message(ctx, L"Preset \"%s\" does not exist", hotkey->preset_name);
+                    break;
+                }
+                // Same lookup as IPC, the rules and the command line
+                display_preset_t *hotkey_preset = first_applicable_preset(ctx, hotkey->preset_idx);
+                if (hotkey_preset == NULL) {
+                    log_warning(L"Preset \"%s\" is not applicable", hotkey->preset_name);
+                    show_notification_message(ctx, L"Preset \"%s\" is not applicable", hotkey->preset_name);
+                    break;
+                }
+                apply_preset(ctx, hotkey_preset);
+            } else if (hotkey->action == HOTKEY_ACTION_SHOW_LAUNCHER && ctx->headless) {
+                log_warning(L"No preset launcher in headless mode");
+            } else if (hotkey->action == HOTKEY_ACTION_SHOW_LAUNCHER) {
+                run_deferred_init(ctx);
+                show_launcher_window(ctx);
+            } else if (hotkey->action == HOTKEY_ACTION_REVERT) {
+                revert_display_changes(ctx);
+            }
             break;
 
         case WM_COPYDATA:;
             // Handle copydata
             COPYDATASTRUCT *copydata = (COPYDATASTRUCT *) lparam;
+            note_activity(ctx);
+            metric_inc(METRIC_IPC_REQUESTS);
+            DWORD ipc_type = (DWORD) copydata->dwData;
+            trace_write(&(ctx->trace), TRACE_EVENT_COPYDATA, &ipc_type, sizeof(DWORD), copydata->lpData,
+                        copydata->cbData);
             if (copydata->dwData == IPC_APPLY_PRESET) {
                 // Change preset
                 ipc_preset_change_request *req = (ipc_preset_change_request *) copydata->lpData;
                 log_info(L"Got preset change request, requested preset: \"%s\"", req->preset_name);
 
                 apply_preset_by_name(ctx, req->preset_name);
+            } else if (copydata->dwData == IPC_REVERT) {
+                // Revert the last display change
+                log_info(L"Got revert request");
+                revert_display_changes(ctx);
+            } else if (copydata->dwData == IPC_METRICS && copydata->cbData >= sizeof(ipc_metrics_request)) {
+                // Send the metrics back to the requesting process
+                log_debug(L"Got metrics request");
+                ipc_metrics_request *req = (ipc_metrics_request *) copydata->lpData;
+                send_metrics_reply((HWND) (UINT_PTR) req->reply_hwnd);
             }
             break;
 
@@ -338,9 +664,82 @@ static LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARA
                                MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
                     DestroyWindow(ctx->main_window_hwnd);
                 }
+            } else if (wparam == TIMER_DISPLAY_CHANGE) {
+                KillTimer(hwnd, TIMER_DISPLAY_CHANGE);
+                if (ctx->display_update_in_progress) {
+                    // Display update in progress
+                    log_warning(L"Display update in progress, not reloading");
+                    metric_inc(METRIC_DROPPED_UPDATES);
+                    break;
+                }
+                log_debug(L"Reloading information and config");
+                ctx->display_update_in_progress = TRUE;
+                // Reload display data and config to check for applicable presets
+                reload(ctx);
+                // The help text position depends on the primary monitor position
+                free_align_pattern_cache(ctx);
+                ctx->display_update_in_progress = FALSE;
+                // Apply the preset of a matching rule if the displays have changed
+                apply_matching_rule(ctx);
+            } else if (wparam == TIMER_SETTLE) {
+                // No display change notifications for a while, the last change has settled
+                KillTimer(hwnd, TIMER_SETTLE);
+                if (ctx->settle_last > ctx->settle_start) {
+                    metric_record(METRIC_SETTLE, ctx->settle_start, ctx->settle_last);
+                }
+                ctx->settle_start = 0;
+                ctx->settle_last = 0;
+            } else if (wparam == TIMER_CONFIG_CHANGE) {
+                // The config file has been written
+                KillTimer(hwnd, TIMER_CONFIG_CHANGE);
+                reload_changed_config(ctx);
+            } else if (wparam == TIMER_IDLE) {
+                // Nothing has happened for a while
+                enter_idle_mode(ctx);
+            } else if (wparam == TIMER_AUTO_REVERT) {
+                // The display change wasn't confirmed in time
+                log_info(L"Display change wasn't confirmed, reverting");
+                revert_display_changes(ctx);
             }
             break;
 
+        case MSG_CONFIRM_CHANGE:;
+            // Ask the user to keep the new display settings
+            if (!ctx->auto_revert_pending) {
+                break;
+            }
+            wchar_t confirm_msg[200];
+            StringCbPrintf(confirm_msg, sizeof(confirm_msg),
+                           L"Keep these display settings?\nThe previous settings will be restored in %d seconds.",
+                           ctx->config->auto_revert_seconds);
+            ctx->confirm_box_open = TRUE;
+            int confirm_res =
+                MessageBox(hwnd, confirm_msg, APP_NAME, MB_OKCANCEL | MB_ICONQUESTION | MB_SETFOREGROUND | MB_TOPMOST);
+            ctx->confirm_box_open = FALSE;
+            if (!ctx->auto_revert_pending) {
+                // Already reverted
+                break;
+            }
+            if (confirm_res == IDOK) {
+                log_info(L"User kept the display change");
+                KillTimer(hwnd, TIMER_AUTO_REVERT);
+                ctx->auto_revert_pending = FALSE;
+            } else {
+                log_info(L"User wants to revert the display change");
+                revert_display_changes(ctx);
+            }
+            break;
+
+        case MSG_DEFERRED_INIT:
+            // The message loop is running, finish the non-critical initialization
+            run_deferred_init(ctx);
+            break;
+
+        case MSG_MONITOR_NAMES:
+            // A background pass has verified the friendly names of the monitors
+            apply_monitor_names(ctx, (monitor_names_result_t *) lparam);
+            break;
+
         default:
             return DefWindowProc(hwnd, umsg, wparam, lparam);
     }
@@ -364,24 +763,20 @@ HWND init_main_window(app_ctx_t *ctx) {
         int err = GetLastError();
         wchar_t *err_msg;
         get_error_msg(err, &err_msg);
-        log_error(L"RegisterClassEx failed: %s (0x%08X)", err_msg, err);
-        wchar_t err_str[200];
-        StringCbPrintf(err_str, 200, L"RegisterClassEx failed: %s (0x%08X)", err_msg, err);
-        MessageBox(NULL, (LPCWSTR) err_str, APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+        show_error_message(ctx, L"RegisterClassEx failed: %s (0x%08X)", err_msg, err);
         LocalFree(err_msg);
         return NULL;
     }
 
+    // Even a headless instance needs a hidden top-level window, message-only windows don't get WM_DISPLAYCHANGE
+    // and can't be found by the IPC clients
     HWND hwnd = CreateWindow(MAIN_WND_CLASS, APP_NAME, WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, 500, 100,
                              NULL, NULL, h_inst, NULL);
     if (!hwnd) {
         int err = GetLastError();
         wchar_t *err_msg;
         get_error_msg(err, &err_msg);
-        log_error(L"CreateWindow failed: %s (0x%08X)", err_msg, err);
-        wchar_t err_str[200];
-        StringCbPrintf(err_str, 200, L"CreateWindowW failed: %s (0x%08X)", err_msg, err);
-        MessageBox(NULL, (LPCWSTR) err_str, APP_NAME, MB_OK | MB_ICONERROR | MB_SETFOREGROUND);
+        show_error_message(ctx, L"CreateWindow failed: %s (0x%08X)", err_msg, err);
         LocalFree(err_msg);
         return NULL;
     }
@@ -399,17 +794,43 @@ HWND init_main_window(app_ctx_t *ctx) {
     return hwnd;
 }
 
-static LRESULT CALLBACK virt_desktop_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    // Get window pointer that points to the app context
-    app_ctx_t *ctx = (app_ctx_t *) GetWindowLongPtr(hwnd, GWLP_USERDATA);
+void free_align_pattern_cache(app_ctx_t *ctx) {
+    if (ctx->align_pattern_bitmap != NULL) {
+        DeleteObject(ctx->align_pattern_bitmap);
+        ctx->align_pattern_bitmap = NULL;
+    }
+    ZeroMemory(&(ctx->align_pattern_surface), sizeof(pattern_surface_t));
+}
 
-    PAINTSTRUCT ps;
-    HDC hdc;
+void release_ui_caches(app_ctx_t *ctx) {
+    // Release the GDI and USER objects that are rebuilt when they are needed
+    free_align_pattern_cache(ctx);
+    if (ctx->align_pattern_font != NULL) {
+        DeleteObject(ctx->align_pattern_font);
+        ctx->align_pattern_font = NULL;
+    }
+    // The model stays, the menu is materialized from it when it is opened
+    if (ctx->notif_menu != NULL) {
+        DestroyMenu(ctx->notif_menu);
+        ctx->notif_menu = NULL;
+    }
+    free(ctx->menu_actions.actions);
+    ZeroMemory(&(ctx->menu_actions), sizeof(menu_action_table_t));
+}
 
-    RECT r;
-    HBRUSH brush = GetStockBrush(DC_BRUSH);
-    int cur_color = 0;
-    int row_first_color = 0;
+static void render_align_pattern(app_ctx_t *ctx, HWND hwnd, HDC mem_dc) {
+    // Rasterize the pattern and the help text into the cached bitmap
+    uint32_t colors[sizeof(align_pattern_colors) / sizeof(COLORREF)];
+    for (size_t i = 0; i < align_pattern_color_count; i++) {
+        // DIB pixels are 0x00RRGGBB, COLORREF is 0x00BBGGRR
+        COLORREF c = align_pattern_colors[i];
+        colors[i] = ((uint32_t) GetRValue(c) << 16) | ((uint32_t) GetGValue(c) << 8) | GetBValue(c);
+    }
+    pattern_surface_t *surface = &(ctx->align_pattern_surface);
+    pattern_fill(surface, 0, 0, surface->width, surface->height, PATTERN_TILE_SIZE, colors,
+                 align_pattern_color_count);
+    // GDI must finish with the bitmap before it is written directly and vice versa
+    GdiFlush();
 
     // Get the primary monitor top left coordinates
     POINT text_pos = {0};
@@ -426,33 +847,87 @@ static LRESULT CALLBACK virt_desktop_wnd_proc(HWND hwnd, UINT umsg, WPARAM wpara
 
     RECT text_rect;
     SetRect(&text_rect, text_pos.x + 10, text_pos.y + 10, text_pos.x + 10 + 500, text_pos.y + 10 + 100);
+    if (ctx->align_pattern_font == NULL) {
+        // Use 32em Arial in the align pattern window help text
+        ctx->align_pattern_font =
+            CreateFont(32, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, ANSI_CHARSET, OUT_TT_ONLY_PRECIS,
+                       CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Arial");
+    }
+    HGDIOBJ old_font = SelectObject(mem_dc, ctx->align_pattern_font);
+    DrawText(mem_dc, L"Press any key to close", -1, &text_rect, DT_LEFT);
+    SelectObject(mem_dc, old_font);
+}
+
+static BOOL prepare_align_pattern(app_ctx_t *ctx, HWND hwnd, HDC hdc) {
+    // Make sure the cached bitmap matches the window size, rasterize it again if it doesn't
+    RECT client;
+    GetClientRect(hwnd, &client);
+    int width = client.right - client.left;
+    int height = client.bottom - client.top;
+    pattern_surface_t *surface = &(ctx->align_pattern_surface);
+    if (ctx->align_pattern_bitmap != NULL && surface->width == width && surface->height == height) {
+        return TRUE;
+    }
+    free_align_pattern_cache(ctx);
+    if (width <= 0 || height <= 0) {
+        return FALSE;
+    }
+
+    BITMAPINFO bmi = {0};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height; // Top-down
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    void *bits = NULL;
+    ctx->align_pattern_bitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (ctx->align_pattern_bitmap == NULL) {
+        log_error(L"Failed to create a %dx%d bitmap for the alignment pattern", width, height);
+        return FALSE;
+    }
+    surface->pixels = bits;
+    surface->stride = (size_t) width;
+    surface->width = width;
+    surface->height = height;
+
+    HDC mem_dc = CreateCompatibleDC(hdc);
+    HGDIOBJ old_bitmap = SelectObject(mem_dc, ctx->align_pattern_bitmap);
+    render_align_pattern(ctx, hwnd, mem_dc);
+    SelectObject(mem_dc, old_bitmap);
+    DeleteDC(mem_dc);
+    log_debug(L"Rasterized a %dx%d alignment pattern", width, height);
+    return TRUE;
+}
+
+static LRESULT CALLBACK virt_desktop_wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    // Get window pointer that points to the app context
+    app_ctx_t *ctx = (app_ctx_t *) GetWindowLongPtr(hwnd, GWLP_USERDATA);
+
+    PAINTSTRUCT ps;
+    HDC hdc;
 
     switch (umsg) {
         case WM_PAINT:;
             hdc = BeginPaint(hwnd, &ps);
 
-            SelectObject(hdc, ctx->align_pattern_font);
-
-            // Draw shifting color pattern
-            cur_color = -1;
-            for (int y = 0; y < ctx->display_virtual_size.height; y += 100) {
-                for (int x = 0; x < ctx->display_virtual_size.width; x += 100) {
-                    if (x == 0) {
-                        cur_color = (row_first_color + 1) % align_pattern_color_count;
-                        row_first_color = cur_color;
-                    }
-                    SetDCBrushColor(hdc, align_pattern_colors[cur_color]);
-                    SetRect(&r, x, y, x + 100, y + 100);
-                    FillRect(hdc, &r, brush);
-                    cur_color = (cur_color + 1) % align_pattern_color_count;
-                }
+            if (prepare_align_pattern(ctx, hwnd, hdc)) {
+                // Only copy the invalidated part of the cached pattern
+                HDC mem_dc = CreateCompatibleDC(hdc);
+                HGDIOBJ old_bitmap = SelectObject(mem_dc, ctx->align_pattern_bitmap);
+                BitBlt(hdc, ps.rcPaint.left, ps.rcPaint.top, ps.rcPaint.right - ps.rcPaint.left,
+                       ps.rcPaint.bottom - ps.rcPaint.top, mem_dc, ps.rcPaint.left, ps.rcPaint.top, SRCCOPY);
+                SelectObject(mem_dc, old_bitmap);
+                DeleteDC(mem_dc);
             }
 
-            DrawText(hdc, L"Press any key to close", -1, &text_rect, DT_LEFT);
-
             EndPaint(hwnd, &ps);
             break;
 
+        case WM_ERASEBKGND:
+            // The pattern covers the whole window
+            return 1;
+
         case WM_KEYDOWN:
         case WM_SYSKEYDOWN:
         case WM_LBUTTONDOWN:
@@ -474,7 +949,7 @@ int init_virt_desktop_window(app_ctx_t *ctx) {
 
     WNDCLASSEX wcex = {0};
     wcex.cbSize = sizeof(WNDCLASSEX);
-    wcex.style = CS_HREDRAW | CS_VREDRAW | CS_NOCLOSE;
+    wcex.style = CS_NOCLOSE;
     wcex.lpfnWndProc = virt_desktop_wnd_proc;
     wcex.hInstance = h_inst;
     wcex.hIcon = NULL;
@@ -494,10 +969,6 @@ int init_virt_desktop_window(app_ctx_t *ctx) {
         return 1;
     }
 
-    // Use 32em Arial in the align pattern window help text
-    ctx->align_pattern_font = CreateFont(32, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, ANSI_CHARSET, OUT_TT_ONLY_PRECIS,
-                                         CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Arial");
-
     return 0;
 }
 
@@ -571,3 +1042,53 @@ int create_tray_icon(app_ctx_t *ctx) {
     Shell_NotifyIcon(NIM_SETVERSION, &nid);
     return 0;
 }
+
+void run_deferred_init(app_ctx_t *ctx) {
+    // Initialization that isn't needed for a usable tray icon
+    // Runs once the message loop has started or when something needs it earlier
+    if (ctx->deferred_init_done) {
+        return;
+    }
+    ctx->deferred_init_done = TRUE;
+
+    if (!ctx->headless) {
+        init_virt_desktop_window(ctx);
+        stage_timer_log(&(ctx->startup_timer), L"alignment pattern window");
+        init_launcher_window(ctx);
+        stage_timer_log(&(ctx->startup_timer), L"launcher window");
+    }
+    compile_applicable_presets(ctx);
+    stage_timer_log(&(ctx->startup_timer), L"apply plans");
+    watch_config_file(ctx);
+    stage_timer_log(&(ctx->startup_timer), L"config watch");
+    log_info(L"Deferred initialization done");
+    log_memory_usage(L"after startup");
+    // Start counting down to the idle mode
+    note_activity(ctx);
+}
+
+void register_hotkeys(app_ctx_t *ctx) {
+    // Register the hotkeys defined in the config
+    // The hotkey ID is the index of the hotkey in the config, offset by HOTKEY_ID_BASE
+    for (size_t i = 0; i < ctx->config->hotkey_count; i++) {
+        hotkey_t *hotkey = &(ctx->config->hotkeys[i]);
+        if (!RegisterHotKey(ctx->main_window_hwnd, HOTKEY_ID_BASE + i, hotkey->modifiers, hotkey->vk)) {
+            int err = GetLastError();
+            wchar_t *err_msg;
+            get_error_msg(err, &err_msg);
+            log_warning(L"Failed to register hotkey \"%s\": %s (0x%08X)", hotkey->keys, err_msg, err);
+            LocalFree(err_msg);
+        } else {
+            log_debug(L"Registered hotkey \"%s\"", hotkey->keys);
+        }
+    }
+    ctx->registered_hotkey_count = ctx->config->hotkey_count;
+}
+
+void unregister_hotkeys(app_ctx_t *ctx) {
+    // Unregistering IDs that failed to register is harmless
+    for (size_t i = 0; i < ctx->registered_hotkey_count; i++) {
+        UnregisterHotKey(ctx->main_window_hwnd, HOTKEY_ID_BASE + i);
+    }
+    ctx->registered_hotkey_count = 0;
+}
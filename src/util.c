@@ -17,6 +17,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #define UNICODE
+#include <errno.h>
+#include <stdlib.h>
 #include "log.h"
 #include "util.h"
 
@@ -33,4 +35,81 @@ void get_error_msg(const int err_code, wchar_t **out_msg) {
             *newline_pos = '\0';
         }
     }
-}
\ No newline at end of file
+}
+UINT64 hash_fnv1a64(UINT64 hash, const void *data, size_t size) {
+    const BYTE *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+UINT64 hash_mix64(UINT64 hash) {
+    // Finalizer of MurmurHash3, spreads the bits so that summed hashes don't cancel out
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+UINT64 hash_display_set_add(UINT64 set_hash, const wchar_t *device_path) {
+    // Adding is order independent, so the same displays always give the same hash
+    UINT64 hash = hash_fnv1a64(HASH_FNV1A64_INIT, device_path, (wcslen(device_path) + 1) * sizeof(wchar_t));
+    return set_hash + hash_mix64(hash);
+}
+
+wchar_t *mbstowcsdup(const char *src, size_t *dest_sz) {
+    int wbuf_size = mbstowcs(NULL, src, 0);
+    if (wbuf_size < 0) {
+        // TODO: Return NULL instead?
+        log_error(L"wbuf_size query failed");
+        abort();
+    }
+    // Allocate memory
+    // TODO: Don't trust the src size (user controllable)
+    wchar_t *tmp;
+    tmp = calloc(wbuf_size + 1, sizeof(wchar_t));
+    if (mbstowcs(tmp, src, wbuf_size + 1) <= 0) {
+        // TODO: Return NULL instead?
+        log_error(L"mbstowcs failed");
+        abort();
+    }
+    if (dest_sz != NULL) {
+        *dest_sz = wbuf_size;
+    }
+    return tmp;
+}
+
+const char *wcstombs_alloc(const wchar_t *src, size_t *dest_sz) {
+    // Convert (wchar_t *) name to (char *)
+    size_t converted_count = 0;
+    size_t src_sz = wcslen(src) + 1;
+    size_t result_sz = (src_sz * sizeof(char)) * 2; // Each multibyte character is two bytes
+    char *result = calloc(src_sz, result_sz);
+    if (wcstombs_s(&converted_count, result, result_sz, src, _TRUNCATE) != 0) {
+        log_error(L"wcstombs_s failed: 0x%04X", errno);
+        abort();
+    }
+    if (dest_sz != NULL) {
+        *dest_sz = converted_count;
+    }
+    return result;
+}
+
+void stage_timer_start(stage_timer_t *timer) {
+    QueryPerformanceFrequency(&(timer->frequency));
+    QueryPerformanceCounter(&(timer->start));
+    timer->last = timer->start;
+}
+
+void stage_timer_log(stage_timer_t *timer, const wchar_t *stage) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    double stage_ms = (double) (now.QuadPart - timer->last.QuadPart) * 1000.0 / (double) timer->frequency.QuadPart;
+    double total_ms = (double) (now.QuadPart - timer->start.QuadPart) * 1000.0 / (double) timer->frequency.QuadPart;
+    log_info(L"Stage \"%s\" took %.2f ms (%.2f ms total)", stage, stage_ms, total_ms);
+    timer->last = now;
+}
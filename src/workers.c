@@ -0,0 +1,84 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define UNICODE
+#include <stdlib.h>
+#include "workers.h"
+#include "log.h"
+
+typedef struct {
+    parallel_task_t task;
+    void *data;
+    volatile LONG next_idx;
+} parallel_job_t;
+
+static VOID CALLBACK parallel_work_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    // Each submission runs exactly one index
+    parallel_job_t *job = (parallel_job_t *) context;
+    size_t idx = (size_t) (InterlockedIncrement(&(job->next_idx)) - 1);
+    job->task(job->data, idx);
+}
+
+void parallel_for(size_t count, parallel_task_t task, void *data) {
+    if (count <= 1) {
+        // Not worth a round trip through the pool
+        for (size_t i = 0; i < count; i++) {
+            task(data, i);
+        }
+        return;
+    }
+
+    parallel_job_t job = {.task = task, .data = data, .next_idx = 0};
+    PTP_WORK work = CreateThreadpoolWork(parallel_work_callback, &job, NULL);
+    if (work == NULL) {
+        log_warning(L"CreateThreadpoolWork failed (0x%08X), running the tasks serially", GetLastError());
+        for (size_t i = 0; i < count; i++) {
+            task(data, i);
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        SubmitThreadpoolWork(work);
+    }
+    WaitForThreadpoolWorkCallbacks(work, FALSE);
+    CloseThreadpoolWork(work);
+}
+
+typedef struct {
+    background_task_t task;
+    void *data;
+} background_job_t;
+
+static VOID CALLBACK background_callback(PTP_CALLBACK_INSTANCE instance, PVOID context) {
+    background_job_t *job = (background_job_t *) context;
+    job->task(job->data);
+    free(job);
+}
+
+BOOL run_in_background(background_task_t task, void *data) {
+    background_job_t *job = malloc(sizeof(background_job_t));
+    job->task = task;
+    job->data = data;
+    if (!TrySubmitThreadpoolCallback(background_callback, job, NULL)) {
+        log_warning(L"TrySubmitThreadpoolCallback failed (0x%08X)", GetLastError());
+        free(job);
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,105 @@
+/*
+disp - Simple display settings manager for Windows 7+
+Copyright (C) 2019-2020 Mark "zini" Mäkinen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Standalone check of the alignment pattern kernel against a per-pixel reference, built with the host compiler
+// by "make pattern-check". The kernel doesn't depend on Windows so this runs on any platform.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pattern.h"
+
+#define CHECK_ROUNDS 2000
+#define CHECK_MAX_SIZE 700
+#define BENCH_WIDTH 11520
+#define BENCH_HEIGHT 2160
+#define BENCH_ROUNDS 10
+#define BACKGROUND 0xDEADBEEF
+
+static const uint32_t colors[] = {0x00FF0000, 0x0000FF00, 0x000000FF, 0x00FFFF00, 0x0000FFFF};
+#define COLOR_COUNT (sizeof(colors) / sizeof(colors[0]))
+
+static uint32_t reference_pixel(int px, int py, int x, int y, int width, int height, int tile_size,
+                                size_t color_count) {
+    // What the old per-tile FillRect painting gave for a pixel
+    if (px < x || px >= x + width || py < y || py >= y + height) {
+        return BACKGROUND;
+    }
+    return colors[(size_t) (py / tile_size + 1 + px / tile_size) % color_count];
+}
+
+static int check_round(uint32_t *pixels, int surface_width, int surface_height) {
+    // Random rectangle, possibly partly outside of the surface, with a random tile size and color count
+    pattern_surface_t surface = {pixels, (size_t) surface_width + rand() % 8, surface_width, surface_height};
+    size_t pixel_count = surface.stride * (size_t) surface_height;
+    for (size_t i = 0; i < pixel_count; i++) {
+        pixels[i] = BACKGROUND;
+    }
+    int x = rand() % (surface_width + 64) - 32;
+    int y = rand() % (surface_height + 64) - 32;
+    int width = rand() % surface_width;
+    int height = rand() % surface_height;
+    int tile_size = 1 + rand() % 150;
+    size_t color_count = 1 + (size_t) rand() % COLOR_COUNT;
+    pattern_fill(&surface, x, y, width, height, tile_size, colors, color_count);
+
+    // Clip the reference like the kernel, the stride padding must stay untouched
+    for (int py = 0; py < surface_height; py++) {
+        for (size_t px = 0; px < surface.stride; px++) {
+            uint32_t expected = px < (size_t) surface_width
+                                    ? reference_pixel((int) px, py, x, y, width, height, tile_size, color_count)
+                                    : BACKGROUND;
+            uint32_t actual = pixels[(size_t) py * surface.stride + px];
+            if (actual != expected) {
+                printf("Mismatch at (%d, %d) for rect %d,%d %dx%d, tile %d, %u colors: 0x%08X != 0x%08X\n",
+                       (int) px, py, x, y, width, height, tile_size, (unsigned) color_count, (unsigned) actual,
+                       (unsigned) expected);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    srand(1);
+    uint32_t *pixels = malloc((size_t) (CHECK_MAX_SIZE + 8) * CHECK_MAX_SIZE * sizeof(uint32_t));
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        int width = 1 + rand() % CHECK_MAX_SIZE;
+        int height = 1 + rand() % CHECK_MAX_SIZE;
+        if (!check_round(pixels, width, height)) {
+            free(pixels);
+            return 1;
+        }
+    }
+    free(pixels);
+    printf("%d random fills match the reference\n", CHECK_ROUNDS);
+
+    // Time a desktop of six 4K-wide displays, the first round includes the page faults of the fresh buffer
+    pattern_surface_t surface = {malloc((size_t) BENCH_WIDTH * BENCH_HEIGHT * sizeof(uint32_t)), BENCH_WIDTH,
+                                 BENCH_WIDTH, BENCH_HEIGHT};
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        clock_t start = clock();
+        pattern_fill(&surface, 0, 0, BENCH_WIDTH, BENCH_HEIGHT, PATTERN_TILE_SIZE, colors, COLOR_COUNT);
+        double ms = (double) (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+        printf("%dx%d fill %d: %.2f ms\n", BENCH_WIDTH, BENCH_HEIGHT, round + 1, ms);
+    }
+    free(surface.pixels);
+    return 0;
+}